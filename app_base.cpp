@@ -1,8 +1,10 @@
 #include "app_base.h"
 #include "ral_proto.h"
 #include "socket.hpp"
+#include <algorithm>
 #include <array>
 #include <iostream>
+#include <string>
 
 void AppBase::discard_udp_message()
 {
@@ -12,6 +14,8 @@ void AppBase::discard_udp_message()
 	switch(Proto::OpCode(opcode[0]))
 	{
 	case Proto::OpCode::NOP:
+	case Proto::OpCode::PING: // The other side established the channel first
+	case Proto::OpCode::PONG:
 		return;
 	case Proto::OpCode::MESSAGE:
 		{
@@ -35,6 +39,9 @@ void AppBase::discard_udp_message()
 
 void AppBase::establish_udp_connection()
 {
+	// Read directly from now on : the backend must stop receiving the channel of the last tunnel
+	unwatch(m_udp_proto_conn);
+	m_poller->sync();
 
 	std::array<Proto::OpCode, 1> init_msg = {Proto::OpCode::NOP};
 
@@ -76,31 +83,107 @@ void AppBase::establish_udp_connection()
 	}
 }
 
-void AppBase::process_udp_message()
+bool AppBase::process_udp_message()
 {
-	m_message_buffer.resize(m_message_buffer.capacity());
-	CHECK_RET(m_udp_proto_conn.Recv(m_message_buffer, MSG_WAITALL))
+	auto n = m_udp_in.recv(m_udp_proto_conn, m_udp_in.capacity());
 
-	switch(Proto::OpCode(m_message_buffer[0]))
+	if(n < 0 && would_block())
+		return false;
+
+	CHECK_RET(n >= 0)
+
+	for(int i = 0; i != n; ++i)
+	{
+		auto msg = m_udp_in.data(i);
+		auto size = m_udp_in.size(i);
+
+		// Datagrams coalesced by the kernel, all of the segment size but the last one
+		size_t seg = std::max<size_t>(m_udp_in.segment(i), 1);
+		for(size_t off = 0; off < size; off += seg)
+			process_udp_datagram(msg + off, std::min(seg, size - off));
+	}
+
+	m_udp_out.flush();
+
+	// A smaller batch drained the socket
+	return size_t(n) == m_udp_in.depth();
+}
+
+void AppBase::check_udp_channel(const Poller::Event & ev)
+{
+	if(!(ev.ready & Poller::DATA))
+	{
+		while(process_udp_message());
+		return;
+	}
+
+	// Received by the backend a datagram at a time : the next ones of this iteration are forwarded in the same batch
+	auto & events = m_poller->events();
+	for(auto next = &ev;; next = &events[m_next_event++])
+	{
+		if(next->size)
+			process_udp_datagram(next->data, next->size);
+
+		if(m_next_event == events.size() || events[m_next_event].tag != ev.tag || !(events[m_next_event].ready & Poller::DATA))
+			break;
+	}
+
+	m_udp_out.flush();
+}
+
+void AppBase::process_udp_datagram(unsigned char * msg, size_t size)
+{
+	switch(Proto::OpCode(msg[0]))
 	{
 	case Proto::OpCode::NOP:
 		return;
 	case Proto::OpCode::MESSAGE:
 		{
-			uint16_t bridge = DECODE_UINT16(m_message_buffer.data() + 1);
-			uint32_t len = DECODE_UINT32(m_message_buffer.data() + 3);
+			// Any datagram may reach the channel : a header beyond its segment, or an unknown bridge, drops it
+			constexpr size_t header_size = Proto::udp_message_header_size - 1;
+			if(size < header_size)
+				return;
+
+			uint16_t bridge = DECODE_UINT16(msg + 1);
+			uint32_t len = DECODE_UINT32(msg + 3);
+
+			if(len > size - header_size || bridge >= m_udp_sockets.size())
+			{
+				LOG("Malformed UDP message, bridge " << bridge << ", size " << len << std::endl);
+				return;
+			}
+
+			if(m_udp_sockets[bridge].addr.empty())
+				return; // Endpoint not resolved yet
 
-			m_udp_sockets[bridge].sck.Sendto_raw(m_message_buffer.data() + 7, len, m_udp_sockets[bridge].addr);
+			count_udp_in(bridge, len);
+			m_udp_out.add(m_udp_sockets[bridge].sck, msg + header_size, len, m_udp_sockets[bridge].addr);
 			return;
 		}
 	case Proto::OpCode::UDP_CONNECTED:
 		m_udp_established = true;
 		if(m_udp_est_resend)
-			CHECK_RET(m_udp_proto_conn.Sendto(m_message_buffer, m_proto_udp_address))
+			m_udp_proto_conn.Sendto_raw(msg, size, m_proto_udp_address);
 
 		m_udp_est_resend = !m_udp_est_resend;
 		return;
 
+	case Proto::OpCode::PING:
+		{
+			if(size < Proto::ping_size)
+				return;
+
+			std::array<unsigned char, Proto::pong_size> pong;
+			make_pong(msg, pong.data());
+			m_udp_proto_conn.Sendto(pong, m_proto_udp_address);
+			update_udp_ka();
+			return;
+		}
+	case Proto::OpCode::PONG:
+		if(size >= Proto::pong_size)
+			receive_pong(m_udp_rtt, msg);
+		return;
+
 	case Proto::OpCode::CONFIG:
 	case Proto::OpCode::CONNECT:
 	default:
@@ -108,112 +191,195 @@ void AppBase::process_udp_message()
 	}
 }
 
-void AppBase::process_bypassed_message()
+void AppBase::process_bypassed_message(const unsigned char * msg)
 {
-	std::array<unsigned char, 6> buf;
-	CHECK_RET(m_tcp_proto_conn.Recv(buf, MSG_WAITALL))
-
-	uint16_t bridge = DECODE_UINT16(buf.data());
-	uint32_t len = DECODE_UINT32(buf.data() + 2);
-
-	m_message_buffer.resize(len);
+	uint16_t bridge = DECODE_UINT16(msg);
+	uint32_t len = DECODE_UINT32(msg + 2);
 
 	LOG("Processing bypassed udp with size " << len << std::endl)
 
-	m_tcp_proto_conn.Recv(m_message_buffer, MSG_WAITALL);
+	// The size was bounded by the reader
+	if(bridge >= m_udp_sockets.size())
+		throw NetworkError("Unknown UDP bridge on TCP");
 
-	m_udp_sockets[bridge].sck.Sendto(m_message_buffer, m_udp_sockets[bridge].addr);
+	if(m_udp_sockets[bridge].addr.empty())
+		return; // Endpoint not resolved yet
+
+	count_udp_in(bridge, len);
+	m_udp_sockets[bridge].sck.Sendto_raw(msg + 6, len, m_udp_sockets[bridge].addr);
 }
 
-void AppBase::send_udp(uint16_t bridge, uint32_t size)
+void AppBase::send_udp(uint16_t bridge, unsigned char * payload, uint32_t size)
 {
-	m_message_buffer.resize(size + Proto::udp_message_header_size);
+	unsigned char * msg = payload - Proto::udp_message_header_size;
+
+	ENCODE_UINT16(bridge, msg + 2)
+	ENCODE_UINT32(size, msg + 4)
 
-	ENCODE_UINT16(bridge, m_message_buffer.data() + 2)
-	ENCODE_UINT32(size, m_message_buffer.data() + 4)
+	count_udp_out(bridge, size);
 
 	if(m_bypass_udp)
 	{
-		m_message_buffer[1] = (unsigned char)(Proto::Protocol::UDP);
-		m_message_buffer[0] = (unsigned char)(Proto::OpCode::MESSAGE);
+		msg[1] = (unsigned char)(Proto::Protocol::UDP);
+		msg[0] = (unsigned char)(Proto::OpCode::MESSAGE);
 
-		m_tcp_proto_conn.Send(m_message_buffer);
+		send_frame(0, msg, size + Proto::udp_message_header_size);
 	}
 	else
 	{
-		m_message_buffer[1] = (unsigned char)(Proto::OpCode::MESSAGE);
+		msg[1] = (unsigned char)(Proto::OpCode::MESSAGE);
 
-		m_udp_proto_conn.Sendto_raw(m_message_buffer.data() + 1, m_message_buffer.size() - 1, m_proto_udp_address);
+		m_udp_out.add(m_udp_proto_conn, msg + 1, size + Proto::udp_message_header_size - 1, m_proto_udp_address, m_udp_gso);
 	}
 
 	update_udp_ka();
 }
 
-bool AppBase::check_conn_pfd(std::vector<pollfd>::iterator iter_pfd)
+void AppBase::send_frame(size_t l, const void * frame, size_t size)
+{
+	auto & batch = m_batches[l];
+	auto now = std::chrono::steady_clock::now();
+
+	if(batch.data.empty())
+		batch.since = now;
+
+	auto data = reinterpret_cast<const unsigned char *>(frame);
+	batch.data.insert(batch.data.end(), data, data + size);
+
+	if(batch.data.size() >= batch_size || now - batch.since >= std::chrono::microseconds(m_options.batch_latency))
+		flush_lane(l);
+}
+
+void AppBase::flush_lane(size_t l)
+{
+	auto & batch = m_batches[l];
+
+	if(batch.data.empty() || batch.sending)
+		return;
+
+	bool sent;
+	if(m_options.zerocopy && batch.data.size() >= zerocopy_min_size)
+		sent = batch.zc.send(lane(l), batch.data);
+	else if(lane_reactor(l).send_batch(lane(l), batch.data))
 	{
-		auto conn = m_connections.find(key_sock_uni_t(iter_pfd->fd));
+		// Batched with the other submissions of the reactor. The credit of the connections bounds what waits meanwhile.
+		batch.sending = true;
+		return;
+	}
+	else
+		sent = lane(l).Send_all(batch.data.data(), batch.data.size(), MSG_NOSIGNAL);
 
-		while(iter_pfd->revents & pollmask)
-		{
-			Socket::recv_res_t recres;
+	// Lost as if closed on the read side : the main thread reestablishes the tunnel
+	if(!sent)
+	{
+		LOG("Send failed on lane " << l << std::endl);
+		request_reset();
+	}
 
-			if(iter_pfd->revents & POLLERR)
-			{
-				recres = 0;
-			}
-			else
-			{
-				// If poll gives hangup, we still need to receive last data
-				// So we process hangup here if recres is 0
+	batch.data.clear();
+}
 
-				m_message_buffer.resize(m_message_buffer.capacity());
-				
-				recres = conn->second.sck.Recv_raw(m_message_buffer.data() + Proto::tcp_message_header_size, m_message_buffer.size() - Proto::tcp_message_header_size, 0);
-				CHECK_RET(recres >= 0);
-			}
-			
-			if(recres == 0) // Connection loss
-			{
-				LOG("Connection " << conn->first.sk << ',' << conn->second.key << " Hung up." << std::endl);
-				if(disconnect_tcp<true>(conn))
-					return true;
+void AppBase::exchange_windows()
+{
+	std::array<unsigned char, 4> win;
 
-				// The iter_sck structure has changed. Update connection and poll again.
-				conn = m_connections.find(key_sock_uni_t(iter_pfd->fd));
-			}
-			else // Message
-			{
-				m_message_buffer.resize(recres + Proto::tcp_message_header_size);
+	ENCODE_UINT32(m_options.window, win)
+	CHECK_RET(m_tcp_proto_conn.Send(win))
+	CHECK_RET(m_tcp_proto_conn.Recv(win, MSG_WAITALL))
 
-				ENCODE_KEY(conn->second.key, &m_message_buffer[2])
-				ENCODE_KEY(conn->first.uk, &m_message_buffer[10])
+	m_peer_window = DECODE_UINT32(win);
 
-				ENCODE_UINT32(recres, &m_message_buffer[18])
+	std::cout << "Window : " << m_options.window << ", other side : " << m_peer_window << std::endl;
+}
 
-				if(m_bypass_udp)
-				{
-					m_message_buffer[1] = (unsigned char)(Proto::Protocol::TCP);
-					m_message_buffer[0] = (unsigned char)(Proto::OpCode::MESSAGE);
-					CHECK_RET(m_tcp_proto_conn.Send(m_message_buffer))
-				}
-				else
-				{
-					m_message_buffer[1] = (unsigned char)(Proto::OpCode::MESSAGE);
-					CHECK_RET(m_tcp_proto_conn.Send_raw(m_message_buffer.data() + 1, m_message_buffer.size() - 1));
-				}
-			}
+void AppBase::exchange_capabilities()
+{
+	unsigned char own = (unsigned char)(Proto::Capability::COMPRESSION) | (unsigned char)(Proto::Capability::COMPACT)
+		| (unsigned char)(Proto::Capability::EARLY) | (unsigned char)(Proto::Capability::PING);
+	if(m_options.resume)
+		own |= (unsigned char)(Proto::Capability::RESUME);
 
-			CHECK_RET(poll(&(*iter_pfd), 1, 0) >= 0)
-		}
+	std::array<unsigned char, 5> caps = {own};
+	ENCODE_UINT32(m_options.frame_payload, &caps[1])
 
-		return false;
+	CHECK_RET(m_tcp_proto_conn.Send(caps))
+	CHECK_RET(m_tcp_proto_conn.Recv(caps, MSG_WAITALL))
+
+	m_compression = caps[0] & (unsigned char)(Proto::Capability::COMPRESSION);
+
+	if(!m_compression)
+		std::cout << "The other side does not support compression." << std::endl;
+
+	m_compact = caps[0] & (unsigned char)(Proto::Capability::COMPACT);
+	std::cout << "Frame headers : " << (m_compact ? "compact" : "fixed") << std::endl;
+
+	m_early = caps[0] & (unsigned char)(Proto::Capability::EARLY);
+
+	if(!m_early)
+		std::cout << "The other side does not accept early data." << std::endl;
+
+	m_ping = caps[0] & (unsigned char)(Proto::Capability::PING);
+
+	if(!m_ping)
+		std::cout << "The other side does not answer pings : fixed keepalives and timeouts." << std::endl;
+
+	m_resume = m_options.resume && (caps[0] & (unsigned char)(Proto::Capability::RESUME));
+	std::cout << "Connections " << (m_resume ? "resumed" : "dropped") << " on reconnection." << std::endl;
+
+	size_t peer_payload = DECODE_UINT32(&caps[1]);
+	m_frame_payload = std::min(m_options.frame_payload, clamp_payload(peer_payload));
+
+	std::cout << "Frame payload : " << m_frame_payload << std::endl;
+}
+
+void AppBase::resume_session(bool first)
+{
+	std::vector<unsigned char> msg(4);
+	for(size_t r = 0; r != n_reactors(); ++r)
+	{
+		reactor(r).hold_events();
+		reactor(r).save_connections(msg);
+	}
+
+	uint32_t n = (msg.size() - 4) / resume_entry_size;
+	ENCODE_UINT32(n, msg)
+
+	if(first)
+		CHECK_RET(m_tcp_proto_conn.Send(msg))
+
+	std::array<unsigned char, 4> count;
+	CHECK_RET(m_tcp_proto_conn.Recv(count, MSG_WAITALL))
+
+	uint32_t peer_n = DECODE_UINT32(count);
+	CHECK_RET(peer_n <= max_resumed)
+
+	std::vector<unsigned char> states(size_t(peer_n) * resume_entry_size);
+	CHECK_RET(m_tcp_proto_conn.Recv(states, MSG_WAITALL))
+	CHECK_RET(states.size() == size_t(peer_n) * resume_entry_size)
+
+	if(!first)
+		CHECK_RET(m_tcp_proto_conn.Send(msg))
+
+	ResumeMap peer;
+	for(size_t i = 0; i != peer_n; ++i)
+	{
+		unsigned char * s = &states[i * resume_entry_size];
+		peer[DECODE_KEY(s)] = {DECODE_UINT32(s + 8), DECODE_UINT64(s + 12), DECODE_UINT64(s + 20)};
 	}
 
+	for(size_t r = 0; r != n_reactors(); ++r)
+		reactor(r).resume_connections(peer);
+
+	std::cout << "Session resumed, " << n << " connections here, " << peer_n << " on the other side." << std::endl;
+}
+
 void AppBase::create_udp_socket()
 {	
 	std::cout << "Creating UDP Socket ..." << std::endl;
-	CHECK_RET(m_udp_proto_conn.create(AF_INET, SOCK_DGRAM))
-	CHECK_RET(m_udp_proto_conn.bind(Address(AF_INET, SOCK_DGRAM, "0.0.0.0", 0)))
+	// Of the family of the address of the other side
+	int af = m_proto_udp_address.af();
+	CHECK_RET(m_udp_proto_conn.create(af, SOCK_DGRAM))
+	CHECK_RET(m_udp_proto_conn.bind(Address(af, SOCK_DGRAM, af == AF_INET6 ? "::" : "0.0.0.0", 0)))
 
 	auto [res, udp_plug_adr] = m_udp_proto_conn.getsockname();
 	CHECK_RET(res);
@@ -222,5 +388,166 @@ void AppBase::create_udp_socket()
 
 	std::cout << "UDP Socket created at port " << m_udp_port << '.' << std::endl;
 
-	m_pfds[1].fd = m_udp_proto_conn.socket();
+	if(m_options.udp_gso)
+	{
+		// Coalesced datagrams fill the larger slots of m_udp_in
+		m_udp_gso = enable_udp_gso(m_udp_proto_conn);
+		bool gro = enable_udp_gro(m_udp_proto_conn);
+		m_udp_in.set_gro(gro);
+
+		std::cout << "UDP segmentation offload " << (m_udp_gso ? "enabled" : "unavailable")
+			<< ", receive offload " << (gro ? "enabled" : "unavailable") << '.' << std::endl;
+	}
+}
+
+void AppBase::watch_udp_socket()
+{
+	unwatch(m_udp_proto_conn);
+	CHECK_RET(m_udp_proto_conn.set_nonblocking())
+	// The segment size of coalesced datagrams is only given by the reads of m_udp_in
+	watch(m_udp_proto_conn, Source::TUNNEL_UDP, 0, Poller::IN | (m_udp_in.gro() ? 0 : Poller::RECV));
+}
+
+void AppBase::open_metrics()
+{
+	Address adr(AF_INET, SOCK_STREAM, "127.0.0.1", m_options.metrics_port);
+
+	CHECK_RET(m_metrics_listener.create(AF_INET, SOCK_STREAM))
+	CHECK_RET(m_metrics_listener.set_reuseaddr())
+	CHECK_RET(m_metrics_listener.bind(adr))
+	CHECK_RET(m_metrics_listener.listen(16))
+	CHECK_RET(m_metrics_listener.set_nonblocking())
+
+	watch(m_metrics_listener, Source::METRICS, 0, Poller::IN);
+
+	std::cout << "Serving metrics at http://127.0.0.1:" << m_options.metrics_port << "/metrics" << std::endl;
+}
+
+void AppBase::accept_scrapes()
+{
+	do
+	{
+		Socket sck = m_metrics_listener.accept();
+
+		// A failed accept only loses that scrape
+		if(!sck.valid() || !sck.set_nonblocking())
+			return;
+
+		auto free = std::find_if(m_scrapes.begin(), m_scrapes.end(), [](const Scrape & s){return !s.sck.valid();});
+		size_t s = free - m_scrapes.begin();
+		if(free == m_scrapes.end())
+			m_scrapes.emplace_back();
+
+		watch(sck, Source::SCRAPE, s, Poller::IN);
+		m_scrapes[s] = {std::move(sck), {}, {}, 0, m_now + scrape_timeout};
+		m_timers.add(m_scrapes[s].deadline, {TimerKind::SCRAPE, s});
+	}
+	while(m_poller->edge_triggered());
+}
+
+void AppBase::check_scrape(size_t s)
+{
+	if(s >= m_scrapes.size() || !m_scrapes[s].sck.valid())
+		return;
+
+	auto & scrape = m_scrapes[s];
+
+	// Answering
+	if(!scrape.response.empty())
+	{
+		send_scrape(s);
+		return;
+	}
+
+	bool complete = false;
+
+	for(;;)
+	{
+		std::array<char, 1024> buf;
+		auto res = scrape.sck.Recv_raw(buf.data(), buf.size(), 0);
+
+		if(res < 0 && would_block())
+			return; // The rest of the request comes later
+
+		// Whatever is asked for, the metrics are the answer. A scraper closing its side after its request is still answered.
+		if(res > 0)
+		{
+			scrape.request.append(buf.data(), res);
+			if(scrape.request.size() > max_scrape_request)
+				break;
+			if(scrape.request.find("\r\n\r\n") == std::string::npos)
+				continue;
+		}
+
+		complete = res >= 0 && !scrape.request.empty();
+		break;
+	}
+
+	if(!complete)
+	{
+		close_scrape(s);
+		return;
+	}
+
+	auto body = metrics_text();
+	scrape.response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size())
+		+ "\r\nConnection: close\r\n\r\n" + body;
+
+	// Only writes are waited for from now on
+	CHECK_RET(m_poller->modify(scrape.sck.socket(), make_tag(Source::SCRAPE, s), Poller::OUT))
+	send_scrape(s);
+}
+
+void AppBase::send_scrape(size_t s)
+{
+	auto & scrape = m_scrapes[s];
+
+	while(scrape.sent != scrape.response.size())
+	{
+		auto res = scrape.sck.Send_raw(scrape.response.data() + scrape.sent, scrape.response.size() - scrape.sent, MSG_NOSIGNAL);
+		if(res < 0)
+		{
+			if(would_block())
+				return; // Sent as the scraper reads, or dropped when it times out
+			break;
+		}
+		scrape.sent += res;
+	}
+
+	close_scrape(s);
+}
+
+void AppBase::scrape_timed_out(size_t s, uint64_t deadline)
+{
+	// Closed, or its slot reused since
+	if(s >= m_scrapes.size() || !m_scrapes[s].sck.valid() || m_scrapes[s].deadline != deadline)
+		return;
+
+	LOG("Scrape timed out" << std::endl);
+	close_scrape(s);
+}
+
+void AppBase::close_scrape(size_t s)
+{
+	auto & scrape = m_scrapes[s];
+	unwatch(scrape.sck);
+	scrape.sck.destroy();
+
+	if(std::none_of(m_scrapes.begin(), m_scrapes.end(), [](const Scrape & s){return s.sck.valid();}))
+		m_scrapes.clear();
+}
+
+std::string AppBase::metrics_text()
+{
+	std::vector<const Metrics *> all;
+	for(size_t r = 0; r != n_reactors(); ++r)
+		all.push_back(&reactor(r).metrics());
+
+	MetricsWriter::Channels channels;
+	for(size_t l = 0; l != m_lane_rtt.size(); ++l)
+		channels.push_back({"channel=\"tcp\",lane=\"" + std::to_string(l) + '"', &m_lane_rtt[l]});
+	if(!m_bypass_udp)
+		channels.push_back({"channel=\"udp\"", &m_udp_rtt});
+
+	return MetricsWriter(all, channels).write();
 }
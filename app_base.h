@@ -2,273 +2,493 @@
 #define APP_BASE_H
 
 #include "classes.h"
+#include "reactor.h"
+#include "udp_batch.hpp"
+#include "zerocopy.hpp"
+#include "frame_reader.hpp"
+#include "resolver.hpp"
 #include "socket.hpp"
+#include "poller.hpp"
 #include "ral_proto.h"
 #include "debug.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <limits>
+#include <memory>
+#include <string>
 #include <type_traits>
 #include <vector>
 #include <array>
 #include <unordered_map>
 #include <iostream>
-#include <ctime>
 #include <cassert>
 
-#define ENCODE_KEY(key, loc) *reinterpret_cast<key_sock_uni_t*>(loc) = key_sock_uni_t(key);
-#define DECODE_KEY(loc) *reinterpret_cast<key_sock_uni_t*>(loc)
-
 #undef min
 
-class AppBase : public NoCopy
+class AppBase : public Reactor
 {
+	friend class Reactor;
 public:
 
 	struct CombinedAddressSocket
 	{
 		Socket sck;
 		Address addr;
+		unsigned char weight = 1; // Batches of datagrams read in a turn
 	};
 
-	typedef uint64_t key_sock_uni_t;
-
-	static_assert(sizeof(key_sock_uni_t) == 8);
-
-	struct ComKey
+	// Runtime options, given on the command line
+	struct Options
 	{
-		key_sock_uni_t sk;
-		key_sock_uni_t uk;
-
-		bool operator==(const ComKey & a) const
-		{
-			return a.sk == sk && a.uk == uk;
-		}
+		bool bypass_udp = false;
+		bool io_uring = false; // Use the io_uring backend if available
+		uint32_t window = 1 << 20; // Initial window given to the other side for each connection
+		unsigned lanes = 1; // Number of tunnel TCP connections, chosen by the client
+		unsigned threads = 1; // Number of reactors, the main thread included
+		unsigned batch_latency = 200; // Microseconds a frame may wait in the batch of its lane, 0 to send frames at once
+		unsigned udp_batch = 32; // Datagrams received or sent with one system call
+		bool udp_gso = false; // Segmentation and receive offload on the UDP channel
+		bool zerocopy = false; // Send large batches of frames with MSG_ZEROCOPY
+		size_t frame_payload = default_frame_payload; // Largest payload of a frame accepted by this side
+		bool resume = true; // Keep the connections across tunnel reconnects, with a replay buffer of the data not yet delivered
+		unsigned dns_ttl = 60; // Seconds a resolved host name is used before it is resolved again
+		port_t metrics_port = 0; // Loopback port serving the metrics as Prometheus text, 0 for none
 	};
 
-	static_assert(sizeof(key_sock_uni_t) >= sizeof(socket_t), "key_sock_uni_t should be able to contain a socket");
+	void create_udp_socket();
 
-	struct Connection
-	{
-		Socket sck;
-		key_sock_uni_t key;
-		size_t pfd_index;
-	};
+	// Register the UDP channel in the poller, once established
+	void watch_udp_socket();
 
-	struct CKHash : std::hash<key_sock_uni_t>
-	{
-		typedef std::true_type is_transparent;
+protected:
+	Options m_options;
 
-		size_t operator()(const ComKey & ck) const
-		{
-			return std::hash<key_sock_uni_t>::operator()(ck.sk);
-		}
+	Socket m_tcp_proto_conn, m_udp_proto_conn;
+	std::vector<Socket> m_lanes; // Tunnel lanes after the first one, which is m_tcp_proto_conn
 
-		using std::hash<key_sock_uni_t>::operator();
+	// Frames waiting to be written to a lane, sent together
+	struct FrameBatch
+	{
+		std::vector<unsigned char> data;
+		std::chrono::steady_clock::time_point since; // Of the oldest frame
+		ZeroCopyQueue zc; // Sent buffers still read by the kernel
+		bool sending = false; // A batch given to the backend, until reported sent
 	};
+	std::vector<FrameBatch> m_batches; // One for each lane, used by the reactor of the lane
+	std::vector<FrameReader> m_readers; // Same
+	uint64_t m_session_id = 0; // Given by the server, lanes join the session with it
+	Address m_proto_udp_address;
 
-	struct CKEq : std::equal_to<ComKey>
-	{
-		typedef std::true_type is_transparent;
+	std::vector<std::unique_ptr<Reactor>> m_workers; // Reactors after the first one, which is the application
 
-		bool operator()(const key_sock_uni_t & sk, ComKey ck) const
-		{
-			return ck.sk == sk;
-		}
+	std::vector<CombinedAddressSocket> m_udp_sockets;
 
-		bool operator()(const ComKey & ck, key_sock_uni_t sk) const
-		{
-			return ck.sk == sk;
-		}
+	// Datagrams of the UDP bridges and channel, all handled by the main thread.
+	// Received datagrams keep room for the header of a UDP message before them.
+	RecvBatch m_udp_in;
+	SendBatch m_udp_out;
+
+	Resolver m_resolver; // Host names of the server or of the endpoints, its results handled by the main thread
 
-		using std::equal_to<ComKey>::operator();
+	// Scrape of the metrics, answered once its request is read. The answer is sent without blocking, as the scraper reads it.
+	struct Scrape
+	{
+		Socket sck;
+		std::string request;
+		std::string response; // Empty until the request is complete
+		size_t sent = 0;
+		uint64_t deadline = 0; // ms, the scrape is dropped if not answered by then
 	};
 
-	void create_udp_socket();
+	Socket m_metrics_listener;
+	std::vector<Scrape> m_scrapes; // Closed ones are invalid, their slot is reused
 
-	typedef std::unordered_map<ComKey, Connection, CKHash, CKEq> ConnectionMap;
+	uint64_t m_udp_last_send = 0; // ms, a keepalive is sent after udp_ka_interval without datagrams
+	std::vector<uint64_t> m_last_tcp_packet; // ms, last data received on each lane. Written by the reactor of the lane.
 
-protected:
-	Socket m_tcp_proto_conn, m_udp_proto_conn;
-	Address m_proto_udp_address;
-	std::vector<pollfd> m_pfds;
-	std::vector<unsigned char> m_message_buffer;
+	// Round trip times measured by the pings of each lane, written by the reactor of the lane, and of the UDP channel
+	std::vector<RttEstimator> m_lane_rtt;
+	RttEstimator m_udp_rtt;
 
-	std::vector<CombinedAddressSocket> m_udp_sockets;
-	ConnectionMap m_connections;
+	unsigned m_epoch = 0; // Incremented when the tunnel is reestablished : pending events are then stale
 
+	uint32_t m_peer_window = 0; // Initial credit of new connections, given by the other side
+	size_t m_frame_payload; // Largest payload of a frame, the smaller one of both sides once connected
+	bool m_compression = false; // Supported by the other side : bridges may then compress their payloads
+	bool m_resume = false; // Enabled on both sides : connections are resumed with the tunnel
+	bool m_compact = false; // Supported by the other side : TCP messages have compact headers
+	bool m_early = false; // Supported by the other side : the client reads its connections before they are established
+	bool m_ping = false; // Supported by the other side : keepalives are pings, which measure the round trip time
 
-	time_t m_cur_time = 0; // Time to be updated after poll
-	time_t m_udp_ka_time = 0, m_tcp_ka_time = 0;
-	time_t m_last_tcp_packet = 0; // Last TCP ka received
+	std::atomic<bool> m_reset_requested = false; // A lane was lost
 
 	uint16_t m_udp_port;
 	bool m_udp_established = false;
 	bool m_udp_est_resend = true;
 	bool m_run = true;
 	bool m_bypass_udp = false;
+	bool m_udp_gso = false; // Enabled on the UDP channel socket
 public:
 
-	static constexpr size_t message_buffer_size = 16384 + 8;
-
-	AppBase(bool ub = false) : m_message_buffer(message_buffer_size), m_bypass_udp(ub) {
-		if(ub) set_bypass();
+	AppBase(const Options & opts) : Reactor(*this, opts.io_uring, clamp_payload(opts.frame_payload)), m_options(opts),
+		m_udp_in(std::max(opts.udp_batch, 1u), opts.udp_gso ? max_gro_size : udp_slot_size(clamp_payload(opts.frame_payload)), Proto::udp_message_header_size),
+		m_udp_out(std::max(opts.udp_batch, 1u)),
+		m_resolver(SOCK_STREAM, std::chrono::seconds(std::max(opts.dns_ttl, 1u)), [this]{wake();}),
+		m_bypass_udp(opts.bypass_udp) {
+		m_options.frame_payload = m_frame_payload = clamp_payload(opts.frame_payload);
+		m_options.window = std::clamp<uint32_t>(m_options.window, m_options.frame_payload, max_window);
+		m_options.threads = std::clamp(m_options.threads, 1u, max_lanes);
+
+		for(unsigned t = 1; t != m_options.threads; ++t)
+			m_workers.push_back(std::make_unique<Reactor>(*this, opts.io_uring, m_options.frame_payload));
+
+		std::cout << "Using " << m_poller->name() << " backend";
+		if(m_options.threads > 1)
+			std::cout << " on " << m_options.threads << " threads";
+		std::cout << '.' << std::endl;
+
+		if(m_options.metrics_port)
+			open_metrics();
 	}
 
+	~AppBase() {stop_workers();}
+
 	constexpr static int n_initial_messages = 16;
-	constexpr static time_t udp_ka_interval = 5;
-	constexpr static time_t tcp_ka_interval = 2;
-	constexpr static time_t tcp_timeout = tcp_ka_interval + 2;
+	constexpr static uint64_t udp_ka_interval = 5000; // ms
+	constexpr static unsigned max_lanes = 64;
+	constexpr static size_t batch_size = 64 << 10; // A lane batch is sent once it reaches this size
+	constexpr static unsigned max_udp_batch = 1024;
+	constexpr static size_t max_gro_size = 1 << 16; // Datagrams coalesced by the kernel
+	constexpr static size_t max_udp_payload = 65507 - (Proto::udp_message_header_size - 1); // Within an IPv4 datagram on the UDP channel
+	constexpr static size_t zerocopy_min_size = 16 << 10; // Smaller batches are cheaper to copy than to pin
+	constexpr static uint32_t max_resumed = 1 << 20; // Connections in a resume message
+	constexpr static size_t max_scrape_request = 8 << 10; // Larger requests are dropped
+	constexpr static uint64_t scrape_timeout = 5000; // ms, to send a request and read the answer
+	constexpr static uint64_t min_ka_interval = 500; // ms, keepalive interval of a lane with a short round trip time
+	constexpr static uint64_t min_timeout_margin = 1000, max_timeout_margin = 30000; // ms, after the keepalive interval before a lane times out
 
 protected:
 
 #undef max
 
-	// Enable bypass
-	void set_bypass()
-	{
-		m_udp_ka_time = std::numeric_limits<time_t>::max();
-	}
-	
+	static size_t clamp_payload(size_t payload) {return std::clamp(payload, min_frame_payload, max_frame_payload);}
+
+	// Slot of a received datagram : a payload of a UDP message, with its header
+	static size_t udp_slot_size(size_t frame_payload) {return std::min(frame_payload, max_udp_payload) + Proto::udp_message_header_size;}
+
+	// Largest payload of a datagram of a UDP bridge, carried by one UDP message
+	size_t udp_payload() const {return std::min(m_frame_payload, max_udp_payload);}
 
 	void discard_udp_message();
 
 	void establish_udp_connection();
-	void process_udp_message();
+
+	// Process a batch of datagrams from the UDP channel. Returns false once the socket is drained.
+	bool process_udp_message();
+
+	// Process the datagrams of the UDP channel, reported by an event
+	void check_udp_channel(const Poller::Event & ev);
+
+	// Process one message of the UDP channel
+	void process_udp_datagram(unsigned char * msg, size_t size);
 	
 	// Call when it has been determined that a TCP message is bypassed and directed to udp
-	void process_bypassed_message();
+	void process_bypassed_message(const unsigned char * msg);
 
-	// Call to process UDP message in message buffer. The buffer should have space for the header reserved (should be 8 bytes at time of writing).
-	void send_udp(uint16_t bridge, uint32_t size);
+	// Listen for the scrapes of the metrics, on the loopback
+	void open_metrics();
 
-	template<bool Message>
-	bool disconnect_tcp(ConnectionMap::iterator connex)
-	{	
+	// Accept the scrapes waiting on the listener
+	void accept_scrapes();
 
-		LOG("Connexion " << connex->first.sk << ", " << connex->second.key << " disconnected." << std::endl);
+	// Read the request of a scrape, and answer it with the metrics once complete, or send more of the answer
+	void check_scrape(size_t s);
 
-		if constexpr (Message)
-		{
-			std::array<unsigned char, 17> msg = {(unsigned char)(Proto::OpCode::TCP_DISCONNECTED)};
+	// Send what the scraper accepts of the answer, and close the scrape once sent
+	void send_scrape(size_t s);
 
-			ENCODE_KEY(connex->second.key, &msg[1])
-			ENCODE_KEY(connex->first.uk, &msg[9])
+	// Drop a scrape which was not answered in time, when its timer expires
+	void scrape_timed_out(size_t s, uint64_t deadline);
 
-			CHECK_RET(m_tcp_proto_conn.Send(msg))
-		}
+	void close_scrape(size_t s);
 
-		bool ate = (connex->second.pfd_index + 1) == m_pfds.size();
+	// Metrics of all the reactors, as Prometheus text
+	std::string metrics_text();
 
-		if(!ate)
-		{
-			auto idx = connex->second.pfd_index;
-			m_pfds[idx] = m_pfds.back();
-
-			auto it_movco = m_connections.find(key_sock_uni_t(m_pfds[idx].fd));
-			if(it_movco == m_connections.end())
-			{
-				LOG("Something strange happened ... Lost pfd." << std::endl);
-			}
-			else 
-				it_movco->second.pfd_index = idx;
-
-			assert(idx >= 2);
-		}
-	
-		m_pfds.pop_back();
-		m_connections.erase(connex);
+	// Account a datagram of a UDP bridge received from the tunnel, or sent through it
+	void count_udp_in(uint16_t bridge, uint32_t size)
+	{
+		auto & traffic = m_metrics.udp_traffic(bridge);
+		traffic.bytes_in.add(size);
+		traffic.frames_in.add();
+		m_metrics.frame_in.record(size);
+	}
 
-		return ate;
+	void count_udp_out(uint16_t bridge, uint32_t size)
+	{
+		auto & traffic = m_metrics.udp_traffic(bridge);
+		traffic.bytes_out.add(size);
+		traffic.frames_out.add();
+		m_metrics.frame_out.record(size);
 	}
 
-	template<bool Message>
-	bool disconnect_tcp(ComKey connex)
+	// Exchange the initial windows, while initializing a fresh connection
+	void exchange_windows();
+
+	// Exchange the capabilities and the largest frame payloads, while initializing a fresh connection
+	void exchange_capabilities();
+
+	// Exchange the state of the connections once the tunnel is reestablished with the same peer, and resume them.
+	// The client sends its state first. The workers should be stopped.
+	void resume_session(bool first);
+
+	// Call to send an UDP message received on a bridge. The payload should have space for the header reserved before it (should be 8 bytes at time of writing).
+	// Without bypass, the payload should stay valid until m_udp_out is flushed.
+	void send_udp(uint16_t bridge, unsigned char * payload, uint32_t size);
+
+	Socket & lane(size_t l) {return l ? m_lanes[l - 1] : m_tcp_proto_conn;}
+	size_t n_lanes() const {return m_lanes.size() + 1;}
+
+	// Lane carrying the frames of a connection. Frames of a connection stay on the same lane, so they stay ordered.
+	size_t lane_of(key_sock_uni_t unkey) const {return unkey % n_lanes();}
+
+	// Set the number of lanes, when establishing the tunnel
+	void set_lanes(size_t n)
 	{
-		auto iter_sck = m_connections.find(connex);
+		m_lanes.resize(n - 1);
+		m_batches.assign(n, {});
+		m_readers.assign(n, {});
+		m_lane_rtt = std::vector<RttEstimator>(n);
+	}
 
-		if(iter_sck == m_connections.end())
-		{
-			LOG("Double disconnect of connection " << connex.sk << std::endl);
-			return false; // We don't care in this case...
-		}
+	// Write a frame to a lane, from the thread of its reactor. Once the tunnel is established, every frame goes through the batch of its lane, so frames stay ordered.
+	void send_frame(size_t l, const void * frame, size_t size);
 
-		return disconnect_tcp<Message>(iter_sck);
+	template<typename Cont>
+	void send_frame(size_t l, const Cont & frame)
+	{
+		send_frame(l, frame.data(), frame.size());
 	}
 
-	bool check_conn_pfd(std::vector<pollfd>::iterator iter_pfd);
+	// Send the frames batched for a lane. A failure loses the lane, and the tunnel is reestablished.
+	// With a backend which sends, the frames batched meanwhile wait for the batch in flight.
+	void flush_lane(size_t l);
 
-	void check_keepalives()
+	// A batch sent by the backend of the reactor of the lane completed : the next one may go
+	void lane_sent(size_t l, uint32_t ready)
 	{
-		// UDP Keepalive
-		if(udp_ka_message())
+		m_batches[l].sending = false;
+
+		// Lost as if closed on the read side
+		if(ready & Poller::ERR)
 		{
-			Proto::OpCode ka{Proto::OpCode::NOP};
-			m_udp_proto_conn.Sendto(ka, m_proto_udp_address);
+			LOG("Send failed on lane " << l << std::endl);
+			request_reset();
 		}
-		// TCP Keepalive
-		if(tcp_ka_message())
+	}
+
+	// Whether an event without input on a lane means that it was lost.
+	// Zero copy completions are reported as errors : they are read here, and only an error of the socket itself loses the lane.
+	bool lane_error(size_t l, uint32_t ready)
+	{
+		if(ready & Poller::HUP)
+			return true;
+		if(!(ready & Poller::ERR))
+			return false;
+
+		m_batches[l].zc.reap(lane(l));
+		return lane(l).pending_error() != 0;
+	}
+
+	// Keepalive interval of a lane, from the reactor of the lane : twice its retransmission timeout once measured, never longer than the fixed interval,
+	// which the other side may still use for its timeout
+	uint64_t keepalive_interval(size_t l) const
+	{
+		auto & rtt = m_lane_rtt[l];
+		return rtt.sampled() ? std::clamp<uint64_t>(rtt.rto() / 500, min_ka_interval, tcp_ka_interval) : tcp_ka_interval;
+	}
+
+	// Delay without data before a lane times out : the longest keepalive interval of the other side, then 4 retransmission timeouts once measured
+	uint64_t lane_timeout(size_t l) const
+	{
+		auto & rtt = m_lane_rtt[l];
+		return rtt.sampled() ? tcp_ka_interval + std::clamp<uint64_t>(rtt.rto() / 250, min_timeout_margin, max_timeout_margin) : tcp_timeout;
+	}
+
+	// Send a keepalive on a lane, from the thread of its reactor : a ping if the other side answers them
+	void send_keepalive(size_t l)
+	{
+		if(!m_ping)
 		{
 			Proto::OpCode ka{Proto::OpCode::NOP};
-			m_tcp_proto_conn.Send(ka);
+			send_frame(l, &ka, sizeof(ka));
+			return;
 		}
+
+		std::array<unsigned char, Proto::ping_size> ping = {(unsigned char)(Proto::OpCode::PING)};
+		uint64_t now = monotonic_us();
+		ENCODE_UINT64(now, &ping[1])
+		send_frame(l, ping);
+		m_lane_rtt[l].ping_sent();
+	}
+
+	// Answer a ping, on the lane it came from : the pong is sent by the thread of the lane
+	void send_pong(size_t l, const unsigned char * ping)
+	{
+		std::array<unsigned char, Proto::pong_size> pong;
+		make_pong(ping, pong.data());
+		send_frame(l, pong);
 	}
 
+	static void make_pong(const unsigned char * ping, unsigned char * pong)
+	{
+		pong[0] = (unsigned char)(Proto::OpCode::PONG);
+		memcpy(pong + 1, ping + 1, 8);
+		uint64_t now = monotonic_us();
+		ENCODE_UINT64(now, pong + 9)
+	}
 
-	bool udp_ka_message()
+	// Account a pong received on a channel
+	static void receive_pong(RttEstimator & rtt, const unsigned char * pong)
 	{
-		auto t = time(nullptr);
-		if(t >= m_udp_ka_time)
-		{
-			m_udp_ka_time = t + udp_ka_interval;
-			return true;
-		}
-		return false;
+		rtt.sample(DECODE_UINT64(pong + 1), DECODE_UINT64(pong + 9), monotonic_us());
+	}
+
+	size_t n_reactors() const {return m_workers.size() + 1;}
+
+	// Reactor reading and writing a lane. The first lane, carrying the control frames, stays on the main thread.
+	Reactor & lane_reactor(size_t l)
+	{
+		size_t r = l % n_reactors();
+		return r ? *m_workers[r - 1] : *this;
 	}
 
+	// Reactor of a connection : the one of its lane
+	Reactor & conn_reactor(key_sock_uni_t unkey) {return lane_reactor(lane_of(unkey));}
+
+	// Run a task in the thread of a reactor
+	void dispatch(Reactor & r, Task task)
+	{
+		if(&r == this)
+			task();
+		else
+			r.post(std::move(task));
+	}
 
-	bool tcp_ka_message()
+	// Start the workers owning a lane, once the tunnel is established
+	void start_workers()
 	{
-		auto t = time(nullptr);
-		if(t >= m_tcp_ka_time)
+		// Only read by their reactor from now on, which may receive them through its backend
+		for(size_t l = 0; l != n_lanes(); ++l)
+			lane_reactor(l).rewatch(lane(l), Source::TUNNEL_TCP, l, Poller::IN | Poller::LEVEL | Poller::RECV);
+
+		for(size_t r = 1; r < std::min(n_reactors(), n_lanes()); ++r)
+			m_workers[r - 1]->start();
+	}
+
+	// Stop the workers before the tunnel is reset
+	void stop_workers()
+	{
+		for(auto & w : m_workers)
+			w->stop();
+
+		// Posted by the workers for the tunnel being reset
+		drop_tasks();
+
+		m_reset_requested = false;
+	}
+
+	// Called when a lane was lost, by its reader or its sender : the main thread reestablishes the tunnel
+	void request_reset()
+	{
+		m_reset_requested = true;
+		wake();
+	}
+
+	void close_lanes()
+	{
+		for(size_t l = 0; l != n_lanes(); ++l)
 		{
-			m_tcp_ka_time = t + tcp_ka_interval;
-			return true;
+			lane_reactor(l).unwatch(lane(l));
+			lane(l).destroy();
 		}
-		return false;
+		m_lanes.clear();
+		m_batches.clear();
+		m_readers.clear();
+		m_lane_rtt.clear();
+	}
+
+	Reactor & reactor(size_t r) {return r ? *m_workers[r - 1] : *this;}
+
+	// Drop the connections of all the reactors, when the tunnel is reset
+	void drop_connections()
+	{
+		for(size_t r = 0; r != n_reactors(); ++r)
+			reactor(r).clear_connections();
 	}
 
-	void update_tcp_ka()
+	void clear_udp_bridges()
 	{
-		m_tcp_ka_time = time(nullptr) + tcp_ka_interval;
+		for(auto & cs : m_udp_sockets)
+			unwatch(cs.sck);
+		m_udp_sockets.clear();
+	}
+
+	// Send a keepalive on the UDP channel if no datagram was sent for udp_ka_interval, when its timer expires. With pings, one is sent at each interval.
+	void udp_keepalive()
+	{
+		if(m_ping)
+		{
+			std::array<unsigned char, Proto::ping_size> ping = {(unsigned char)(Proto::OpCode::PING)};
+			uint64_t now = monotonic_us();
+			ENCODE_UINT64(now, &ping[1])
+			m_udp_proto_conn.Sendto(ping, m_proto_udp_address);
+			m_udp_rtt.ping_sent();
+			m_udp_last_send = m_now;
+		}
+		else if(m_now >= m_udp_last_send + udp_ka_interval)
+		{
+			Proto::OpCode ka{Proto::OpCode::NOP};
+			m_udp_proto_conn.Sendto(ka, m_proto_udp_address);
+			m_udp_last_send = m_now;
+		}
+		m_timers.add(m_udp_last_send + udp_ka_interval, {TimerKind::UDP_KEEPALIVE});
 	}
 
 	void update_udp_ka()
 	{
-		m_udp_ka_time = time(nullptr) + udp_ka_interval;
+		m_udp_last_send = m_now;
 	}
 
-	auto poll_pfds()
+	auto poll_events()
 	{
-		constexpr auto poll_time = std::min(tcp_ka_interval, udp_ka_interval) * 1000;	
-		
-		// Poll
-		int rpoll;
+		// Turns of the connections readable in the last iteration, and their frames
+		run_reads();
+		flush_lanes();
+
+		// Poll until the next timer
+		int rpoll = m_poller->wait(poll_timeout());
+		m_next_event = 0;
 
-		rpoll = poll(m_pfds.data(), m_pfds.size(), poll_time);
+		update_clock();
+		run_timers();
 
-		m_cur_time = time(nullptr);
+		// Tasks posted by the workers, such as the frames of the first lane
+		run_inbox();
+
+		m_resolver.complete();
 
-		check_keepalives();
-		
 		return rpoll;
 	}
 	
-	// Check if the tcp connection timed out and send the network message if it has
+	// Check if a lane of the tcp connection timed out or was lost by a worker, and send the network message if it has
 	bool check_tcp_timeout()
 	{
-		if(m_cur_time >= m_last_tcp_packet + tcp_timeout)
+		if(lanes_timed_out() || m_reset_requested.exchange(false))
 		{
 			send_timeout_message();
 			return true;
@@ -276,10 +496,22 @@ protected:
 		return false;
 	}
 
+	// Start the timeouts of all the lanes and the keepalives, once connected. The workers should be stopped.
+	void reset_tcp_timeout()
+	{
+		update_clock();
+		m_last_tcp_packet.assign(n_lanes(), m_now);
+		m_udp_last_send = m_now;
+
+		for(size_t r = 0; r != n_reactors(); ++r)
+			reactor(r).start_timers();
+	}
+
 	void send_timeout_message()
 	{
 		Proto::OpCode op(Proto::OpCode::TCP_TIMEOUT);
-		m_tcp_proto_conn.Send(op);
+		send_frame(0, &op, sizeof(op));
+		flush_lane(0);
 	}
 };
 
@@ -0,0 +1,89 @@
+// Ratio and speed of the payload compression on 16KB frames, for text logs and for random data, with the share of frames sent compressed.
+// Usage : bench_compression [MB of frames for each kind of data, default 256]
+
+#include "../lz.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+constexpr size_t frame_size = 16 << 10;
+
+// JSON log lines, the kind of traffic the option compress is for
+static std::vector<unsigned char> make_logs(size_t size, std::mt19937 & rng)
+{
+	static const char * levels[] = {"debug", "info", "warning", "error"};
+	static const char * paths[] = {"/api/v1/users", "/api/v1/orders", "/static/app.js", "/health", "/api/v1/search"};
+
+	std::string text;
+	for(unsigned i = 0; text.size() < size; ++i)
+		text += "{\"ts\":" + std::to_string(1700000000000ull + i * 37 + rng() % 20) + ",\"level\":\"" + levels[rng() % 4] +
+			"\",\"path\":\"" + paths[rng() % 5] + "\",\"status\":" + std::to_string(rng() % 8 ? 200 : 404) +
+			",\"ms\":" + std::to_string(rng() % 900) + ",\"req\":\"" + std::to_string(rng()) + "\"}\n";
+
+	return {text.begin(), text.begin() + size};
+}
+
+static std::vector<unsigned char> make_random(size_t size, std::mt19937 & rng)
+{
+	std::vector<unsigned char> data(size);
+	for(auto & b : data)
+		b = (unsigned char)(rng());
+	return data;
+}
+
+static void run(const char * name, const std::vector<unsigned char> & data)
+{
+	size_t frames = data.size() / frame_size;
+	std::vector<unsigned char> out(Lz::bound(frame_size)), back(frame_size);
+	std::vector<size_t> sizes(frames);
+
+	// As the reactor does : worth it if it saves at least 1/16
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i != frames; ++i)
+		sizes[i] = Lz::compress(data.data() + i * frame_size, frame_size, out.data(), frame_size - frame_size / 16);
+	double compress_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Decompressed from a copy of each compressed frame, checked against the original
+	size_t compressed = 0, wire = 0;
+	double decompress_s = 0;
+	for(size_t i = 0; i != frames; ++i)
+	{
+		const unsigned char * src = data.data() + i * frame_size;
+		if(!sizes[i])
+		{
+			wire += frame_size;
+			continue;
+		}
+		compressed++;
+		wire += sizes[i];
+
+		Lz::compress(src, frame_size, out.data(), out.size());
+		auto t = std::chrono::steady_clock::now();
+		auto res = Lz::decompress(out.data(), sizes[i], back.data(), back.size());
+		decompress_s += std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+
+		if(res != ptrdiff_t(frame_size) || memcmp(back.data(), src, frame_size))
+		{
+			printf("%s : round trip failed on frame %zu\n", name, i);
+			return;
+		}
+	}
+
+	double mb = double(frames * frame_size) / 1e6;
+	printf("%8s %8.3f %12.0f %12.0f %10.2f %10.0f%%\n", name, double(wire) / (frames * frame_size), mb / compress_s,
+		compressed ? compressed * frame_size / 1e6 / decompress_s : 0, compress_s * 1e3 / mb, 100.0 * compressed / frames);
+}
+
+int main(int argc, char ** argv)
+{
+	size_t total = (argc > 1 ? std::stoul(argv[1]) : 256) << 20;
+	std::mt19937 rng(42);
+
+	printf("%8s %8s %12s %12s %10s %11s\n", "data", "ratio", "comp MB/s", "decomp MB/s", "ms/MB", "compressed");
+	run("logs", make_logs(total, rng));
+	run("random", make_random(total, rng));
+	return 0;
+}
@@ -0,0 +1,69 @@
+// Throughput of one TCP bridge through the tunnel for a range of frame payload sizes (-fs), with the CPU time of both sides per GB.
+// Usage : bench_frame_size [MB sent for each size, default 1024]
+
+#include "tunnel.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+int main(int argc, char ** argv)
+{
+	size_t total = (argc > 1 ? std::stoul(argv[1]) : 1024) << 20;
+
+	// Random data : nothing to gain from compression or from the lengths of the runs
+	std::vector<unsigned char> chunk(1 << 20);
+	std::mt19937 rng(42);
+	for(auto & b : chunk)
+		b = (unsigned char)(rng());
+
+	printf("%8s %10s %14s\n", "frame KB", "MB/s", "CPU ticks/GB");
+
+	for(unsigned fs : {4, 16, 64, 256, 1024})
+	{
+		port_t in = free_port(), out = free_port();
+
+		Socket listener;
+		Address out_adr(AF_INET, SOCK_STREAM, "127.0.0.1", out);
+		if(!listener.create(AF_INET, SOCK_STREAM) || !listener.set_reuseaddr() || !listener.bind(out_adr) || !listener.listen(1))
+			throw std::runtime_error("Cannot listen for the endpoint");
+
+		Tunnel tunnel("tcp 127.0.0.1 " + std::to_string(in) + " 127.0.0.1 " + std::to_string(out) + "\n", {"-fs", std::to_string(fs)});
+
+		std::atomic<size_t> received = 0;
+		std::thread sink([&]{
+			Socket sck = listener.accept();
+			std::vector<unsigned char> buf(1 << 20);
+			while(received < total)
+			{
+				auto res = sck.Recv_raw(buf.data(), buf.size());
+				if(res <= 0)
+					break;
+				received += res;
+			}
+		});
+
+		Socket src;
+		Address in_adr(AF_INET, SOCK_STREAM, "127.0.0.1", in);
+		if(!src.create(AF_INET, SOCK_STREAM) || !src.connect(in_adr))
+			throw std::runtime_error("Cannot connect to the bridge");
+
+		auto ticks = tunnel.cpu_ticks();
+		auto start = std::chrono::steady_clock::now();
+
+		for(size_t sent = 0; sent < total; sent += chunk.size())
+			if(!src.Send_all(chunk.data(), chunk.size()))
+				throw std::runtime_error("Send failed");
+
+		sink.join();
+		double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		ticks = tunnel.cpu_ticks() - ticks;
+
+		if(received < total)
+			throw std::runtime_error("Data lost");
+
+		printf("%8u %10.0f %14.0f\n", fs, total / s / 1e6, ticks * double(1 << 30) / total);
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+// Bytes on the wire of a TCP message header, fixed or compact, by payload size and connection id, and the time to encode and decode compact headers.
+
+#include "../ral_proto.h"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+// Whole header with the opcode, and the protocol byte with UDP bypass
+static size_t fixed_size(bool bypass)
+{
+	return bypass ? Proto::tcp_message_header_size : Proto::tcp_message_header_size - 1;
+}
+
+static size_t compact_size(uint32_t id, uint32_t size, bool bypass)
+{
+	std::array<unsigned char, Proto::tcp_message_room> buf;
+	unsigned char * payload = buf.data() + buf.size();
+	return payload - Proto::encode_compact_header(payload, id, size, bypass);
+}
+
+int main()
+{
+	constexpr uint32_t sizes[] = {1, 16, 64, 255, 256, 1000, 1460, 16 << 10, 64 << 10, 1 << 20};
+	constexpr uint32_t ids[] = {5, 500, 70000};
+
+	for(bool bypass : {false, true})
+	{
+		printf("%s UDP bypass\n%10s %6s", bypass ? "With" : "Without", "payload", "fixed");
+		for(uint32_t id : ids)
+			printf("   id %-6u", id);
+		printf("\n");
+
+		for(uint32_t size : sizes)
+		{
+			printf("%10u %6zu", size, fixed_size(bypass));
+			for(uint32_t id : ids)
+				printf(" %11zu", compact_size(id, size, bypass));
+			printf("\n");
+		}
+		printf("\n");
+	}
+
+	// Interactive traffic : keystrokes and small game ticks on a few hundred connections
+	uint64_t fixed = 0, compact = 0, payload = 0;
+	for(uint32_t i = 0; i != 100000; ++i)
+	{
+		uint32_t size = 1 + i % 97;
+		payload += size;
+		fixed += fixed_size(false);
+		compact += compact_size(i % 300, size, false);
+	}
+	printf("Small messages : %.2f header bytes per payload byte fixed, %.2f compact\n\n", double(fixed) / payload, double(compact) / payload);
+
+	// Codec speed
+	constexpr size_t n = 10000000;
+	std::vector<unsigned char> buf(Proto::tcp_message_room);
+	unsigned char * end = buf.data() + buf.size();
+	uint64_t check = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i != n; ++i)
+	{
+		uint32_t size = uint32_t(i * 2654435761u) >> 16;
+		unsigned char * msg = Proto::encode_compact_header(end, uint32_t(i & 0xFFFF), size, false);
+
+		uint32_t id, wire_size;
+		bool is_short = Proto::OpCode(msg[0]) == Proto::OpCode::SHORT_MESSAGE;
+		check += Proto::decode_compact_header(msg + 1, end - msg - 1, is_short, id, wire_size) + id + wire_size;
+	}
+	auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	printf("Encode and decode : %.1f ns per header (%llu)\n", ns / n, (unsigned long long)(check));
+	return 0;
+}
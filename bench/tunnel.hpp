@@ -0,0 +1,133 @@
+#ifndef BENCH_TUNNEL_HPP
+#define BENCH_TUNNEL_HPP
+
+// A server and a client of the rallonge built with the benchmarks, on the loopback, with the bridges of a config file.
+// Linux only : the processes are forked, and their CPU time read from /proc.
+
+#include "../socket.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+
+// A port of the loopback free at the time, for the type of socket
+inline port_t free_port(int type = SOCK_STREAM)
+{
+	Socket sck;
+	Address adr(AF_INET, type, "127.0.0.1", 0);
+	if(!sck.create(AF_INET, type) || !sck.bind(adr))
+		throw std::runtime_error("No free port");
+	auto [ok, bound] = sck.getsockname();
+	if(!ok)
+		throw std::runtime_error("No free port");
+	return bound.port();
+}
+
+// CPU time of a process in clock ticks, user and system
+inline long cpu_ticks(pid_t pid)
+{
+	std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+	std::string line;
+	std::getline(stat, line);
+
+	// After the command name, which may hold spaces : fields 14 and 15 are utime and stime
+	std::istringstream fields(line.substr(line.rfind(')') + 2));
+	std::string field;
+	long utime = 0, stime = 0;
+	for(int i = 3; i <= 15 && fields >> field; ++i)
+	{
+		if(i == 14) utime = std::stol(field);
+		if(i == 15) stime = std::stol(field);
+	}
+	return utime + stime;
+}
+
+class Tunnel
+{
+	pid_t m_server = 0, m_client = 0;
+	std::string m_config, m_log;
+
+	static pid_t spawn(const std::vector<std::string> & args, const std::string & log)
+	{
+		fflush(nullptr); // Or the child prints the output buffered so far again
+		pid_t pid = fork();
+		if(pid < 0)
+			throw std::runtime_error("fork failed");
+
+		if(pid == 0)
+		{
+			freopen(log.c_str(), "w", stdout);
+			std::vector<char *> argv;
+			for(auto & a : args)
+				argv.push_back(const_cast<char *>(a.c_str()));
+			argv.push_back(nullptr);
+			execv(argv[0], argv.data());
+			_exit(127);
+		}
+		return pid;
+	}
+
+	static void stop(pid_t pid)
+	{
+		if(!pid)
+			return;
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+	}
+
+public:
+	// Start the tunnel with the lines of a config file, and the same options on both sides. Returns once the client loaded its config.
+	Tunnel(const std::string & config, const std::vector<std::string> & options)
+	{
+		port_t port = free_port();
+		auto tag = std::to_string(getpid()) + '_' + std::to_string(port);
+		m_config = "/tmp/rallonge_bench_" + tag + ".cfg";
+		m_log = "/tmp/rallonge_bench_" + tag + ".log";
+		std::ofstream(m_config) << config;
+
+		std::vector<std::string> server = {RALLONGE_PATH, "server", std::to_string(port)};
+		std::vector<std::string> client = {RALLONGE_PATH, "client", "127.0.0.1", std::to_string(port), m_config};
+		server.insert(server.end(), options.begin(), options.end());
+		client.insert(client.end(), options.begin(), options.end());
+
+		m_server = spawn(server, "/dev/null");
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		m_client = spawn(client, m_log);
+
+		for(int i = 0; i != 100; ++i)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			std::ifstream log(m_log);
+			std::stringstream text;
+			text << log.rdbuf();
+			if(text.str().find("Configuration loaded successfully.") != std::string::npos)
+				return;
+		}
+
+		stop(m_client);
+		stop(m_server);
+		throw std::runtime_error("The tunnel did not start");
+	}
+
+	~Tunnel()
+	{
+		stop(m_client);
+		stop(m_server);
+		remove(m_config.c_str());
+		remove(m_log.c_str());
+	}
+
+	// CPU time of both sides so far
+	long cpu_ticks() const {return ::cpu_ticks(m_client) + ::cpu_ticks(m_server);}
+};
+
+#endif
@@ -0,0 +1,69 @@
+// Datagrams per second through a UDP bridge of the tunnel, with and without GSO/GRO on the UDP channel (-gso), and the CPU time of both sides.
+// Usage : bench_udp_gso [datagrams sent for each size, default 300000]
+
+#include "tunnel.hpp"
+#include "../udp_batch.hpp"
+
+#include <atomic>
+#include <cstdio>
+
+int main(int argc, char ** argv)
+{
+	size_t count = argc > 1 ? std::stoul(argv[1]) : 300000;
+
+	printf("%6s %5s %12s %12s %12s %10s\n", "size", "gso", "sent/s", "delivered", "delivered/s", "CPU ticks");
+
+	for(size_t size : {64, 512, 1200})
+		for(bool gso : {false, true})
+		{
+			port_t in = free_port(SOCK_DGRAM), out = free_port(SOCK_DGRAM);
+
+			Socket sink;
+			Address out_adr(AF_INET, SOCK_DGRAM, "127.0.0.1", out);
+			int rcvbuf = 8 << 20;
+			if(!sink.create(AF_INET, SOCK_DGRAM) || !sink.bind(out_adr) || !sink.set_recv_timeout(500))
+				throw std::runtime_error("Cannot bind the endpoint");
+			setsockopt(sink.socket(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+			std::vector<std::string> options;
+			if(gso)
+				options.push_back("-gso");
+			Tunnel tunnel("udp 127.0.0.1 " + std::to_string(in) + " 127.0.0.1 " + std::to_string(out) + "\n", options);
+
+			// Counted until none came for the receive timeout
+			std::atomic<size_t> delivered = 0;
+			std::chrono::steady_clock::time_point last;
+			std::thread counter([&]{
+				std::vector<unsigned char> buf(65536);
+				while(sink.Recv_raw(buf.data(), buf.size()) > 0)
+				{
+					delivered++;
+					last = std::chrono::steady_clock::now();
+				}
+			});
+
+			Socket src;
+			Address in_adr(AF_INET, SOCK_DGRAM, "127.0.0.1", in);
+			if(!src.create(AF_INET, SOCK_DGRAM))
+				throw std::runtime_error("Cannot create the source");
+
+			std::vector<unsigned char> datagram(size, 'x');
+			SendBatch batch(32);
+
+			auto ticks = tunnel.cpu_ticks();
+			auto start = std::chrono::steady_clock::now();
+
+			for(size_t i = 0; i != count; ++i)
+				batch.add(src, datagram.data(), datagram.size(), in_adr);
+			batch.flush();
+
+			double send_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			counter.join();
+			ticks = tunnel.cpu_ticks() - ticks;
+			double s = std::chrono::duration<double>(last - start).count();
+
+			printf("%6zu %5s %12.0f %12zu %12.0f %10ld\n", size, gso ? "on" : "off", count / send_s, size_t(delivered), delivered / s, ticks);
+		}
+	return 0;
+}
@@ -2,11 +2,15 @@
 #include "app_base.h"
 #include "ral_proto.h"
 #include "socket.hpp"
+#include <cstdlib>
 #include <fstream>
+#include <sstream>
+#include <memory>
 #include <iostream>
 #include <array>
-#include <limits>
 #include <stdexcept>
+#include <thread>
+#include <tuple>
 
 void Client::run()
 {
@@ -17,8 +21,6 @@ void Client::run()
 
 void Client::initiate()
 {
-	m_pfds = {{0, POLLIN, 0}, {0, POLLIN, 0}};
-	
 	connect_proto_tcp(true);
 
 	if(!m_bypass_udp)
@@ -28,20 +30,51 @@ void Client::initiate()
 
 	init_post_connection();
 	
-	m_last_tcp_packet = m_cur_time = time(nullptr);
+	reset_tcp_timeout();
 }
 
 bool Client::connect_proto_tcp(bool fresh)
 {
-	Address tcp_srv(AF_INET, SOCK_STREAM, m_hostname, m_tcp_port);
-	m_proto_udp_address = tcp_srv;
-
-	CHECK_RET(m_tcp_proto_conn.create(AF_INET, SOCK_STREAM))
+	// Resolved once, then kept up to date
+	if(m_server_addresses.empty())
+	{
+		set_server_addresses(m_resolver.add(m_hostname));
+		while(m_server_addresses.empty())
+			m_resolver.wait();
+	}
 
 	std::cout << "Connecting to server at " << m_hostname << ':'
 		<< m_tcp_port << " ..." << std::endl;
 
-	CHECK_RET(m_tcp_proto_conn.connect(tcp_srv))
+	// The addresses of the server are raced. A server reconnecting after a timeout listens again only once it noticed it.
+	size_t winner = 0;
+	for(;;)
+	{
+		try
+		{
+			std::tie(m_tcp_proto_conn, winner) = connect_first(m_server_addresses, server_connect_timeout);
+		}
+		catch(const NetworkError & e)
+		{
+			// All the addresses silent : retried as if refused
+			if(fresh)
+				throw;
+			std::cout << e.what() << std::endl;
+		}
+		if(m_tcp_proto_conn.valid())
+			break;
+
+		CHECK_RET(!fresh)
+		std::cout << "Server unreachable, retrying." << std::endl;
+		std::this_thread::sleep_for(reconnect_delay);
+
+		// The server may have moved
+		m_resolver.complete();
+	}
+
+	// The lanes and the UDP channel use the address which answered
+	Address tcp_srv = m_server_addresses[winner];
+	m_proto_udp_address = tcp_srv;
 
 	Proto::OpCode opcode = Proto::OpCode::ESTABLISH;
 	m_tcp_proto_conn.Send(opcode);
@@ -52,20 +85,63 @@ bool Client::connect_proto_tcp(bool fresh)
 
 	std::cout << "Connected to server." << std::endl;
 
-	m_pfds.front().fd = m_tcp_proto_conn.socket();
+	// A lane is read once per event, up to the room of its reader : level triggered, what is left is reported again
+	watch(m_tcp_proto_conn, Source::TUNNEL_TCP, 0, Poller::IN | Poller::LEVEL);
 
 	Proto::Connection cn(fresh ? Proto::Connection::FRESH : Proto::Connection::RESUME);
 	CHECK_RET(m_tcp_proto_conn.Send(cn))
 	CHECK_RET(m_tcp_proto_conn.Recv(cn))
+
+	connect_lanes(tcp_srv);
+
 	return cn == Proto::Connection::FRESH;
 }
 
+void Client::connect_lanes(const Address & srv)
+{
+	unsigned char n = m_options.lanes;
+	CHECK_RET(m_tcp_proto_conn.Send(n))
+
+	std::array<unsigned char, 8> session;
+	CHECK_RET(m_tcp_proto_conn.Recv(session, MSG_WAITALL))
+
+	set_lanes(n);
+
+	for(unsigned char l = 1; l != n; ++l)
+	{
+		auto & sck = lane(l);
+
+		CHECK_RET(sck.create(srv.af(), SOCK_STREAM))
+		CHECK_RET(sck.connect(srv))
+
+		Proto::OpCode opcode = Proto::OpCode::ESTABLISH;
+		sck.Send(opcode);
+		do
+		{
+			CHECK_RET(sck.Recv(opcode))
+		} while (opcode != Proto::OpCode::ESTABLISH);
+
+		std::array<unsigned char, 10> join = {(unsigned char)(Proto::Connection::LANE)};
+		std::copy(session.begin(), session.end(), &join[1]);
+		join[9] = l;
+		CHECK_RET(sck.Send(join))
+
+		lane_reactor(l).watch(sck, Source::TUNNEL_TCP, l, Poller::IN | Poller::LEVEL);
+	}
+
+	if(n > 1)
+		std::cout << "Tunnel striped over " << unsigned(n) << " lanes." << std::endl;
+}
+
 void Client::init_post_connection()
 {
 	std::cout << "Initializing connection" << std::endl;
 	auto bp = m_bypass_udp ? Proto::UDPBypass::BYPASS : Proto::UDPBypass::NO_BYPASS;
 	CHECK_RET(m_tcp_proto_conn.Send(bp));
 
+	exchange_windows();
+	exchange_capabilities();
+
 	if(!m_bypass_udp)
 	{
 
@@ -85,18 +161,20 @@ void Client::init_post_connection()
 			<< client_udp_port << std::endl;
 
 		establish_udp_connection();
+		watch_udp_socket();
 
 		std::cout << "UDP connect OK." << std::endl;
 	}
 	else
 	{
 		std::cout << "UDP bypass enabled." << std::endl;
-		m_udp_ka_time = std::numeric_limits<time_t>::max();
 	}
 }
 
 void Client::proc_loop()
 {
+	start_workers();
+
 	while(m_run)
 	{
 		if (check_tcp_timeout())
@@ -105,249 +183,286 @@ void Client::proc_loop()
 			on_timeout();
 		}
 
-		auto rpoll = poll_pfds();
+		auto rpoll = poll_events();
 		
 		if(rpoll == 0) continue;
 
-		CHECK_RET(rpoll);
+		CHECK_RET(rpoll > 0);
 
-		// Check server TCP / UDP
-		
-		while(m_pfds.front().revents & pollmask)
+		auto epoch = m_epoch;
+
+		auto & events = m_poller->events();
+		while(m_next_event != events.size())
 		{
-			if(m_pfds.front().revents & (POLLIN | POLLRDNORM))
-			{
-				process_tcp_message();
-			}
-			else if(m_pfds.front().revents & (POLLERR | POLLHUP))
-			{
-				std::cout << "Lost connection. Reconnecting." << std::endl;
-				send_timeout_message();
-				on_timeout();
-			}
+			auto & ev = events[m_next_event++];
+			if(!ev.ready) continue; // Source removed during this iteration
 
-			if(!m_tcp_proto_conn.valid())
+			switch(tag_source(ev.tag))
 			{
-				std::cout << "Lost connection. Reconnecting." << std::endl;
-				send_timeout_message();
-				on_timeout();
-			}
+			case Source::TUNNEL_TCP:
+				{
+					// Check server TCP
+					auto l = tag_index(ev.tag);
 
-			// /!\ with TCP message, the pfd vector might have been reallocated
+					if(ev.ready & Poller::SENT)
+					{
+						lane_sent(l, ev.ready);
+						break;
+					}
 
-			CHECK_RET(poll(&m_pfds.front(), 1, 0) >= 0)
-		}
+					if(ev.ready & Poller::IN)
+					{
+						process_tcp_message(l, ev);
+					}
 
-		// pfd vector won't change ahead
+					// Losing any lane reestablishes the whole tunnel
+					if(epoch == m_epoch && (!lane(l).valid() || (!(ev.ready & Poller::IN) && lane_error(l, ev.ready))))
+					{
+						std::cout << "Lost connection. Reconnecting." << std::endl;
+						send_timeout_message();
+						on_timeout();
+					}
+				}
+				break;
+			case Source::TUNNEL_UDP:
+				check_udp_channel(ev);
+				break;
+			case Source::TCP_LISTENER:
+				accept_connections(tag_index(ev.tag));
+				break;
+			case Source::UDP_BRIDGE:
+				check_udp_bridge(tag_index(ev.tag));
+				break;
+			case Source::CONNECTION:
+				check_conn(ev);
+				break;
+			case Source::WAKE:
+				drain_wake();
+				break;
+			case Source::METRICS:
+				accept_scrapes();
+				break;
+			case Source::SCRAPE:
+				check_scrape(tag_index(ev.tag));
+				break;
+			case Source::CONNECT_ATTEMPT: // Endpoints are connected by the server
+				break;
+			}
 
-		auto iter_pfd = std::next(m_pfds.begin());
-		
-		
-		while (iter_pfd->revents & pollmask)
-		{
-			process_udp_message();
-			CHECK_RET(poll(&(*iter_pfd), 1, 0) >= 0)
+			// The tunnel was reestablished : remaining events refer to dropped sources
+			if(epoch != m_epoch) break;
 		}
-		
-		iter_pfd++;
-
-		// Check endpoints
-		
-		// TCP
-		uint16_t bridge(0);
-		for(auto & sck : m_tcp_listener_sockets)
-		{
-			while(iter_pfd->revents & pollmask)
-			{
-				// Add a connection
-
-				Connection nco;
-				nco.sck = sck.accept();
-				nco.key = 0; // Will receive true value when connection established message is received
-				CHECK_RET(nco.sck.valid())
-
-				LOG("New connection on bridge " << bridge << ", key " << key_sock_uni_t(nco.sck.socket()) << std::endl);
+	}
+}
 
-				nco.pfd_index = m_pfds.size();
+void Client::accept_connections(uint16_t bridge)
+{
+	auto & sck = m_tcp_listener_sockets[bridge];
 
-				m_pfds.push_back({nco.sck.socket(), 0, 0});
-				// VECTOR INVALIDATION !!!
-				
-				iter_pfd = m_pfds.begin() + 2 + bridge;
+	do
+	{
+		// Add a connection
+
+		Connection nco;
+		nco.sck = sck.accept();
+		nco.key = 0; // Will receive true value when connection established message is received
+		nco.established = false;
+		nco.credit = early_credit(nco); // Reads early data if the server accepts it
+		nco.compress = m_compression && m_tcp_compress[bridge];
+		nco.idle_timeout = m_tcp_idle[bridge];
+		nco.schedule = m_tcp_schedule[bridge];
+		nco.bridge = bridge;
+		nco.connect_start = monotonic_us();
+
+		if(!nco.sck.valid() && would_block())
+			return;
 
-				// Do not poll for input before connection is confirmed
+		CHECK_RET(nco.sck.valid())
+		CHECK_RET(nco.sck.set_nonblocking())
 
-				key_sock_uni_t unkey = next_unique_key();
+		nco.unkey = next_unique_key();
 
-				std::array<unsigned char, 19> msg = {(unsigned char)(Proto::OpCode::CONNECT)};
-				ENCODE_UINT16(bridge, &msg[1])
-				ENCODE_KEY(nco.sck.socket(), &msg[3])
-				ENCODE_KEY(unkey, &msg[11])
+		LOG("New connection on bridge " << bridge << ", unique key " << nco.unkey << std::endl);
 
-				ComKey ck{key_sock_uni_t(nco.sck.socket()), unkey};
+		// Given to the reactor of its lane before the server can answer. Until the connection is confirmed, it only reads the early data.
+		// The server is asked to connect once the connection has its id, from the main thread which writes the first lane : the early data follows.
+		auto & r = conn_reactor(nco.unkey);
+		auto co = std::make_shared<Connection>(std::move(nco));
+		dispatch(r, [this, &r, bridge, co]{
+			auto unkey = co->unkey;
+			auto id = r.add_connection(std::move(*co));
+			if(!id)
+				return;
 
-				m_connections.emplace(ck, std::move(nco));
+			std::array<unsigned char, 15> msg = {(unsigned char)(Proto::OpCode::CONNECT)};
+			ENCODE_UINT16(bridge, &msg[1])
+			ENCODE_UINT32(id, &msg[3])
+			ENCODE_KEY(unkey, &msg[7])
 
-				CHECK_RET(m_tcp_proto_conn.Send(msg))
+			if(&r == this)
+				send_frame(0, msg);
+			else
+				post([this, msg]{send_frame(0, msg);});
+		});
+	}
+	while(m_poller->edge_triggered());
+}
 
-				CHECK_RET(poll(&(*iter_pfd), 1, 0) >= 0)
-			}
+void Client::check_udp_bridge(uint16_t bridge)
+{
+	auto & sck = m_udp_sockets[bridge];
+	unsigned batches = 0;
 
-			iter_pfd++;
-			bridge++;
-		}
+	do
+	{
+		auto n = m_udp_in.recv(sck.sck, udp_payload());
 
-		// UDP
-		bridge = 0;
-		for(auto & sck : m_udp_sockets)
+		if(n < 0)
 		{
-			while(iter_pfd->revents & pollmask)
+			if(would_block())
+				return;
+#ifdef WIN32
+			auto err = WSAGetLastError();
+			if(err == WSAECONNRESET)
 			{
-				m_message_buffer.resize(m_message_buffer.capacity());
-
-				// Offset by 8 to ensure bypassed header fits
-				auto recres = sck.sck.Recvfrom_raw(m_message_buffer.data() + Proto::udp_message_header_size, m_message_buffer.size() - Proto::udp_message_header_size, sck.addr);
+				LOG("UDP port unreachable on bridge " << bridge << std::endl);
+				continue;
+			}
 
-#ifdef WIN32
-				if(recres < 0)
-				{
-					auto err = WSAGetLastError();
-					if(err == WSAECONNRESET)
-					{
-						LOG("UDP port unreachable on bridge " << bridge << std::endl);
-					}
-					else
-						{
-							std::cout << "err on UDP recv : " << err << std::endl;
-							throw std::runtime_error("Error on UDP recv");
-						}
-				}
+			std::cout << "err on UDP recv : " << err << std::endl;
+			throw std::runtime_error("Error on UDP recv");
 #else
-				CHECK_RET(recres >= 0);
+			CHECK_RET(false)
 #endif
-				LOG("Sending UDP with size " << recres << " to server" << std::endl)
+		}
 
-				send_udp(bridge, recres);
-				
-				CHECK_RET(poll(&(*iter_pfd), 1, 0) >= 0)
-			}
+		LOG("Sending " << n << " UDP datagrams to server" << std::endl)
 
-			iter_pfd++;
-			bridge++;
-		}
+		// Datagrams are received after room for the header
+		for(int i = 0; i != n; ++i)
+			send_udp(bridge, m_udp_in.data(i), m_udp_in.size(i));
 
-		// TCP connections
+		m_udp_out.flush();
 
-		for(;iter_pfd < m_pfds.end(); ++iter_pfd)
+		// Replies go to the last sender
+		if(n)
+			sck.addr = m_udp_in.addr(n - 1);
+
+		if(size_t(n) < m_udp_in.depth())
+			return; // Drained
+
+		// Turn used up : the rest is read after the other sources
+		if(m_poller->edge_triggered() && ++batches == sck.weight)
 		{
-			if(check_conn_pfd(iter_pfd)) break;
+			post([this, bridge]{check_udp_bridge(bridge);});
+			return;
 		}
 	}
+	while(m_poller->edge_triggered());
 }
 
-void Client::process_tcp_message()
+void Client::process_tcp_message(size_t l, const Poller::Event & ev)
 {
-	StatVec<1> opcode;
-	m_tcp_proto_conn.Recv(opcode);
+	auto & tun = lane(l);
 
-	if(opcode.dyn_size == 0)
+	if(!receive_lane(l, ev))
 	{
-		m_tcp_proto_conn.destroy();
+		unwatch(tun);
+		tun.destroy();
 		return;
 	}
 
-	m_last_tcp_packet = m_cur_time;
+	auto & reader = m_readers[l];
 
-	switch(Proto::OpCode(opcode[0]))
+	while(auto size = reader.next(m_bypass_udp, m_compact))
 	{
-	case Proto::OpCode::NOP:
-		return;
-	case Proto::OpCode::MESSAGE:
-		{
-			if(m_bypass_udp) // Check proto!
-			{
-				Proto::Protocol p;
-				CHECK_RET(m_tcp_proto_conn.Recv(p));
-
-				if(p == Proto::Protocol::UDP) // It is UDP
-				{
-					process_bypassed_message();
-					return;
-				}
-				// Otherwise, do as usual...
-			}
-
-			std::array<unsigned char, 20> hdr;
-			CHECK_RET(m_tcp_proto_conn.Recv(hdr, MSG_WAITALL))
-
-			ComKey ck{DECODE_KEY(&hdr[0]), DECODE_KEY(&hdr[8])};
-
-			uint32_t dat_size = DECODE_UINT32(&hdr[16]);
-
-			m_message_buffer.resize(dat_size);
-			CHECK_RET(m_tcp_proto_conn.Recv(m_message_buffer, MSG_WAITALL))
-
-			auto iter_co = m_connections.find(ck);
-			
-			if(iter_co == m_connections.end())
-			{
-				LOG("Message on dead connection " << ck.sk << std::endl);
-				return;
-			}
+		auto frame = reader.frame();
 
-			CHECK_RET(iter_co->second.sck.Send(m_message_buffer))
-			return;
-		}
-	case Proto::OpCode::TCP_DISCONNECTED:
+		switch(Proto::OpCode(frame[0]))
 		{
-			std::array<unsigned char, 16> bridge_dat;
-			CHECK_RET(m_tcp_proto_conn.Recv(bridge_dat, MSG_WAITALL))
-
-			disconnect_tcp<false>({DECODE_KEY(&bridge_dat[0]), DECODE_KEY(&bridge_dat[8])});
-
-			return;
+		case Proto::OpCode::TCP_TIMEOUT:
+			std::cout << "Timeout on other side!" << std::endl;
+			on_timeout();
+			return; // The reader was dropped with the lane
+		default:
+			if(!process_frame(l, frame))
+				throw NetworkError("Unexpected OpCode on TCP");
 		}
-	case Proto::OpCode::TCP_ESTABLISHED:
-		{
-			std::array<unsigned char, 24> keys;
-
-			CHECK_RET(m_tcp_proto_conn.Recv(keys, MSG_WAITALL))
-
-			auto iter_co = m_connections.find(ComKey{DECODE_KEY(&keys[0]), DECODE_KEY(&keys[8])});
 
-			if(iter_co == m_connections.end())
-			{
-				LOG("Dead connection established" << std::endl);
-				return;
-			}
-
-			iter_co->second.key = DECODE_KEY(&keys[16]);
-
-			m_pfds[iter_co->second.pfd_index].events = POLLIN;
-
-			LOG("Connection " << iter_co->second.key << " established" << std::endl);
-		}
-		return;
-	case Proto::OpCode::TCP_TIMEOUT:
-		std::cout << "Timeout on other side!" << std::endl;
-		on_timeout();
-		return;
-	case Proto::OpCode::CONNECT:
-	case Proto::OpCode::UDP_CONNECTED:
-	case Proto::OpCode::CONFIG:
-	default:
-		throw NetworkError("Unexpected OpCode on TCP");
+		reader.consume(size);
 	}
 }
 
 void Client::load_config()
 {
 	std::ifstream cfg_file(m_config_path);
-	std::string proto;
-	std::string chost, shost;
-	port_t cport, sport;
-	while(cfg_file >> proto >> chost >> cport >> shost >> sport)
+	if(!cfg_file)
+		throw std::runtime_error("Error reading config file");
+
+	std::string line;
+	while(std::getline(cfg_file, line))
 	{
+		std::istringstream fields(line);
+		std::string proto;
+		std::string chost, shost;
+		port_t cport, sport;
+
+		if(!(fields >> proto))
+			continue; // Empty line
+
+		if(!(fields >> chost >> cport >> shost >> sport))
+			throw std::runtime_error("Error reading config file");
+
+		// Options after the endpoints
+		unsigned char options = 0;
+		uint32_t idle = 0, connect_timeout = 0;
+		Schedule schedule;
+		for(std::string opt; fields >> opt;)
+		{
+			if(opt == "compress" && proto == "tcp")
+				options |= (unsigned char)(Proto::BridgeOption::COMPRESS);
+			else if(opt.starts_with("idle=") && proto == "tcp")
+			{
+				// In seconds
+				char * end;
+				auto secs = strtoul(opt.c_str() + 5, &end, 10);
+				if(*end || secs == 0 || secs > max_idle_timeout / 1000)
+					throw std::runtime_error("Invalid idle timeout in config file : " + opt);
+				idle = uint32_t(secs * 1000);
+			}
+			else if(opt.starts_with("connect=") && proto == "tcp")
+			{
+				// In seconds
+				char * end;
+				auto secs = strtoul(opt.c_str() + 8, &end, 10);
+				if(*end || secs == 0 || secs > max_connect_timeout / 1000)
+					throw std::runtime_error("Invalid connect timeout in config file : " + opt);
+				connect_timeout = uint32_t(secs * 1000);
+				options |= (unsigned char)(Proto::BridgeOption::CONNECT_TIMEOUT);
+			}
+			else if(opt.starts_with("priority=") && proto == "tcp")
+			{
+				auto cls = opt.substr(9);
+				if(cls == "high")
+					schedule.priority = Proto::Priority::HIGH;
+				else if(cls == "low")
+					schedule.priority = Proto::Priority::LOW;
+				else if(cls != "normal")
+					throw std::runtime_error("Invalid priority in config file : " + opt);
+				options |= (unsigned char)(Proto::BridgeOption::SCHEDULE);
+			}
+			else if(opt.starts_with("weight="))
+			{
+				char * end;
+				auto weight = strtoul(opt.c_str() + 7, &end, 10);
+				if(*end || weight == 0 || weight > 255)
+					throw std::runtime_error("Invalid weight in config file : " + opt);
+				schedule.weight = (unsigned char)(weight);
+				options |= (unsigned char)(Proto::BridgeOption::SCHEDULE);
+			}
+			else
+				throw std::runtime_error("Unknown bridge option in config file : " + opt);
+		}
 
 		Proto::Protocol p;
 
@@ -360,11 +475,14 @@ void Client::load_config()
 			CHECK_RET(listener.create(bind_addr.af(), SOCK_STREAM))
 			CHECK_RET(listener.bind(bind_addr))
 			CHECK_RET(listener.listen(16))
+			CHECK_RET(listener.set_nonblocking())
 
-			m_pfds.insert(m_pfds.end() - m_udp_sockets.size(),
-				{listener.socket(), POLLIN, 0});
+			watch(listener, Source::TCP_LISTENER, m_tcp_listener_sockets.size(), Poller::IN);
 
 			m_tcp_listener_sockets.push_back(std::move(listener));
+			m_tcp_compress.push_back(options & (unsigned char)(Proto::BridgeOption::COMPRESS));
+			m_tcp_idle.push_back(idle);
+			m_tcp_schedule.push_back(schedule);
 
 			p = Proto::Protocol::TCP;
 		}
@@ -376,8 +494,11 @@ void Client::load_config()
 
 			CHECK_RET(cs.sck.create(bind_addr.af(), SOCK_DGRAM))
 			CHECK_RET(cs.sck.bind(bind_addr))
+			CHECK_RET(cs.sck.set_nonblocking())
 			
-			m_pfds.push_back({cs.sck.socket(), POLLIN, 0});
+			watch(cs.sck, Source::UDP_BRIDGE, m_udp_sockets.size(), Poller::IN);
+
+			cs.weight = schedule.weight;
 
 			m_udp_sockets.push_back(std::move(cs));
 
@@ -388,25 +509,49 @@ void Client::load_config()
 
 		std::cout << "Adding bridge " << chost << ':' << cport
 			<< " -> " << shost << ':' << sport
-			<< " on protocol " << proto << std::endl;
+			<< " on protocol " << proto << (options & (unsigned char)(Proto::BridgeOption::COMPRESS) ? " with compression" : "");
+		if(idle)
+			std::cout << ", idle timeout " << idle / 1000 << 's';
+		if(connect_timeout)
+			std::cout << ", connect timeout " << connect_timeout / 1000 << 's';
+		if(schedule.priority != Proto::Priority::NORMAL)
+			std::cout << ", " << (schedule.priority == Proto::Priority::HIGH ? "high" : "low") << " priority";
+		if(schedule.weight != 1)
+			std::cout << ", weight " << int(schedule.weight);
+		std::cout << std::endl;
+
+		bool scheduled = options & (unsigned char)(Proto::BridgeOption::SCHEDULE);
 
 		// Send message to server
-		uint16_t len = 4 + shost.size();
+		uint16_t len = 5 + shost.size() + (connect_timeout ? 4 : 0) + (scheduled ? 2 : 0);
 		std::vector<unsigned char> data;
 		data.reserve(3 + len);
-		data.resize(6);
+		data.resize(7);
 
 		data[0] = (unsigned char)(Proto::OpCode::CONFIG);
 		ENCODE_UINT16(len, data.data() + 1)
 		data[3] = (unsigned char)(p);
 		ENCODE_UINT16(sport, data.data() + 4)
+		data[6] = options;
 		data.insert(data.end(), shost.begin(), shost.end());
 		data.push_back(0);
 
-		CHECK_RET(m_tcp_proto_conn.Send(data))
+		if(connect_timeout)
+		{
+			data.resize(data.size() + 4);
+			ENCODE_UINT32(connect_timeout, &data[data.size() - 4])
+		}
+
+		if(scheduled)
+		{
+			data.push_back((unsigned char)(schedule.priority));
+			data.push_back(schedule.weight);
+		}
+
+		send_frame(0, data);
 	}
 
-	if(!cfg_file.eof())
+	if(cfg_file.bad())
 		throw std::runtime_error("Error reading config file");
 
 	std::cout << "Configuration loaded successfully." << std::endl;
@@ -417,25 +562,44 @@ void Client::on_timeout()
 {
 	std::cout << "Reestablishing connection..." << std::endl;
 
-	m_connections.clear();
-	m_pfds.resize(2 + m_udp_sockets.size() + m_tcp_listener_sockets.size());
+	m_epoch++;
+	m_metrics.reconnects.add();
+
+	stop_workers();
 
-	m_tcp_proto_conn.destroy();
+	if(!m_resume)
+		drop_connections();
+
+	close_lanes();
+
+	auto udp_port = m_proto_udp_address.port();
 
 	if(connect_proto_tcp(false))
 	{
-		m_udp_sockets.clear();
+		// New server : nothing to resume
+		drop_connections();
+		clear_udp_bridges();
 
+		for(auto & sck : m_tcp_listener_sockets)
+			unwatch(sck);
 		m_tcp_listener_sockets.clear();
-		m_connections.clear();
-
-		m_pfds.resize(2);
+		m_tcp_compress.clear();
+		m_tcp_idle.clear();
+		m_tcp_schedule.clear();
 
 		init_post_connection();
 
 		load_config();
 	}
+	else
+	{
+		m_proto_udp_address.set_port(udp_port);
+
+		if(m_resume)
+			resume_session(true);
+	}
+
+	reset_tcp_timeout();
 
-	m_pfds.front().fd = m_tcp_proto_conn.socket();
-	m_last_tcp_packet = m_cur_time = time(nullptr);
+	start_workers();
 }
@@ -9,11 +9,20 @@ class Client : public AppBase
 {
 	const char * m_hostname, * m_config_path;
 	port_t m_tcp_port;
+	std::vector<Address> m_server_addresses; // Kept resolved in the background, so that reconnecting does not wait for the resolver
 
 	std::vector<Socket> m_tcp_listener_sockets;
+	std::vector<bool> m_tcp_compress; // For each TCP bridge
+	std::vector<uint32_t> m_tcp_idle; // Idle timeout of the connections of each TCP bridge in ms, 0 for none
+	std::vector<Schedule> m_tcp_schedule; // Of the connections of each TCP bridge
 
 	key_sock_uni_t m_next_key = 0;
 
+	constexpr static uint32_t max_idle_timeout = 7 * 24 * 3600 * 1000u; // ms, a week
+	constexpr static uint32_t max_connect_timeout = 3600 * 1000u; // ms, an hour
+	constexpr static std::chrono::seconds reconnect_delay{1}; // Between attempts to reach the server again
+	constexpr static int server_connect_timeout = 30000; // ms, to connect to one of the addresses of the server
+
 public:	
 
 	key_sock_uni_t next_unique_key()
@@ -21,20 +30,39 @@ public:
 		return m_next_key++;
 	}
 
-	Client(const char * hostname, port_t port, const char * cfg_file, bool ub) : AppBase(ub),
+	Client(const char * hostname, port_t port, const char * cfg_file, const Options & opts) : AppBase(opts),
 		m_hostname(hostname), m_config_path(cfg_file), m_tcp_port(port)
-	{}
+	{
+		m_resolver.set_handler([this](const std::string & host, const std::vector<Address> & adrs){
+			if(adrs.empty())
+				throw NetworkError("Cannot resolve " + host);
+			set_server_addresses(adrs);
+		});
+	}
+
+	void set_server_addresses(std::vector<Address> adrs)
+	{
+		for(auto & adr : adrs)
+			adr.set_port(m_tcp_port);
+		m_server_addresses = std::move(adrs);
+	}
 
 	void run();
 
 	void initiate();
 	void proc_loop();
 
-	void process_tcp_message();
+	void accept_connections(uint16_t bridge);
+	void check_udp_bridge(uint16_t bridge);
+
+	void process_tcp_message(size_t l, const Poller::Event & ev);
 
 	void load_config();
 
 	bool connect_proto_tcp(bool fresh = true);
+
+	// Open the other lanes of the tunnel, once the first one is connected
+	void connect_lanes(const Address & srv);
 	
 	void on_timeout();
 
@@ -0,0 +1,182 @@
+#ifndef FRAME_READER_HPP
+#define FRAME_READER_HPP
+
+#include "socket.hpp"
+#include "ral_proto.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Frames received on a tunnel lane, read without blocking or given by the backend : one read gives all the frames received so far,
+// and a partial frame waits in the buffer for the rest.
+class FrameReader
+{
+	std::vector<unsigned char> m_buffer; // Allocated on the first read
+	size_t m_begin = 0, m_end = 0; // Received data not yet processed
+
+	// Room for at least size more bytes after the data
+	void reserve(size_t size)
+	{
+		if(m_begin == m_end)
+			m_begin = m_end = 0;
+		else if(m_begin && (m_buffer.size() - m_end < m_buffer.size() / 4 || m_buffer.size() - m_end < size))
+		{
+			// Partial frame moved to the front
+			memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+			m_end -= m_begin;
+			m_begin = 0;
+		}
+
+		if(m_buffer.empty())
+			m_buffer.resize(std::max(initial_size, size));
+		while(m_buffer.size() - m_end < size)
+			m_buffer.resize(m_buffer.size() * 2); // Frame larger than the buffer
+	}
+
+public:
+	constexpr static size_t initial_size = 256 << 10;
+	constexpr static size_t max_frame_size = 2 << 20; // Above the largest payload with its header, larger frames are a protocol error
+
+	// Receive what the lane has available. Returns the byte count, 0 if the lane was closed, or -1 on error (would_block() if nothing was available).
+	int fill(Socket & sck)
+	{
+		reserve(1);
+
+		int res;
+		do
+			res = sck.Recv_available(m_buffer.data() + m_end, m_buffer.size() - m_end);
+		while(res < 0 && interrupted());
+
+		if(res > 0)
+			m_end += res;
+		return res;
+	}
+
+	// Add bytes the backend received from the lane
+	void append(const unsigned char * data, size_t size)
+	{
+		reserve(size);
+		memcpy(m_buffer.data() + m_end, data, size);
+		m_end += size;
+	}
+
+	// Size of the frame at the front if it was received whole, 0 otherwise. Bypassed UDP messages are carried by MESSAGE frames with bypass.
+	// TCP messages have compact headers if negotiated.
+	size_t next(bool bypass, bool compact) const
+	{
+		const unsigned char * f = m_buffer.data() + m_begin;
+		size_t avail = m_end - m_begin;
+
+		if(avail == 0)
+			return 0;
+
+		size_t size;
+
+		switch(Proto::OpCode(f[0]))
+		{
+		case Proto::OpCode::NOP:
+		case Proto::OpCode::TCP_TIMEOUT:
+			return 1;
+		case Proto::OpCode::CONFIG:
+			{
+				if(avail < 3)
+					return 0;
+				uint16_t len = DECODE_UINT16(f + 1);
+				size = 3 + len;
+				break;
+			}
+		case Proto::OpCode::MESSAGE:
+			{
+				size_t head = 1;
+				if(bypass)
+				{
+					if(avail < 2)
+						return 0;
+
+					if(Proto::Protocol(f[1]) == Proto::Protocol::UDP)
+					{
+						if(avail < Proto::udp_message_header_size)
+							return 0;
+						uint32_t len = DECODE_UINT32(f + 4);
+						size = Proto::udp_message_header_size + size_t(len);
+						break;
+					}
+					head = 2;
+				}
+
+				if(compact)
+					return compact_size(f, avail, head, false);
+
+				if(avail < head + 8)
+					return 0;
+				uint32_t len = DECODE_UINT32(f + head + 4);
+				len &= ~Proto::compressed_payload;
+				size = head + 8 + size_t(len);
+				break;
+			}
+		case Proto::OpCode::SHORT_MESSAGE:
+			if(!compact)
+				throw NetworkError("Unexpected OpCode on TCP");
+			return compact_size(f, avail, 1, true);
+		case Proto::OpCode::CONNECT:
+			size = 15;
+			break;
+		case Proto::OpCode::TCP_DISCONNECTED:
+			size = 5;
+			break;
+		case Proto::OpCode::TCP_ESTABLISHED:
+			size = 9;
+			break;
+		case Proto::OpCode::WINDOW_UPDATE:
+			size = 9;
+			break;
+		case Proto::OpCode::PING:
+			size = Proto::ping_size;
+			break;
+		case Proto::OpCode::PONG:
+			size = Proto::pong_size;
+			break;
+		case Proto::OpCode::EARLY_DATA:
+			{
+				if(avail < Proto::early_data_header_size)
+					return 0;
+				uint32_t len = DECODE_UINT32(f + 9);
+				size = Proto::early_data_header_size + size_t(len);
+				break;
+			}
+		default:
+			throw NetworkError("Unexpected OpCode on TCP");
+		}
+
+		if(size > max_frame_size)
+			throw NetworkError("Frame too large on TCP");
+
+		return avail >= size ? size : 0;
+	}
+
+	// Size of a TCP message with a compact header after head bytes, if received whole
+	static size_t compact_size(const unsigned char * f, size_t avail, size_t head, bool is_short)
+	{
+		uint32_t id, len;
+		int res = Proto::decode_compact_header(f + head, avail - head, is_short, id, len);
+		if(res < 0)
+			throw NetworkError("Malformed message header on TCP");
+		if(res == 0)
+			return 0;
+
+		size_t size = head + size_t(res) + (len & ~Proto::compressed_payload);
+		if(size > max_frame_size)
+			throw NetworkError("Frame too large on TCP");
+
+		return avail >= size ? size : 0;
+	}
+
+	// The frame at the front, valid until the next read
+	unsigned char * frame() {return m_buffer.data() + m_begin;}
+
+	void consume(size_t size) {m_begin += size;}
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef LZ_HPP
+#define LZ_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Fast compression of message payloads, in the LZ4 block format : sequences of literals followed by a match in the last 64KB.
+namespace Lz
+{
+	constexpr size_t max_block_size = 1 << 16; // Positions are kept on 16 bits
+
+	// Worst case compressed size
+	constexpr size_t bound(size_t size) {return size + size / 255 + 16;}
+
+	namespace detail
+	{
+		constexpr int hash_log = 12;
+		constexpr size_t min_match = 4;
+		constexpr size_t last_literals = 5; // The block ends with literals
+		constexpr size_t match_limit = 12; // No match starts in the last bytes
+		constexpr int skip_trigger = 6; // Positions searched since the last match before skipping some
+
+		inline uint32_t read32(const unsigned char * p)
+		{
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		// Length of the common prefix of two positions, up to max_len
+		inline size_t match_length(const unsigned char * a, const unsigned char * b, size_t max_len)
+		{
+			size_t len = 0;
+			while(len + 8 <= max_len)
+			{
+				uint64_t x, y;
+				memcpy(&x, a + len, 8);
+				memcpy(&y, b + len, 8);
+				if(x != y)
+				{
+					if constexpr(std::endian::native == std::endian::little)
+						return len + (std::countr_zero(x ^ y) >> 3);
+					else
+						return len + (std::countl_zero(x ^ y) >> 3);
+				}
+				len += 8;
+			}
+			while(len < max_len && a[len] == b[len])
+				len++;
+			return len;
+		}
+
+		inline uint32_t hash(uint32_t v)
+		{
+			return (v * 2654435761u) >> (32 - hash_log);
+		}
+
+		// Write a length beyond its 4 bits in the token
+		inline bool write_length(unsigned char *& op, const unsigned char * oend, size_t len)
+		{
+			for(; len >= 255; len -= 255)
+			{
+				if(op == oend) return false;
+				*op++ = 255;
+			}
+			if(op == oend) return false;
+			*op++ = (unsigned char)(len);
+			return true;
+		}
+
+		// Write literals and a match, or only literals for the last sequence (match_len 0)
+		inline bool write_sequence(unsigned char *& op, const unsigned char * oend, const unsigned char * lit, size_t lit_len, size_t offset, size_t match_len)
+		{
+			if(op == oend) return false;
+			unsigned char * token = op++;
+
+			*token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+			if(lit_len >= 15 && !write_length(op, oend, lit_len - 15))
+				return false;
+
+			if(size_t(oend - op) < lit_len)
+				return false;
+			if(lit_len)
+				memcpy(op, lit, lit_len);
+			op += lit_len;
+
+			if(!match_len)
+				return true;
+
+			if(oend - op < 2) return false;
+			*op++ = (unsigned char)(offset);
+			*op++ = (unsigned char)(offset >> 8);
+
+			size_t m = match_len - min_match;
+			*token |= (unsigned char)(m < 15 ? m : 15);
+			return m < 15 || write_length(op, oend, m - 15);
+		}
+	}
+
+	// Compress a block of at most max_block_size bytes. Returns the compressed size, or 0 if it would exceed the capacity.
+	inline size_t compress(const unsigned char * src, size_t size, unsigned char * dst, size_t capacity)
+	{
+		using namespace detail;
+
+		if(size > max_block_size)
+			return 0;
+
+		uint16_t table[1 << hash_log] = {}; // Last position of each hashed sequence
+		unsigned char * op = dst;
+		const unsigned char * oend = dst + capacity;
+
+		size_t anchor = 0; // Start of the pending literals
+		size_t ip = 0;
+
+		while(ip + match_limit <= size)
+		{
+			uint32_t seq = read32(src + ip);
+			uint32_t h = hash(seq);
+			size_t ref = table[h];
+			table[h] = uint16_t(ip);
+
+			if(ref >= ip || read32(src + ref) != seq)
+			{
+				// Faster over data without matches
+				ip += 1 + ((ip - anchor) >> skip_trigger);
+				continue;
+			}
+
+			size_t len = min_match + match_length(src + ref + min_match, src + ip + min_match, size - last_literals - ip - min_match);
+
+			// Extend backwards over the pending literals
+			while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+			{
+				ip--;
+				ref--;
+				len++;
+			}
+
+			if(!write_sequence(op, oend, src + anchor, ip - anchor, ip - ref, len))
+				return 0;
+
+			ip += len;
+			anchor = ip;
+		}
+
+		if(!write_sequence(op, oend, src + anchor, size - anchor, 0, 0))
+			return 0;
+
+		return op - dst;
+	}
+
+	// Decompress a block. Returns the decompressed size, or -1 if the block is malformed or does not fit in the capacity.
+	inline ptrdiff_t decompress(const unsigned char * src, size_t size, unsigned char * dst, size_t capacity)
+	{
+		size_t ip = 0, op = 0;
+
+		auto read_length = [&](size_t & len)
+		{
+			unsigned char b;
+			do
+			{
+				if(ip == size) return false;
+				b = src[ip++];
+				len += b;
+			}
+			while(b == 255);
+			return true;
+		};
+
+		for(;;)
+		{
+			if(ip == size) return -1;
+			unsigned char token = src[ip++];
+
+			size_t lit_len = token >> 4;
+			if(lit_len == 15 && !read_length(lit_len))
+				return -1;
+
+			if(lit_len > size - ip || lit_len > capacity - op)
+				return -1;
+			if(lit_len)
+				memcpy(dst + op, src + ip, lit_len);
+			ip += lit_len;
+			op += lit_len;
+
+			// The last sequence has no match
+			if(ip == size)
+				return op;
+
+			if(size - ip < 2) return -1;
+			size_t offset = src[ip] | size_t(src[ip + 1]) << 8;
+			ip += 2;
+
+			if(offset == 0 || offset > op)
+				return -1;
+
+			size_t len = token & 15;
+			if(len == 15 && !read_length(len))
+				return -1;
+			len += detail::min_match;
+
+			if(len > capacity - op)
+				return -1;
+
+			if(offset >= len)
+				memcpy(dst + op, dst + op - offset, len);
+			else
+			{
+				// Byte by byte : the match overlaps what it writes
+				for(size_t i = 0; i != len; ++i)
+					dst[op + i] = dst[op + i - offset];
+			}
+			op += len;
+		}
+	}
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "socket.hpp"
 #include "client.h"
 #include "server.h"
+#include "multi_server.h"
 
 #include <algorithm>
 #include <cstdlib>
@@ -13,15 +14,78 @@ constexpr const char * usage =
 	"Usage : rallonge <client / server> [client / server params] <options>\n\n"
 
 	"options:\n"
-	"\t--udp-bypass -ub\tbypass udp connection (transmit udp messages over tcp and do not establish udp connection\n\n"
+	"\t--udp-bypass -ub\tbypass udp connection (transmit udp messages over tcp and do not establish udp connection\n"
+	"\t--io-uring -iu\tuse the io_uring backend (Linux), falls back to epoll if unavailable\n"
+	"\t--window -w <KB>\tinitial flow control window of each connection (default 1024)\n"
+	"\t--lanes -l <n>\tclient only, stripe the tunnel over n TCP connections (default 1)\n"
+	"\t--threads -t <n>\tforward connections on n threads, each with its own lanes (default 1)\n"
+	"\t--batch-latency -bl <us>\tdelay a frame may wait to be sent with the next ones, 0 to send frames at once (default 200)\n"
+	"\t--udp-batch -ubt <n>\tdatagrams received or sent with one system call (default 32)\n"
+	"\t--udp-gso -gso\tsend and receive runs of equal datagrams of the UDP channel as one (Linux), if the kernel supports it\n"
+	"\t--frame-size -fs <KB>\tlargest payload of a tunnel frame, the smaller one of both sides is used (default 16, up to 1024)\n"
+	"\t--zerocopy -zc\tsend large batches of tunnel frames without copying them (Linux MSG_ZEROCOPY)\n"
+	"\t--no-resume -nr\tdrop the connections when the tunnel is reestablished, instead of keeping the data they sent until it is delivered\n"
+	"\t--dns-ttl -dt <s>\thost names are resolved again in the background after this delay (default 60)\n"
+	"\t--metrics -mt <port>\tserve counters and histograms as Prometheus text on this port of the loopback\n"
+	"\t--multi -m\tserver only, accept any number of clients, each in its own session and thread\n\n"
 
 	"Client usage:\n"
 	"rallonge client <server hostname> <server port> <config file>\n\n"
 
 	"Server usage:\n"
-	"rallonge server <tcp port>\n"
+	"rallonge server <tcp port> <options>\n"
 ;
 
+// Check if an option is given, in long or short form
+static bool has_option(char ** begin, char ** end, const char * long_form, const char * short_form)
+{
+	return std::any_of(begin, end, [=](const char * arg){
+		return strcmp(arg, long_form) == 0 ||
+			strcmp(arg, short_form) == 0;
+	});
+}
+
+// Get the value following an option, or nullptr if it is not given
+static const char * option_value(char ** begin, char ** end, const char * long_form, const char * short_form)
+{
+	auto it = std::find_if(begin, end, [=](const char * arg){
+		return strcmp(arg, long_form) == 0 ||
+			strcmp(arg, short_form) == 0;
+	});
+	return it != end && it + 1 != end ? *(it + 1) : nullptr;
+}
+
+// Options common to client and server
+static void parse_options(AppBase::Options & opts, char ** begin, char ** end)
+{
+	opts.io_uring = has_option(begin, end, "--io-uring", "-iu");
+
+	if(auto win = option_value(begin, end, "--window", "-w"))
+		opts.window = uint32_t(atoi(win)) * 1024;
+
+	if(auto threads = option_value(begin, end, "--threads", "-t"))
+		opts.threads = std::clamp(atoi(threads), 1, int(AppBase::max_lanes));
+
+	if(auto latency = option_value(begin, end, "--batch-latency", "-bl"))
+		opts.batch_latency = std::max(atoi(latency), 0);
+
+	if(auto depth = option_value(begin, end, "--udp-batch", "-ubt"))
+		opts.udp_batch = std::clamp(atoi(depth), 1, int(AppBase::max_udp_batch));
+
+	opts.udp_gso = has_option(begin, end, "--udp-gso", "-gso");
+	opts.zerocopy = has_option(begin, end, "--zerocopy", "-zc");
+	opts.resume = !has_option(begin, end, "--no-resume", "-nr");
+
+	if(auto size = option_value(begin, end, "--frame-size", "-fs"))
+		opts.frame_payload = size_t(std::clamp(atoi(size), 1, int(AppBase::max_frame_payload >> 10))) << 10;
+
+	if(auto ttl = option_value(begin, end, "--dns-ttl", "-dt"))
+		opts.dns_ttl = unsigned(std::max(atoi(ttl), 1));
+
+	if(auto port = option_value(begin, end, "--metrics", "-mt"))
+		opts.metrics_port = port_t(std::clamp(atoi(port), 0, 65535));
+}
+
 int main(int argc, char * argv[])
 {
 	if(argc < 2)
@@ -47,25 +111,40 @@ int main(int argc, char * argv[])
 				return 0;
 			}
 
-			// Check if bypass
-			bool bp = std::any_of(argv + 5, argv + argc, [](const char * arg){
-				return strcmp(arg, "--udp-bypass") == 0 ||
-					strcmp(arg, "-ub") == 0;
-			});
+			AppBase::Options opts;
+			opts.bypass_udp = has_option(argv + 5, argv + argc, "--udp-bypass", "-ub");
+			parse_options(opts, argv + 5, argv + argc);
+
+			if(auto lanes = option_value(argv + 5, argv + argc, "--lanes", "-l"))
+				opts.lanes = std::clamp(atoi(lanes), 1, int(AppBase::max_lanes));
 
-			Client cl(argv[2], port_t(atoi(argv[3])), argv[4], bp);
+			// Each thread needs a lane of its own
+			opts.lanes = std::max(opts.lanes, opts.threads);
+
+			Client cl(argv[2], port_t(atoi(argv[3])), argv[4], opts);
 			cl.run();
 		}
 		else if (strcmp(argv[1],  "server") == 0)
 		{
-				if(argc != 3)
+				if(argc < 3)
 				{
 					std::cout << usage;
 					return 0;
 				}
 
-				Server srv(port_t(atoi(argv[2])));
-				srv.run();
+				AppBase::Options opts;
+				parse_options(opts, argv + 3, argv + argc);
+
+				if(has_option(argv + 3, argv + argc, "--multi", "-m"))
+				{
+					MultiServer srv(port_t(atoi(argv[2])), opts);
+					srv.run();
+				}
+				else
+				{
+					Server srv(port_t(atoi(argv[2])), opts);
+					srv.run();
+				}
 		}
 		else
 		{
@@ -0,0 +1,341 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Counter written by a single thread and read by any : a relaxed load and store, without the cost of an atomic increment
+class Counter
+{
+	std::atomic<uint64_t> m_value = 0;
+
+public:
+	void add(uint64_t n = 1) {m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);}
+	uint64_t value() const {return m_value.load(std::memory_order_relaxed);}
+};
+
+// Value set by a single thread and read by any
+class Gauge
+{
+	std::atomic<uint64_t> m_value = 0;
+
+public:
+	void set(uint64_t v) {m_value.store(v, std::memory_order_relaxed);}
+	uint64_t value() const {return m_value.load(std::memory_order_relaxed);}
+};
+
+// Log-linear histogram of integers, as HDR histograms : each power of two is split in 2^sub_bits buckets, so a value is known within 1/2^sub_bits.
+// Values up to 2^(MaxExp + 1) are bucketed, larger ones fall in the last bucket.
+template<unsigned MaxExp>
+class Histogram
+{
+public:
+	constexpr static unsigned sub_bits = 2;
+	constexpr static size_t n_buckets = size_t(MaxExp - sub_bits + 2) << sub_bits;
+
+private:
+	std::array<Counter, n_buckets> m_buckets;
+	Counter m_sum;
+
+public:
+	static size_t bucket(uint64_t v)
+	{
+		if(v < (1u << sub_bits))
+			return size_t(v);
+
+		// The exponent gives the group, the bits after the leading one the bucket within it
+		unsigned exp = 63 - std::countl_zero(v);
+		size_t idx = size_t(exp - sub_bits + 1) << sub_bits | (size_t(v >> (exp - sub_bits)) & ((1u << sub_bits) - 1));
+		return std::min(idx, n_buckets - 1);
+	}
+
+	// Largest value of a bucket
+	static uint64_t upper(size_t idx)
+	{
+		if(idx < (1u << sub_bits))
+			return idx;
+
+		unsigned shift = unsigned(idx >> sub_bits) - 1;
+		return ((uint64_t((1u << sub_bits) | (idx & ((1u << sub_bits) - 1))) + 1) << shift) - 1;
+	}
+
+	void record(uint64_t v)
+	{
+		m_buckets[bucket(v)].add();
+		m_sum.add(v);
+	}
+
+	uint64_t count(size_t idx) const {return m_buckets[idx].value();}
+	uint64_t sum() const {return m_sum.value();}
+};
+
+// Metrics of a reactor, only written by its thread. They are summed over the reactors when scraped.
+struct Metrics
+{
+	constexpr static size_t max_bridges = 256; // The bridges after share the last slot
+
+	// Payload bytes and messages of a bridge : out is read from the endpoints and sent through the tunnel, in is received from the tunnel
+	struct Traffic
+	{
+		Counter bytes_in, bytes_out, frames_in, frames_out;
+	};
+
+	std::array<Traffic, max_bridges + 1> tcp, udp;
+
+	Counter opened, closed; // Connections
+	Counter connects, connect_failures; // Of connections to their endpoint, on the client as answered by the server
+	Counter connect_timeouts, idle_timeouts, lane_timeouts;
+	Counter reconnects; // Of the tunnel, on the main thread
+
+	Histogram<25> connect_latency; // us, up to a minute
+	Histogram<20> frame_in, frame_out; // Payload sizes, up to the largest frame payload
+
+	Traffic & tcp_traffic(uint16_t bridge) {return tcp[std::min<size_t>(bridge, max_bridges)];}
+	Traffic & udp_traffic(uint16_t bridge) {return udp[std::min<size_t>(bridge, max_bridges)];}
+};
+
+// Monotonic time in microseconds, for latencies
+inline uint64_t monotonic_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Round trip time of a channel of the tunnel from its pings, smoothed as TCP does (RFC 6298), and the jitter of the delay of each direction (RFC 3550).
+// A pong carries the time of the ping and the time it was answered, by the clock of the other side : the delays of each direction are offset
+// by the difference of the clocks, which cancels out in their variations. Written by the thread of the channel, read when scraped.
+class RttEstimator
+{
+	Gauge m_srtt, m_rttvar, m_min_rtt; // us
+	Gauge m_jitter_out, m_jitter_in; // us, towards the other side and back
+	Counter m_pings, m_pongs;
+	int64_t m_last_out = 0, m_last_in = 0;
+
+	static uint64_t distance(int64_t a, int64_t b) {return uint64_t(a > b ? a - b : b - a);}
+
+public:
+	void ping_sent() {m_pings.add();}
+
+	// A pong, for a ping sent at sent and answered at answered by the other side, received at now
+	void sample(uint64_t sent, uint64_t answered, uint64_t now)
+	{
+		if(now < sent)
+			return; // Not a ping of ours
+
+		int64_t rtt = int64_t(now - sent);
+		int64_t out = int64_t(answered - sent), in = int64_t(now - answered);
+
+		if(!sampled())
+		{
+			m_srtt.set(rtt);
+			m_rttvar.set(rtt / 2);
+			m_min_rtt.set(rtt);
+		}
+		else
+		{
+			int64_t srtt = m_srtt.value();
+			m_rttvar.set((3 * m_rttvar.value() + distance(srtt, rtt)) / 4);
+			m_srtt.set((7 * srtt + rtt) / 8);
+			m_min_rtt.set(std::min(m_min_rtt.value(), uint64_t(rtt)));
+
+			m_jitter_out.set(m_jitter_out.value() + (int64_t(distance(out, m_last_out)) - int64_t(m_jitter_out.value())) / 16);
+			m_jitter_in.set(m_jitter_in.value() + (int64_t(distance(in, m_last_in)) - int64_t(m_jitter_in.value())) / 16);
+		}
+
+		m_last_out = out;
+		m_last_in = in;
+		m_pongs.add();
+	}
+
+	bool sampled() const {return m_pongs.value();}
+
+	uint64_t srtt() const {return m_srtt.value();}
+	uint64_t rttvar() const {return m_rttvar.value();}
+	uint64_t min_rtt() const {return m_min_rtt.value();}
+	uint64_t jitter_out() const {return m_jitter_out.value();}
+	uint64_t jitter_in() const {return m_jitter_in.value();}
+	uint64_t pings() const {return m_pings.value();}
+	uint64_t pongs() const {return m_pongs.value();}
+
+	// Retransmission timeout of TCP (RFC 6298), in us
+	uint64_t rto() const {return srtt() + 4 * rttvar();}
+};
+
+// Prometheus text exposition of the metrics of all the reactors, and of the round trip times of the channels
+class MetricsWriter
+{
+public:
+	typedef std::vector<std::pair<std::string, const RttEstimator *>> Channels; // With their labels
+
+private:
+	const std::vector<const Metrics *> & m_all;
+	const Channels & m_channels;
+	std::string m_out;
+
+	static std::string seconds(uint64_t us)
+	{
+		char s[32];
+		snprintf(s, sizeof(s), "%.6f", double(us) / 1e6);
+		return s;
+	}
+
+	template<typename F>
+	uint64_t total(F && f) const
+	{
+		uint64_t sum = 0;
+		for(auto m : m_all)
+			sum += f(*m);
+		return sum;
+	}
+
+	void header(const char * name, const char * type, const char * help)
+	{
+		m_out += "# HELP ";
+		m_out += name;
+		m_out += ' ';
+		m_out += help;
+		m_out += "\n# TYPE ";
+		m_out += name;
+		m_out += ' ';
+		m_out += type;
+		m_out += '\n';
+	}
+
+	void sample(const char * name, const std::string & labels, uint64_t value)
+	{
+		m_out += name;
+		if(!labels.empty())
+		{
+			m_out += '{';
+			m_out += labels;
+			m_out += '}';
+		}
+		m_out += ' ';
+		m_out += std::to_string(value);
+		m_out += '\n';
+	}
+
+	void scalar(const char * name, const char * type, const char * help, Counter Metrics::* c)
+	{
+		header(name, type, help);
+		sample(name, "", total([c](const Metrics & m){return (m.*c).value();}));
+	}
+
+	void traffic(const char * name, const char * help, Counter Metrics::Traffic::* in, Counter Metrics::Traffic::* out)
+	{
+		header(name, "counter", help);
+
+		for(const char * proto : {"tcp", "udp"})
+		{
+			auto bridges = proto[0] == 't' ? &Metrics::tcp : &Metrics::udp;
+
+			// Bridges which carried nothing yet are left out
+			for(size_t b = 0; b <= Metrics::max_bridges; ++b)
+			{
+				uint64_t vin = total([&](const Metrics & m){return ((m.*bridges)[b].*in).value();});
+				uint64_t vout = total([&](const Metrics & m){return ((m.*bridges)[b].*out).value();});
+				if(!vin && !vout)
+					continue;
+
+				std::string labels = std::string("proto=\"") + proto + "\",bridge=\"" + (b == Metrics::max_bridges ? "other" : std::to_string(b)) + '"';
+				sample(name, labels + ",direction=\"in\"", vin);
+				sample(name, labels + ",direction=\"out\"", vout);
+			}
+		}
+	}
+
+	// Buckets given in seconds for a histogram in us
+	template<unsigned MaxExp>
+	void histogram(const char * name, const char * help, Histogram<MaxExp> Metrics::* h, const std::string & labels, bool us)
+	{
+		if(help)
+			header(name, "histogram", help);
+
+		std::string prefix = labels.empty() ? "" : labels + ',';
+		std::string bucket = std::string(name) + "_bucket";
+		uint64_t cumulated = 0;
+
+		for(size_t idx = 0; idx != Histogram<MaxExp>::n_buckets; ++idx)
+		{
+			cumulated += total([&](const Metrics & m){return (m.*h).count(idx);});
+
+			char le[32] = "+Inf";
+			if(idx + 1 != Histogram<MaxExp>::n_buckets)
+			{
+				auto upper = Histogram<MaxExp>::upper(idx);
+				snprintf(le, sizeof(le), "%s", (us ? seconds(upper) : std::to_string(upper)).c_str());
+			}
+			sample(bucket.c_str(), prefix + "le=\"" + le + '"', cumulated);
+		}
+
+		uint64_t sum = total([&](const Metrics & m){return (m.*h).sum();});
+		m_out += std::string(name) + "_sum" + (labels.empty() ? "" : '{' + labels + '}') + ' ' + (us ? seconds(sum) : std::to_string(sum)) + '\n';
+
+		sample((std::string(name) + "_count").c_str(), labels, cumulated);
+	}
+
+	// A gauge in seconds or a counter of each channel measured, from a value in us or a count
+	void channels(const char * name, const char * type, const char * help, uint64_t (RttEstimator::* get)() const, const char * labels = nullptr)
+	{
+		if(help)
+			header(name, type, help);
+
+		for(auto & [channel, rtt] : m_channels)
+		{
+			// Gauges once measured, counters always
+			if(!rtt->sampled() && type[0] == 'g')
+				continue;
+
+			std::string l = labels ? channel + ',' + labels : channel;
+			uint64_t v = (rtt->*get)();
+			m_out += std::string(name) + '{' + l + "} " + (type[0] == 'g' ? seconds(v) : std::to_string(v)) + '\n';
+		}
+	}
+
+public:
+	MetricsWriter(const std::vector<const Metrics *> & all, const Channels & channels) : m_all(all), m_channels(channels) {}
+
+	std::string write()
+	{
+		traffic("rallonge_bridge_bytes_total", "Payload bytes of the bridges, out from the endpoints into the tunnel, in from the tunnel.", &Metrics::Traffic::bytes_in, &Metrics::Traffic::bytes_out);
+		traffic("rallonge_bridge_frames_total", "Messages of the bridges, out from the endpoints into the tunnel, in from the tunnel.", &Metrics::Traffic::frames_in, &Metrics::Traffic::frames_out);
+
+		// Closed counts are read first : a connection opened and closed meanwhile is not missed
+		header("rallonge_connections_active", "gauge", "TCP connections through the tunnel.");
+		uint64_t closed = total([](const Metrics & m){return m.closed.value();});
+		uint64_t opened = total([](const Metrics & m){return m.opened.value();});
+		sample("rallonge_connections_active", "", opened - std::min(opened, closed));
+
+		scalar("rallonge_connections_opened_total", "counter", "TCP connections opened through the tunnel.", &Metrics::opened);
+		scalar("rallonge_connects_total", "counter", "Connects to the endpoints which succeeded.", &Metrics::connects);
+		scalar("rallonge_connect_failures_total", "counter", "Connects to the endpoints which failed, timed out or were refused.", &Metrics::connect_failures);
+		scalar("rallonge_connect_timeouts_total", "counter", "Connects to the endpoints which timed out.", &Metrics::connect_timeouts);
+		scalar("rallonge_idle_timeouts_total", "counter", "Connections dropped after their idle timeout.", &Metrics::idle_timeouts);
+		scalar("rallonge_lane_timeouts_total", "counter", "Lanes of the tunnel which timed out.", &Metrics::lane_timeouts);
+		scalar("rallonge_reconnects_total", "counter", "Times the tunnel was reestablished.", &Metrics::reconnects);
+
+		histogram("rallonge_connect_latency_seconds", "Delay until a connection reaches its endpoint, through the tunnel on the client.", &Metrics::connect_latency, "", true);
+		histogram("rallonge_frame_payload_bytes", "Payload sizes of the messages of the bridges, out from the endpoints into the tunnel, in from the tunnel.", &Metrics::frame_in, "direction=\"in\"", false);
+		histogram("rallonge_frame_payload_bytes", nullptr, &Metrics::frame_out, "direction=\"out\"", false);
+
+		channels("rallonge_tunnel_rtt_seconds", "gauge", "Smoothed round trip time of the channels of the tunnel, from their pings.", &RttEstimator::srtt);
+		channels("rallonge_tunnel_rtt_variation_seconds", "gauge", "Variation of the round trip time of the channels of the tunnel.", &RttEstimator::rttvar);
+		channels("rallonge_tunnel_rtt_min_seconds", "gauge", "Smallest round trip time of the channels of the tunnel.", &RttEstimator::min_rtt);
+		channels("rallonge_tunnel_jitter_seconds", "gauge", "Jitter of the one way delay of the channels of the tunnel, out to the other side and in from it.", &RttEstimator::jitter_out, "direction=\"out\"");
+		channels("rallonge_tunnel_jitter_seconds", "gauge", nullptr, &RttEstimator::jitter_in, "direction=\"in\"");
+		channels("rallonge_tunnel_pings_total", "counter", "Pings sent on the channels of the tunnel.", &RttEstimator::pings);
+		channels("rallonge_tunnel_pongs_total", "counter", "Answers received to the pings of the channels of the tunnel.", &RttEstimator::pongs);
+
+		return std::move(m_out);
+	}
+};
+
+#endif
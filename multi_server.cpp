@@ -0,0 +1,195 @@
+#include "multi_server.h"
+#include "app_base.h"
+#include "ral_proto.h"
+#include "socket.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+
+void MultiServer::run()
+{
+#ifdef __unix__
+	// A client going away should only end its session
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	Address adr(AF_INET, SOCK_STREAM, "0.0.0.0", m_tcp_port);
+
+	CHECK_RET(m_listener.create(AF_INET, SOCK_STREAM))
+	CHECK_RET(m_listener.bind(adr))
+	CHECK_RET(m_listener.listen(AppBase::max_lanes))
+
+	std::cout << "Listening on port " << m_tcp_port << " for any number of clients." << std::endl;
+
+	// Each session would need its own port
+	if(m_options.metrics_port)
+	{
+		std::cout << "Metrics are not served by a multi-client server." << std::endl;
+		m_options.metrics_port = 0;
+	}
+
+	while(true)
+	{
+		// The listener, then the connections in their handshake
+		std::vector<pollfd> fds = {{m_listener.socket(), POLLIN, 0}};
+		for(auto & hs : m_handshakes)
+			fds.push_back({hs.sck.socket(), POLLIN, 0});
+
+		int res = poll(fds.data(), fds.size(), check_interval);
+		CHECK_RET(res >= 0 || interrupted())
+
+		for(size_t i = 1; i < fds.size() && res > 0; ++i)
+		{
+			if(!fds[i].revents)
+				continue;
+
+			auto & hs = m_handshakes[i - 1];
+			try
+			{
+				if(continue_handshake(hs))
+					hs.sck.destroy(); // Left by the socket given to the session
+			}
+			catch(const std::runtime_error & e)
+			{
+				std::cout << "Rejected a connection : " << e.what() << std::endl;
+				hs.sck.destroy();
+			}
+		}
+		std::erase_if(m_handshakes, [](const Handshake & hs){return !hs.sck.valid();});
+
+		drop_expired();
+
+		if(res > 0 && fds[0].revents)
+			accept_connection();
+	}
+}
+
+void MultiServer::accept_connection()
+{
+	auto [sck, addr] = m_listener.accept_addr();
+	if(!sck.valid())
+		return;
+
+	Proto::OpCode establish = Proto::OpCode::ESTABLISH;
+	if(!sck.set_nonblocking() || sck.Send(establish) <= 0)
+		return;
+
+	auto & hs = m_handshakes.emplace_back();
+	hs.sck = std::move(sck);
+	hs.addr = std::move(addr);
+	hs.deadline = std::chrono::steady_clock::now() + handshake_timeout;
+}
+
+bool MultiServer::continue_handshake(Handshake & hs)
+{
+	// A byte at a time : what follows the handshake is read by the session
+	for(;;)
+	{
+		unsigned char byte;
+		auto res = hs.sck.Recv_available(&byte, 1);
+		if(res < 0 && (would_block() || interrupted()))
+			return false;
+		if(res <= 0)
+			throw NetworkError("closed during the handshake");
+
+		if(!hs.established)
+		{
+			hs.established = Proto::OpCode(byte) == Proto::OpCode::ESTABLISH;
+			if(!hs.established && ++hs.skipped > Server::max_skipped)
+				throw NetworkError("no ESTABLISH");
+			continue;
+		}
+
+		auto & msg = hs.received;
+		msg.push_back(byte);
+
+		if(Proto::Connection(msg[0]) == Proto::Connection::LANE)
+		{
+			// Session id and lane index
+			if(msg.size() != 10)
+				continue;
+
+			uint64_t id;
+			memcpy(&id, &msg[1], sizeof(id));
+			unsigned l = msg[9];
+
+			auto pending = std::find_if(m_pending.begin(), m_pending.end(), [id](const Pending & p){return p.session.id == id;});
+
+			if(pending == m_pending.end() || l == 0 || l > pending->session.lanes.size() || pending->session.lanes[l - 1].valid())
+				throw NetworkError("not a lane of a pending session");
+
+			CHECK_RET(hs.sck.set_nonblocking(false))
+			pending->session.lanes[l - 1] = std::move(hs.sck);
+
+			if(std::all_of(pending->session.lanes.begin(), pending->session.lanes.end(), [](const Socket & s){return s.valid();}))
+			{
+				start_session(std::move(pending->session));
+				m_pending.erase(pending);
+			}
+			return true;
+		}
+
+		// First connection of a client. Its session is new, even if the client resumes : it initializes everything again.
+		if(msg.size() == 1)
+		{
+			Proto::Connection cn = Proto::Connection::FRESH;
+			CHECK_RET(hs.sck.Send(cn) > 0)
+			continue;
+		}
+
+		unsigned char n = msg[1];
+		CHECK_RET(n >= 1 && n <= AppBase::max_lanes)
+
+		Server::Session session;
+		session.id = std::mt19937_64(std::random_device()())();
+		session.lanes.resize(n - 1);
+
+		std::array<unsigned char, 8> id;
+		memcpy(id.data(), &session.id, id.size());
+		CHECK_RET(hs.sck.Send(id) > 0)
+
+		CHECK_RET(hs.sck.set_nonblocking(false))
+		session.conn = std::move(hs.sck);
+		session.addr = std::move(hs.addr);
+
+		std::cout << "Client connected : " << session.addr.str() << ", session " << session.id << std::endl;
+
+		if(n == 1)
+			start_session(std::move(session));
+		else
+			m_pending.push_back({std::move(session), std::chrono::steady_clock::now() + Server::lane_join_timeout});
+		return true;
+	}
+}
+
+void MultiServer::drop_expired()
+{
+	auto now = std::chrono::steady_clock::now();
+
+	std::erase_if(m_handshakes, [now](const Handshake & hs){return now >= hs.deadline;});
+
+	// Lanes never joined
+	std::erase_if(m_pending, [now](const Pending & p){return now >= p.deadline;});
+}
+
+void MultiServer::start_session(Server::Session && session)
+{
+	std::thread([session = std::move(session), opts = m_options]() mutable {
+		auto id = session.id;
+		try
+		{
+			Server srv(std::move(session), opts);
+			srv.run();
+		}
+		catch(const std::runtime_error & e)
+		{
+			std::cout << "Session " << id << " failed : " << e.what() << std::endl;
+		}
+	}).detach();
+}
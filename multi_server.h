@@ -0,0 +1,60 @@
+#ifndef MULTI_SERVER_H
+#define MULTI_SERVER_H
+
+#include "server.h"
+#include "socket.hpp"
+#include "classes.h"
+
+#include <chrono>
+#include <vector>
+
+// Server keeping its listener : every client gets its own session, a Server running in its own thread
+class MultiServer : public NoCopy
+{
+	// Accepted connection in its handshake, read without blocking : a client does not stall the other ones
+	struct Handshake
+	{
+		Socket sck;
+		Address addr;
+		std::chrono::steady_clock::time_point deadline;
+		size_t skipped = 0; // Bytes received before ESTABLISH
+		bool established = false;
+		std::vector<unsigned char> received; // After ESTABLISH
+	};
+
+	struct Pending
+	{
+		Server::Session session;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	port_t m_tcp_port;
+	AppBase::Options m_options;
+
+	Socket m_listener;
+	std::vector<Handshake> m_handshakes;
+	std::vector<Pending> m_pending; // Sessions waiting for their lanes
+
+public:
+	constexpr static std::chrono::seconds handshake_timeout{5}; // For the whole handshake of a connection
+	constexpr static int check_interval = 1000; // ms, between checks of the deadlines when nothing happens
+
+	MultiServer(port_t tp, const AppBase::Options & opts) : m_tcp_port(tp), m_options(opts) {}
+
+	void run();
+
+	// Accept a connection and send it ESTABLISH
+	void accept_connection();
+
+	// Read what a connection in its handshake sent, and go on with it. Returns true once it is over : the first connection of a new client,
+	// or a lane of a pending session. Throws if the connection is rejected.
+	bool continue_handshake(Handshake & hs);
+
+	// Drop the handshakes and the sessions whose lanes did not join in time
+	void drop_expired();
+
+	// Run a session in its own thread, once all its lanes joined
+	void start_session(Server::Session && session);
+};
+
+#endif
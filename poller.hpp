@@ -0,0 +1,261 @@
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+#include "classes.h"
+#include "socket.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// Readiness backend used by the event loops.
+// Sources are registered with a tag, which is given back with every readiness event.
+// With an edge triggered backend, a source has to be drained (until would_block()) each time it is reported.
+class Poller : public NoCopy
+{
+public:
+	typedef uint64_t tag_t;
+
+	// Interest / readiness flags
+	static constexpr uint32_t IN = 1;
+	static constexpr uint32_t OUT = 2;
+	static constexpr uint32_t HUP = 4; // Readiness only
+	static constexpr uint32_t ERR = 8; // Readiness only
+	static constexpr uint32_t LEVEL = 16; // Interest only : keep reporting the source while it is ready, even on an edge triggered backend
+	static constexpr uint32_t RECV = 32; // Interest only : the backend may receive the data itself, and report it with DATA
+	static constexpr uint32_t DATA = 64; // Readiness only : data and size hold received bytes, a size of 0 is the end of the stream
+	static constexpr uint32_t SENT = 128; // Readiness only : a send given to the backend completed, size holds the bytes sent. With ERR, it failed or was cut short.
+
+	struct Event
+	{
+		tag_t tag;
+		uint32_t ready;
+
+		// With DATA, received bytes, valid until the next wait. The recv_headroom bytes before data are writable.
+		unsigned char * data = nullptr;
+		size_t size = 0;
+	};
+
+	virtual ~Poller() {}
+
+	virtual bool add(socket_t sck, tag_t tag, uint32_t interest) = 0;
+	virtual bool modify(socket_t sck, tag_t tag, uint32_t interest) = 0;
+	virtual void remove(socket_t sck) = 0;
+
+	// Wait for events, returns the number of events or -1 on error. Interruptions are reported as 0 events.
+	virtual int wait(int timeout_ms) = 0;
+
+	// Apply the changes made so far without waiting : a source removed is then no longer read by the backend, and its socket may be read directly.
+	virtual void sync() {}
+
+	// Send the data of a registered source in the background, whole, and report the source with SENT once done. The content of data is taken.
+	// One send at a time for each source. Returns false if the backend does not send, the data is then left as it was.
+	virtual bool send(socket_t, std::vector<unsigned char> &) {return false;}
+
+	const std::vector<Event> & events() const {return m_events;}
+
+	// If true, sources are only reported when they become ready
+	virtual bool edge_triggered() const = 0;
+
+	// If true, sources registered with RECV are only reported with DATA, and should not be read otherwise
+	virtual bool receives() const {return false;}
+
+	virtual const char * name() const = 0;
+
+	// Create the best backend available. io_uring is only used if asked and supported.
+	// Received data reported by the backend is preceded by at least recv_headroom bytes, and at most recv_size bytes long.
+	static std::unique_ptr<Poller> create(bool io_uring = false, size_t recv_headroom = 0, size_t recv_size = 0);
+
+protected:
+	std::vector<Event> m_events;
+};
+
+// Portable level triggered backend
+class PollPoller : public Poller
+{
+	std::vector<pollfd> m_pfds;
+	std::vector<tag_t> m_tags;
+	std::unordered_map<socket_t, size_t> m_index;
+
+	static short to_poll(uint32_t interest)
+	{
+		return ((interest & IN) ? POLLIN : 0) | ((interest & OUT) ? POLLOUT : 0);
+	}
+
+public:
+	bool add(socket_t sck, tag_t tag, uint32_t interest) override
+	{
+		if(!m_index.emplace(sck, m_pfds.size()).second) return false;
+		m_pfds.push_back({sck, to_poll(interest), 0});
+		m_tags.push_back(tag);
+		return true;
+	}
+
+	bool modify(socket_t sck, tag_t tag, uint32_t interest) override
+	{
+		auto it = m_index.find(sck);
+		if(it == m_index.end()) return false;
+		m_pfds[it->second].events = to_poll(interest);
+		m_tags[it->second] = tag;
+		return true;
+	}
+
+	void remove(socket_t sck) override
+	{
+		auto it = m_index.find(sck);
+		if(it == m_index.end()) return;
+
+		size_t idx = it->second;
+		m_index.erase(it);
+
+		if(idx + 1 != m_pfds.size())
+		{
+			m_pfds[idx] = m_pfds.back();
+			m_tags[idx] = m_tags.back();
+			m_index[m_pfds[idx].fd] = idx;
+		}
+
+		m_pfds.pop_back();
+		m_tags.pop_back();
+	}
+
+	int wait(int timeout_ms) override
+	{
+		m_events.clear();
+
+		int res = poll(m_pfds.data(), m_pfds.size(), timeout_ms);
+		if(res < 0)
+		{
+#ifdef __unix__
+			if(errno == EINTR) return 0;
+#endif
+			return -1;
+		}
+
+		for(size_t i = 0; i != m_pfds.size() && int(m_events.size()) != res; ++i)
+		{
+			auto rev = m_pfds[i].revents;
+			if(!(rev & pollmask)) continue;
+
+			m_events.push_back({m_tags[i], uint32_t(
+				((rev & (POLLIN | POLLRDNORM)) ? IN : 0) |
+				((rev & POLLOUT) ? OUT : 0) |
+				((rev & POLLHUP) ? HUP : 0) |
+				((rev & (POLLERR | POLLNVAL)) ? ERR : 0))});
+		}
+
+		return m_events.size();
+	}
+
+	bool edge_triggered() const override {return false;}
+
+	const char * name() const override {return "poll";}
+};
+
+#ifdef __linux__
+
+// Edge triggered epoll backend : the cost of an iteration depends on the number of ready sources only
+class EpollPoller : public Poller
+{
+	int m_epfd;
+	std::vector<epoll_event> m_ep_events;
+
+	static uint32_t to_epoll(uint32_t interest)
+	{
+		return ((interest & LEVEL) ? 0u : uint32_t(EPOLLET)) | ((interest & IN) ? uint32_t(EPOLLIN) : 0u) | ((interest & OUT) ? uint32_t(EPOLLOUT) : 0u);
+	}
+
+	bool ctl(int op, socket_t sck, tag_t tag, uint32_t interest)
+	{
+		epoll_event ev{};
+		ev.events = to_epoll(interest);
+		ev.data.u64 = tag;
+		return epoll_ctl(m_epfd, op, sck, &ev) == 0;
+	}
+
+public:
+	static constexpr size_t max_events = 256;
+
+	EpollPoller() : m_epfd(epoll_create1(EPOLL_CLOEXEC)), m_ep_events(max_events)
+	{
+		CHECK_RET(m_epfd >= 0)
+	}
+
+	~EpollPoller() {close(m_epfd);}
+
+	bool add(socket_t sck, tag_t tag, uint32_t interest) override
+	{
+		return ctl(EPOLL_CTL_ADD, sck, tag, interest);
+	}
+
+	bool modify(socket_t sck, tag_t tag, uint32_t interest) override
+	{
+		return ctl(EPOLL_CTL_MOD, sck, tag, interest);
+	}
+
+	void remove(socket_t sck) override
+	{
+		// Fails harmlessly if the socket was already closed
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, sck, nullptr);
+	}
+
+	int wait(int timeout_ms) override
+	{
+		m_events.clear();
+
+		int res = epoll_wait(m_epfd, m_ep_events.data(), m_ep_events.size(), timeout_ms);
+		if(res < 0)
+			return errno == EINTR ? 0 : -1;
+
+		for(int i = 0; i != res; ++i)
+		{
+			auto rev = m_ep_events[i].events;
+			m_events.push_back({m_ep_events[i].data.u64, uint32_t(
+				((rev & EPOLLIN) ? IN : 0) |
+				((rev & EPOLLOUT) ? OUT : 0) |
+				((rev & EPOLLHUP) ? HUP : 0) |
+				((rev & EPOLLERR) ? ERR : 0))});
+		}
+
+		return res;
+	}
+
+	bool edge_triggered() const override {return true;}
+
+	const char * name() const override {return "epoll";}
+};
+
+#endif
+
+#ifdef RALLONGE_IO_URING
+#include "uring.hpp"
+#endif
+
+inline std::unique_ptr<Poller> Poller::create([[maybe_unused]] bool io_uring, [[maybe_unused]] size_t recv_headroom, [[maybe_unused]] size_t recv_size)
+{
+#ifdef RALLONGE_IO_URING
+	if(io_uring)
+	{
+		if(auto p = IoUringPoller::create(recv_headroom, recv_size))
+			return p;
+		std::cout << "io_uring is not available, falling back to epoll." << std::endl;
+	}
+#else
+	if(io_uring)
+		std::cout << "io_uring support was not built." << std::endl;
+#endif
+
+#ifdef __linux__
+	return std::make_unique<EpollPoller>();
+#else
+	return std::make_unique<PollPoller>();
+#endif
+}
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef RAL_PROTO_H
 #define RAL_PROTO_H
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 
 #define ENCODE_UINT16(n, loc) (loc)[0] = n & 255; (loc)[1] = n >> 8;
 #define DECODE_UINT16(loc) (uint16_t((loc)[0]) | uint16_t((loc)[1]) << 8)
@@ -9,6 +11,9 @@
 #define ENCODE_UINT32(n, loc) (loc)[0] = n & 255; (loc)[1] = (n >> 8) & 255; (loc)[2] = (n >> 16) & 255; (loc)[3] = (n >> 24);
 #define DECODE_UINT32(loc) uint32_t((loc)[0]) | uint32_t((loc)[1]) << 8 | uint32_t((loc)[2]) << 16 | uint32_t((loc)[3]) << 24
 
+#define ENCODE_UINT64(n, loc) ENCODE_UINT32(uint32_t(n), loc) ENCODE_UINT32(uint32_t((n) >> 32), (loc) + 4)
+#define DECODE_UINT64(loc) (uint64_t(DECODE_UINT32(loc)) | uint64_t(DECODE_UINT32((loc) + 4)) << 32)
+
 namespace Proto
 {
 	enum class OpCode : unsigned char
@@ -22,6 +27,11 @@ namespace Proto
 		TCP_ESTABLISHED = 6,
 		TCP_TIMEOUT = 7,
 		ESTABLISH = 8,
+		WINDOW_UPDATE = 9,
+		SHORT_MESSAGE = 10, // TCP message with a payload of less than 256 bytes, with compact headers
+		EARLY_DATA = 11, // Data of a connection sent before it is established, on the first lane
+		PING = 12, // Keepalive carrying the time it was sent, answered by a PONG on the same channel
+		PONG = 13,
 	};
 	
 	enum class Protocol : unsigned char
@@ -40,12 +50,160 @@ namespace Proto
 	{
 		FRESH = 0,
 		RESUME = 1,
+		LANE = 2,
+	};
+
+	// Capabilities exchanged on fresh connections, as a bit mask : a capability is used if both sides have it
+	enum class Capability : unsigned char
+	{
+		COMPRESSION = 1,
+		RESUME = 2, // Connections kept across tunnel reconnects
+		COMPACT = 4, // TCP messages with varint headers
+		EARLY = 8, // Data sent by the client before its connections are established
+		PING = 16, // Keepalives are pings, answered with the time they were received
+	};
+
+	// Options of a bridge, as a bit mask in its config message
+	enum class BridgeOption : unsigned char
+	{
+		COMPRESS = 1,
+		CONNECT_TIMEOUT = 2, // The config message ends with a connect timeout
+		SCHEDULE = 4, // The config message ends with the priority and the weight of the bridge
+	};
+
+	// Priority class of a TCP bridge : the connections of a higher class are read first
+	enum class Priority : unsigned char
+	{
+		HIGH = 0,
+		NORMAL = 1,
+		LOW = 2,
 	};
 
+	constexpr size_t n_priorities = 3;
+
+	// Flag of the payload size of a TCP message, if its payload is compressed
+	constexpr uint32_t compressed_payload = uint32_t(1) << 31;
+
  	// Header sizes for messages WITH message type and eventual protocol information
 
-	constexpr size_t tcp_message_header_size = 22;
+	constexpr size_t tcp_message_header_size = 10;
 	constexpr size_t udp_message_header_size = 8;
+
+	// Varints : 7 bits per byte, low bits first, with the high bit set on every byte but the last
+	constexpr size_t max_varint_size = 5;
+
+	// Compact header of a TCP message : opcode, protocol (MESSAGE with UDP bypass), varint id, then the payload size as a varint of (size << 1 | compressed),
+	// or as 1 byte for a SHORT_MESSAGE. Payloads below 2^27 bytes have a size of at most 4 bytes.
+	constexpr size_t max_compact_header_size = 2 + max_varint_size + 4;
+	constexpr uint32_t max_short_payload = 255;
+
+	// Header of early data : opcode, unique key of the connection, payload size
+	constexpr size_t early_data_header_size = 13;
+
+	// Ping : opcode, time of the sender in us. Pong : opcode, time of the ping, time of the answer by the clock of the other side.
+	constexpr size_t ping_size = 9;
+	constexpr size_t pong_size = 17;
+
+	// Room reserved before a TCP payload for its header, in any format
+	constexpr size_t tcp_message_room = std::max({tcp_message_header_size, max_compact_header_size, early_data_header_size});
+
+	constexpr size_t varint_size(uint32_t n)
+	{
+		size_t size = 1;
+		for(; n >= 0x80; n >>= 7)
+			size++;
+		return size;
+	}
+
+	// Returns the size written
+	inline size_t encode_varint(uint32_t n, unsigned char * loc)
+	{
+		size_t i = 0;
+		for(; n >= 0x80; n >>= 7)
+			loc[i++] = (unsigned char)(n | 0x80);
+		loc[i++] = (unsigned char)(n);
+		return i;
+	}
+
+	// Returns the size read, 0 if more than avail bytes are needed, or -1 if malformed : n is then 0.
+	inline int decode_varint(const unsigned char * loc, size_t avail, uint32_t & n)
+	{
+		uint32_t v = 0;
+		n = 0;
+		for(size_t i = 0; i != max_varint_size; ++i)
+		{
+			if(i == avail)
+				return 0;
+			if(i == max_varint_size - 1 && loc[i] > 0x0F)
+				return -1; // Beyond 32 bits
+
+			v |= uint32_t(loc[i] & 0x7F) << (7 * i);
+			if(!(loc[i] & 0x80))
+			{
+				n = v;
+				return int(i + 1);
+			}
+		}
+		return -1;
+	}
+
+	// Write the compact header of a TCP message before its payload. The size is flagged with compressed_payload if compressed.
+	// Returns the start of the frame.
+	inline unsigned char * encode_compact_header(unsigned char * payload, uint32_t id, uint32_t wire_size, bool bypass)
+	{
+		uint32_t compressed = wire_size & compressed_payload ? 1 : 0;
+		uint32_t size = wire_size & ~compressed_payload;
+		bool is_short = !compressed && size <= max_short_payload;
+
+		size_t head = is_short || !bypass ? 1 : 2;
+		size_t id_size = varint_size(id);
+		size_t size_size = is_short ? 1 : varint_size(size << 1 | compressed);
+
+		unsigned char * msg = payload - (head + id_size + size_size);
+		msg[0] = (unsigned char)(is_short ? OpCode::SHORT_MESSAGE : OpCode::MESSAGE);
+		if(head == 2)
+			msg[1] = (unsigned char)(Protocol::TCP);
+
+		encode_varint(id, msg + head);
+		if(is_short)
+			msg[head + id_size] = (unsigned char)(size);
+		else
+			encode_varint(size << 1 | compressed, msg + head + id_size);
+
+		return msg;
+	}
+
+	// Read a compact header, after the opcode and protocol, into the id and the size flagged with compressed_payload if compressed.
+	// Returns its size, 0 if more than avail bytes are needed, or -1 if malformed : the id and size are then 0.
+	inline int decode_compact_header(const unsigned char * hdr, size_t avail, bool is_short, uint32_t & id, uint32_t & wire_size)
+	{
+		wire_size = 0;
+		int id_size = decode_varint(hdr, avail, id);
+		if(id_size <= 0)
+			return id_size;
+
+		if(is_short)
+		{
+			if(size_t(id_size) == avail)
+			{
+				id = 0;
+				return 0;
+			}
+			wire_size = hdr[id_size];
+			return id_size + 1;
+		}
+
+		uint32_t n;
+		int size_size = decode_varint(hdr + id_size, avail - id_size, n);
+		if(size_size <= 0)
+		{
+			id = 0;
+			return size_size;
+		}
+
+		wire_size = n >> 1 | (n & 1 ? compressed_payload : 0);
+		return id_size + size_size;
 	}
+}
 
 #endif
@@ -0,0 +1,1276 @@
+#include "reactor.h"
+#include "app_base.h"
+#include "ral_proto.h"
+#include "socket.hpp"
+#include "lz.hpp"
+#include <array>
+#include <iostream>
+
+Reactor::Reactor(AppBase & app, bool io_uring, size_t frame_payload) : m_app(app),
+	m_poller(Poller::create(io_uring, Proto::tcp_message_room, std::min(frame_payload, max_provided_size) + Proto::udp_message_header_size)), // Room for a datagram of the UDP channel
+	m_message_buffer(Proto::tcp_message_room + frame_payload),
+	m_now(monotonic_ms()), m_timers(m_now)
+{
+	CHECK_RET(m_wake.create(AF_INET, SOCK_DGRAM))
+	CHECK_RET(m_wake.bind(Address(AF_INET, SOCK_DGRAM, "127.0.0.1", 0)))
+
+	auto [res, adr] = m_wake.getsockname();
+	CHECK_RET(res)
+	CHECK_RET(m_wake.connect(adr))
+	CHECK_RET(m_wake.set_nonblocking())
+
+	watch(m_wake, Source::WAKE, 0, Poller::IN);
+}
+
+void Reactor::start()
+{
+	m_stop = false;
+	m_thread = std::thread([this]{run();});
+}
+
+void Reactor::stop()
+{
+	if(!m_thread.joinable())
+		return;
+
+	interrupt();
+	m_thread.join();
+
+	drop_tasks();
+}
+
+void Reactor::post(Task task)
+{
+	{
+		std::lock_guard lock(m_inbox_mutex);
+		m_inbox.push_back(std::move(task));
+	}
+	wake();
+}
+
+void Reactor::run_inbox()
+{
+	std::vector<Task> tasks;
+	{
+		std::lock_guard lock(m_inbox_mutex);
+		tasks.swap(m_inbox);
+	}
+
+	for(auto & task : tasks)
+		task();
+}
+
+void Reactor::run()
+{
+	try
+	{
+		while(!m_stop)
+		{
+			// Turns of the connections readable in the last iteration, and their frames
+			run_reads();
+			flush_lanes();
+
+			auto rpoll = m_poller->wait(poll_timeout());
+			m_next_event = 0;
+
+			if(m_stop)
+				return;
+
+			update_clock();
+			run_timers();
+
+			if(lanes_timed_out())
+			{
+				std::cout << "Timeout on a lane!" << std::endl;
+				m_app.request_reset();
+				return;
+			}
+
+			CHECK_RET(rpoll >= 0)
+
+			// Before the events : a connection is posted before the other side can send frames for it
+			run_inbox();
+
+			auto & events = m_poller->events();
+			while(m_next_event != events.size())
+			{
+				auto & ev = events[m_next_event++];
+				if(!ev.ready) continue; // Source removed during this iteration
+
+				switch(tag_source(ev.tag))
+				{
+				case Source::WAKE:
+					drain_wake();
+					break;
+				case Source::TUNNEL_TCP:
+					{
+						auto l = tag_index(ev.tag);
+
+						if(ev.ready & Poller::SENT)
+						{
+							m_app.lane_sent(l, ev.ready);
+							break;
+						}
+
+						bool alive = ev.ready & Poller::IN ? process_lane(l, ev) : !m_app.lane_error(l, ev.ready);
+
+						// Losing any lane reestablishes the whole tunnel, from the main thread
+						if(!alive && !m_stop)
+						{
+							std::cout << "Lost a lane." << std::endl;
+							m_app.request_reset();
+						}
+						if(!alive)
+							return;
+					}
+					break;
+				case Source::CONNECTION:
+					check_conn(ev);
+					break;
+				case Source::CONNECT_ATTEMPT:
+					check_attempt(ev);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+	}
+	catch(const std::runtime_error & e)
+	{
+		if(m_stop)
+			return; // Lanes shut down by the main thread
+
+		std::cout << e.what() << std::endl;
+		m_app.request_reset();
+	}
+}
+
+bool Reactor::process_lane(size_t l, const Poller::Event & ev)
+{
+	// Closed : left to the main thread, which closes all the lanes
+	if(!receive_lane(l, ev))
+		return false;
+
+	auto & reader = m_app.m_readers[l];
+
+	while(auto size = reader.next(m_app.m_bypass_udp, m_app.m_compact))
+	{
+		if(!process_frame(l, reader.frame()))
+			throw NetworkError("Unexpected OpCode on TCP");
+		reader.consume(size);
+	}
+	return true;
+}
+
+bool Reactor::receive_lane(size_t l, const Poller::Event & ev)
+{
+	// Received by the backend, nothing if the lane was closed
+	if(ev.ready & Poller::DATA)
+	{
+		if(!ev.size)
+			return false;
+
+		m_app.m_readers[l].append(ev.data, ev.size);
+		m_app.m_last_tcp_packet[l] = m_now;
+		return true;
+	}
+
+	auto res = m_app.m_readers[l].fill(m_app.lane(l));
+
+	if(res < 0 && would_block())
+		return true;
+	if(res <= 0)
+		return false;
+
+	m_app.m_last_tcp_packet[l] = m_now;
+	return true;
+}
+
+bool Reactor::process_frame(size_t l, unsigned char * frame)
+{
+	switch(Proto::OpCode(frame[0]))
+	{
+	case Proto::OpCode::NOP:
+		return true;
+	case Proto::OpCode::PING:
+		m_app.send_pong(l, frame);
+		return true;
+	case Proto::OpCode::PONG:
+		AppBase::receive_pong(m_app.m_lane_rtt[l], frame);
+		return true;
+	case Proto::OpCode::MESSAGE:
+	case Proto::OpCode::SHORT_MESSAGE:
+		{
+			unsigned char * hdr = frame + 1;
+			bool is_short = Proto::OpCode(frame[0]) == Proto::OpCode::SHORT_MESSAGE;
+
+			if(m_app.m_bypass_udp && !is_short) // Check proto!
+			{
+				if(Proto::Protocol(*hdr) == Proto::Protocol::UDP) // It is UDP
+				{
+					// UDP bridges belong to the main thread, and are only carried by the first lane
+					if(this != &m_app)
+						throw NetworkError("Bypassed UDP message on a worker lane");
+
+					m_app.process_bypassed_message(hdr + 1);
+					return true;
+				}
+				// Otherwise, do as usual...
+				hdr++;
+			}
+
+			conn_id_t id = 0;
+			uint32_t dat_size = 0;
+			unsigned char * payload;
+
+			if(m_app.m_compact)
+			{
+				// Bounded by the reader, which received the frame whole
+				int res = Proto::decode_compact_header(hdr, Proto::max_compact_header_size, is_short, id, dat_size);
+				if(res <= 0)
+					throw NetworkError("Malformed message header on TCP");
+				payload = hdr + res;
+			}
+			else
+			{
+				id = DECODE_UINT32(&hdr[0]);
+				dat_size = DECODE_UINT32(&hdr[4]);
+				payload = hdr + 8;
+			}
+
+			auto co = m_connections.find(id);
+
+			if(!co)
+			{
+				LOG("Message on dead connection " << id << std::endl);
+				return true;
+			}
+
+			co->last_active = m_now;
+
+			if(dat_size & Proto::compressed_payload)
+			{
+				// Compressed by the other side within the negotiated payload
+				m_message_buffer.resize(m_app.m_frame_payload);
+				auto res = Lz::decompress(payload, dat_size & ~Proto::compressed_payload, m_message_buffer.data(), m_message_buffer.size());
+				if(res < 0)
+					throw NetworkError("Malformed compressed message");
+
+				payload = m_message_buffer.data();
+				dat_size = res;
+			}
+
+			co->received += dat_size;
+			count_in(*co, dat_size);
+
+			if(co->early)
+			{
+				// Overtook the end of the early data, coming through the first lane
+				if(co->late.size() + dat_size > max_queued)
+				{
+					LOG("Connection " << co->id << ',' << co->key << " too slow, dropping." << std::endl);
+					disconnect_tcp<true>(*co);
+					return true;
+				}
+				co->late.insert(co->late.end(), payload, payload + dat_size);
+				return true;
+			}
+
+			deliver_tcp(*co, payload, dat_size);
+			return true;
+		}
+	case Proto::OpCode::TCP_DISCONNECTED:
+		{
+			unsigned char * bridge_dat = frame + 1;
+
+			peer_disconnected(DECODE_UINT32(bridge_dat));
+
+			return true;
+		}
+	case Proto::OpCode::TCP_ESTABLISHED:
+		{
+			unsigned char * keys = frame + 1;
+
+			auto co = m_connections.find(DECODE_UINT32(&keys[0]));
+
+			if(!co)
+			{
+				LOG("Dead connection established" << std::endl);
+				return true;
+			}
+
+			co->key = DECODE_UINT32(&keys[4]);
+			co->established = true;
+			count_connect(*co);
+
+			LOG("Connection " << co->key << " established" << std::endl);
+
+			// The window of the other side, less the early data. No window update comes before.
+			co->credit = int64_t(m_app.m_peer_window) - int64_t(co->sent);
+			if(m_app.m_early)
+				send_early_end(*co);
+
+			// Closed while it was sending early data
+			if(co->hung_up)
+			{
+				release_held(*co, true);
+				disconnect_tcp<true>(*co);
+				return true;
+			}
+
+			release_held(*co);
+			update_interest(*co);
+		}
+		return true;
+	case Proto::OpCode::WINDOW_UPDATE:
+		process_window_update(frame + 1);
+		return true;
+	default:
+		return false;
+	}
+}
+
+Reactor::conn_id_t Reactor::add_connection(Connection && co)
+{
+	auto id = m_connections.insert(std::move(co));
+	if(!id)
+	{
+		LOG("Too many connections, dropping." << std::endl);
+		return 0;
+	}
+
+	auto & added = *m_connections.find(id);
+	added.id = id;
+	added.last_active = m_now;
+	m_metrics.opened.add();
+
+	// Watched once connected, when connecting
+	if(added.sck.valid())
+		watch(added.sck, Source::CONNECTION, id, conn_interest(added));
+
+	if(added.idle_timeout)
+		arm_idle(added);
+	return id;
+}
+
+void Reactor::connect_endpoint(std::vector<Address> adrs, uint16_t bridge, conn_id_t key, key_sock_uni_t unkey, bool compress, uint32_t timeout, Schedule schedule)
+{
+	Connection newcon;
+	newcon.key = key;
+	newcon.unkey = unkey;
+	newcon.bridge = bridge;
+	newcon.credit = m_app.m_peer_window;
+	newcon.compress = compress;
+	newcon.schedule = schedule;
+	newcon.connecting = true;
+	newcon.early = m_app.m_early;
+	newcon.candidates = std::move(adrs);
+	newcon.connect_start = monotonic_us();
+
+	auto id = add_connection(std::move(newcon));
+	if(!id)
+	{
+		refuse_connect(key, unkey);
+		return;
+	}
+
+	// Early data follows the connect, through the main thread
+	if(m_app.m_early)
+		m_early[unkey] = id;
+
+	auto & co = *m_connections.find(id);
+
+	if(timeout)
+		m_timers.add(m_now + timeout, {TimerKind::CONNECT_TIMEOUT, 0, id});
+
+	// Completed once a socket is writable
+	next_attempt(co);
+	if(!attempting(co))
+	{
+		LOG("Connection refused, key : " << key << std::endl);
+		count_connect_failure();
+		disconnect_tcp<true>(co);
+	}
+}
+
+void Reactor::next_attempt(Connection & co)
+{
+	while(!co.candidates.empty())
+	{
+		Address adr = std::move(co.candidates.front());
+		co.candidates.erase(co.candidates.begin());
+
+		Socket sck;
+		if(!sck.create(adr.af(), SOCK_STREAM) || !sck.set_nonblocking() || (!sck.connect(adr) && !connect_in_progress()))
+			continue;
+
+		watch(sck, Source::CONNECT_ATTEMPT, uint64_t(co.attempts.size()) << 32 | co.id, Poller::OUT);
+		co.attempts.push_back(std::move(sck));
+
+		if(!co.candidates.empty())
+		{
+			co.attempt_timer = m_now + connect_attempt_delay;
+			m_timers.add(co.attempt_timer, {TimerKind::CONNECT_ATTEMPT, 0, co.id});
+		}
+		return;
+	}
+}
+
+void Reactor::check_attempt(const Poller::Event & ev)
+{
+	auto found = m_connections.find(conn_id_t(tag_index(ev.tag)));
+	size_t a = tag_index(ev.tag) >> 32;
+
+	if(!found || !found->connecting || a >= found->attempts.size() || !found->attempts[a].valid())
+		return; // Dropped, or lost the race
+
+	auto & co = *found;
+	auto & sck = co.attempts[a];
+
+	if([[maybe_unused]] int err = sck.pending_error())
+	{
+		LOG("Connect attempt failed, key " << co.key << ", error " << err << std::endl);
+		m_poller->remove(sck.socket());
+		sck.destroy();
+
+		// The next address is tried at once
+		next_attempt(co);
+		if(!attempting(co))
+		{
+			count_connect_failure();
+			disconnect_tcp<true>(co);
+		}
+		return;
+	}
+
+	// The first connected wins, the other attempts are dropped
+	co.sck = std::move(sck);
+	co.connecting = false;
+	unwatch_conn(co);
+	co.attempts.clear();
+	co.candidates.clear();
+
+	co.last_active = m_now;
+	watch(co.sck, Source::CONNECTION, co.id, conn_interest(co));
+	send_established(co);
+	count_connect(co);
+}
+
+void Reactor::refuse_connect(conn_id_t key, key_sock_uni_t unkey)
+{
+	LOG("Connection refused, key : " << key << std::endl);
+	count_connect_failure();
+
+	std::array<unsigned char, 5> msg = {(unsigned char)(Proto::OpCode::TCP_DISCONNECTED)};
+
+	ENCODE_UINT32(key, &msg[1])
+
+	m_app.send_frame(m_app.lane_of(unkey), msg);
+}
+
+void Reactor::receive_early(key_sock_uni_t unkey, const std::vector<unsigned char> & data)
+{
+	auto found = m_early.find(unkey);
+	if(found == m_early.end())
+	{
+		LOG("Early data on dead connection " << unkey << std::endl);
+		return;
+	}
+
+	auto & co = *m_connections.find(found->second);
+	co.last_active = m_now;
+
+	if(data.empty())
+	{
+		if(end_early(co) && co.closing && !co.queued())
+			disconnect_tcp<false>(co);
+		return;
+	}
+
+	// The messages which overtook it are counted as received
+	if(co.received - co.late.size() + data.size() > max_early_data)
+	{
+		LOG("Connection " << co.id << ',' << co.key << " sent too much early data, dropping." << std::endl);
+		disconnect_tcp<true>(co);
+		return;
+	}
+
+	// Queued until connected
+	co.received += data.size();
+	count_in(co, uint32_t(data.size()));
+	deliver_tcp(co, data.data(), data.size());
+}
+
+bool Reactor::end_early(Connection & co)
+{
+	m_early.erase(co.unkey);
+	co.early = false;
+
+	if(co.late.empty())
+		return true;
+
+	auto id = co.id;
+	auto late = std::move(co.late);
+	deliver_tcp(co, late.data(), late.size());
+	return m_connections.find(id);
+}
+
+void Reactor::send_established(Connection & co)
+{
+	std::array<unsigned char, 9> msg_estab = {(unsigned char)(Proto::OpCode::TCP_ESTABLISHED)};
+	ENCODE_UINT32(co.key, &msg_estab[1])
+	ENCODE_UINT32(co.id, &msg_estab[5])
+
+	m_app.send_frame(m_app.lane_of(co.unkey), msg_estab);
+
+	LOG("TCP bridge connected, key " << co.key << ", " << co.id << std::endl);
+}
+
+void Reactor::forward_tcp(Connection & co, unsigned char * payload, uint32_t size)
+{
+	if(m_app.m_resume)
+	{
+		// Reclaim the space of delivered data before growing the replay buffer
+		if(co.replay_pos && co.replay_pos * 2 >= co.replay.size())
+		{
+			co.replay.erase(co.replay.begin(), co.replay.begin() + co.replay_pos);
+			co.replay_pos = 0;
+		}
+		co.replay.insert(co.replay.end(), payload, payload + size);
+	}
+
+	// The credit counts payload bytes before compression
+	co.sent += size;
+	co.credit -= size;
+	count_out(co, size);
+
+	send_message(co, payload, size);
+}
+
+void Reactor::send_message(Connection & co, unsigned char * payload, uint32_t size)
+{
+	if(!co.established)
+	{
+		send_early(co, payload, size);
+		return;
+	}
+
+	uint32_t wire_size = size;
+	if(co.compress)
+		payload = compress_payload(co, payload, wire_size);
+
+	if(m_app.m_compact)
+	{
+		unsigned char * msg = Proto::encode_compact_header(payload, co.key, wire_size, m_app.m_bypass_udp);
+		m_app.send_frame(m_app.lane_of(co.unkey), msg, payload + (wire_size & ~Proto::compressed_payload) - msg);
+		return;
+	}
+
+	unsigned char * msg = payload - Proto::tcp_message_header_size;
+	size_t frame_size = (wire_size & ~Proto::compressed_payload) + Proto::tcp_message_header_size;
+
+	ENCODE_UINT32(co.key, &msg[2])
+	ENCODE_UINT32(wire_size, &msg[6])
+
+	if(m_app.m_bypass_udp)
+	{
+		msg[1] = (unsigned char)(Proto::Protocol::TCP);
+		msg[0] = (unsigned char)(Proto::OpCode::MESSAGE);
+		m_app.send_frame(m_app.lane_of(co.unkey), msg, frame_size);
+	}
+	else
+	{
+		msg[1] = (unsigned char)(Proto::OpCode::MESSAGE);
+		m_app.send_frame(m_app.lane_of(co.unkey), msg + 1, frame_size - 1);
+	}
+}
+
+void Reactor::send_early(Connection & co, unsigned char * payload, uint32_t size)
+{
+	unsigned char * msg = payload - Proto::early_data_header_size;
+	size_t frame_size = Proto::early_data_header_size + size;
+
+	msg[0] = (unsigned char)(Proto::OpCode::EARLY_DATA);
+	ENCODE_KEY(co.unkey, &msg[1])
+	ENCODE_UINT32(size, &msg[9])
+
+	// Sent by the main thread, after the connect
+	if(this == &m_app)
+		m_app.send_frame(0, msg, frame_size);
+	else
+		m_app.post([&app = m_app, frame = std::vector<unsigned char>(msg, msg + frame_size)]{app.send_frame(0, frame);});
+}
+
+int64_t Reactor::early_credit(const Connection & co) const
+{
+	if(!m_app.m_early)
+		return 0;
+	return int64_t(std::min(m_app.m_peer_window, max_early_data)) - int64_t(co.sent);
+}
+
+size_t Reactor::max_payload(const Connection & co) const
+{
+	return co.compress ? std::min(m_app.m_frame_payload, Lz::max_block_size) : m_app.m_frame_payload;
+}
+
+unsigned char * Reactor::compress_payload(Connection & co, unsigned char * payload, uint32_t & size)
+{
+	if(size < min_compress_size || size > Lz::max_block_size)
+		return payload;
+
+	if(co.compress_skip)
+	{
+		co.compress_skip--;
+		return payload;
+	}
+
+	m_compress_buffer.resize(Proto::tcp_message_room + size);
+	unsigned char * out = m_compress_buffer.data() + Proto::tcp_message_room;
+
+	// Worth it if it saves at least 1/16 : the compression gives up beyond
+	auto res = Lz::compress(payload, size, out, size - size / 16);
+
+	if(!res)
+	{
+		// Already compressed data : try again later, less and less often
+		co.compress_skip = co.compress_backoff;
+		co.compress_backoff = std::min<unsigned>(co.compress_backoff * 2, max_compress_backoff);
+		return payload;
+	}
+
+	co.compress_backoff = 1;
+	size = uint32_t(res) | Proto::compressed_payload;
+	return out;
+}
+
+template<bool Message>
+void Reactor::disconnect_tcp(Connection & co)
+{
+	LOG("Connexion " << co.id << ", " << co.key << " disconnected." << std::endl);
+
+	if constexpr (Message)
+	{
+		std::array<unsigned char, 5> msg = {(unsigned char)(Proto::OpCode::TCP_DISCONNECTED)};
+
+		ENCODE_UINT32(co.key, &msg[1])
+
+		m_app.send_frame(m_app.lane_of(co.unkey), msg);
+	}
+
+	if(co.early)
+		m_early.erase(co.unkey);
+
+	unwatch_conn(co);
+	m_connections.erase(co.id);
+	m_metrics.closed.add();
+}
+
+template void Reactor::disconnect_tcp<true>(Connection &);
+template void Reactor::disconnect_tcp<false>(Connection &);
+
+void Reactor::check_conn(const Poller::Event & ev)
+{
+	auto found = m_connections.find(conn_id_t(tag_index(ev.tag)));
+
+	if(!found)
+		return; // Disconnected earlier in this iteration
+
+	auto & co = *found;
+	co.last_active = m_now;
+
+	if(ev.ready & Poller::ERR)
+	{
+		LOG("Connection " << co.id << ',' << co.key << " failed." << std::endl);
+		disconnect_tcp<true>(co);
+		return;
+	}
+
+	if(ev.ready & Poller::OUT)
+	{
+		if(!flush_conn(co))
+			return;
+	}
+
+	if(co.closing)
+		return; // Nothing more to send to the other side
+
+	if(ev.ready & Poller::DATA)
+	{
+		// Received by the backend
+		if(ev.size == 0 && !co.established)
+		{
+			// Disconnected once the early data is delivered
+			co.hung_up = true;
+			update_interest(co);
+			return;
+		}
+
+		if(ev.size == 0)
+		{
+			LOG("Connection " << co.id << ',' << co.key << " Hung up." << std::endl);
+			release_held(co, true);
+			disconnect_tcp<true>(co);
+			return;
+		}
+
+		// Held until the turn of the connection. Once the data held uses up the credit, the backend stops receiving until a window update.
+		bool had_credit = co.may_receive();
+		co.held.insert(co.held.end(), ev.data, ev.data + ev.size);
+		if(had_credit && !co.may_receive())
+			update_interest(co);
+
+		queue_read(co);
+		return;
+	}
+
+	if(!(ev.ready & (Poller::IN | Poller::HUP)))
+		return;
+
+	// Read in turn with the other connections
+	queue_read(co);
+}
+
+void Reactor::run_reads()
+{
+	for(auto & queue : m_readable)
+	{
+		// One turn for each connection readable when the round starts
+		for(size_t n = queue.size(); n; --n)
+		{
+			auto co = m_connections.find(queue.front());
+			queue.pop_front();
+
+			if(!co)
+				continue; // Dropped meanwhile
+
+			co->readable = false;
+			co->deficit += int64_t(read_quantum) * co->schedule.weight;
+
+			if(read_conn(*co))
+			{
+				co->readable = true;
+				queue.push_back(co->id);
+			}
+		}
+	}
+}
+
+bool Reactor::read_conn(Connection & co)
+{
+	co.last_active = m_now;
+
+	// Nothing more to send to the other side
+	if(co.closing || co.hung_up)
+	{
+		co.deficit = 0;
+		return false;
+	}
+
+	// Received by the backend
+	if(co.held_size())
+		co.deficit -= release_held(co, false, size_t(std::max<int64_t>(co.deficit, 0)));
+
+	// The backend reports the rest as it receives it
+	if(m_poller->receives())
+	{
+		if(!co.held_size() || co.credit <= 0)
+		{
+			co.deficit = 0;
+			return false;
+		}
+		return true;
+	}
+
+	// Read until drained, or until the turn is used up : an edge triggered backend does not report the rest again.
+	// If poll gives hangup, we still need to receive last data, so hangup is processed here when recv gives 0
+	while(co.deficit > 0 && co.credit > 0)
+	{
+		m_message_buffer.resize(Proto::tcp_message_room + max_payload(co));
+
+		// Do not read more than the other side accepts
+		auto size = std::min<int64_t>({int64_t(m_message_buffer.size() - Proto::tcp_message_room), co.credit, co.deficit});
+
+		auto recres = co.sck.Recv_raw(m_message_buffer.data() + Proto::tcp_message_room, size, 0);
+
+		if(recres < 0 && would_block())
+		{
+			co.deficit = 0;
+			return false;
+		}
+
+		CHECK_RET(recres >= 0);
+
+		if(recres == 0 && !co.established)
+		{
+			co.hung_up = true;
+			co.deficit = 0;
+			update_interest(co);
+			return false;
+		}
+
+		if(recres == 0) // Connection loss
+		{
+			LOG("Connection " << co.id << ',' << co.key << " Hung up." << std::endl);
+			disconnect_tcp<true>(co);
+			return false;
+		}
+
+		co.deficit -= recres;
+		forward_tcp(co, m_message_buffer.data() + Proto::tcp_message_room, recres);
+	}
+
+	// Out of credit : stop receiving until a window update
+	if(co.credit <= 0)
+	{
+		co.deficit = 0;
+		update_interest(co);
+		return false;
+	}
+	return true;
+}
+
+void Reactor::deliver_tcp(Connection & co, const unsigned char * data, size_t size)
+{
+	// Early data is queued until connected
+	if(!co.queued() && !co.connecting)
+	{
+		auto res = co.sck.Send_raw(data, size, MSG_NOSIGNAL);
+
+		if(res < 0)
+		{
+			if(!would_block())
+			{
+				LOG("Send failed on connection " << co.id << ',' << co.key << std::endl);
+				disconnect_tcp<true>(co);
+				return;
+			}
+			res = 0;
+		}
+
+		consume(co, res);
+
+		data += res;
+		size -= res;
+
+		if(!size) return;
+	}
+
+	if(co.queued() + size > max_queued)
+	{
+		LOG("Connection " << co.id << ',' << co.key << " too slow, dropping." << std::endl);
+		disconnect_tcp<true>(co);
+		return;
+	}
+
+	bool was_empty = !co.queued();
+
+	// Reclaim the space of sent data before growing the queue
+	if(co.out_pos && co.out_pos * 2 >= co.out_queue.size())
+	{
+		co.out_queue.erase(co.out_queue.begin(), co.out_queue.begin() + co.out_pos);
+		co.out_pos = 0;
+	}
+
+	co.out_queue.insert(co.out_queue.end(), data, data + size);
+
+	// Wait for the endpoint to be writable
+	if(was_empty && !co.connecting)
+		update_interest(co);
+}
+
+bool Reactor::flush_conn(Connection & co)
+{
+	while(co.queued())
+	{
+		auto res = co.sck.Send_raw(co.out_queue.data() + co.out_pos, co.queued(), MSG_NOSIGNAL);
+
+		if(res < 0)
+		{
+			if(would_block())
+				return true;
+
+			LOG("Send failed on connection " << co.id << ',' << co.key << std::endl);
+			if(co.closing)
+				disconnect_tcp<false>(co);
+			else
+				disconnect_tcp<true>(co);
+			return false;
+		}
+
+		co.out_pos += res;
+
+		if(!co.closing)
+			consume(co, res);
+	}
+
+	co.out_queue.clear();
+	co.out_pos = 0;
+
+	if(co.closing && !co.early)
+	{
+		disconnect_tcp<false>(co);
+		return false;
+	}
+
+	update_interest(co);
+	return true;
+}
+
+void Reactor::peer_disconnected(conn_id_t id)
+{
+	auto found = m_connections.find(id);
+
+	if(!found)
+	{
+		LOG("Double disconnect of connection " << id << std::endl);
+		return; // We don't care in this case...
+	}
+
+	auto & co = *found;
+
+	// Refused by the server
+	if(!co.established)
+		count_connect_failure();
+
+	// Messages held until the end of the early data are delivered first
+	if(!co.queued() && !co.early)
+	{
+		disconnect_tcp<false>(co);
+		return;
+	}
+
+	LOG("Connection " << id << ',' << co.key << " closing after " << co.queued() << " queued bytes." << std::endl);
+
+	co.closing = true;
+	update_interest(co);
+}
+
+void Reactor::consume(Connection & co, size_t size)
+{
+	co.consumed += size;
+	co.delivered += size;
+
+	// Batch the updates
+	if(co.consumed < m_app.m_options.window / 2)
+		return;
+
+	std::array<unsigned char, 9> msg = {(unsigned char)(Proto::OpCode::WINDOW_UPDATE)};
+
+	ENCODE_UINT32(co.key, &msg[1])
+	ENCODE_UINT32(co.consumed, &msg[5])
+
+	m_app.send_frame(m_app.lane_of(co.unkey), msg);
+
+	co.consumed = 0;
+}
+
+void Reactor::process_window_update(unsigned char * dat)
+{
+	conn_id_t id = DECODE_UINT32(&dat[0]);
+	auto found = m_connections.find(id);
+
+	if(!found)
+	{
+		LOG("Window update on dead connection " << id << std::endl);
+		return;
+	}
+
+	auto & co = *found;
+	uint32_t size = DECODE_UINT32(&dat[4]);
+
+	bool had_credit = co.may_receive();
+	co.credit += size;
+
+	// Delivered by the other side, no longer replayed
+	co.acked += size;
+	co.replay_pos = std::min(co.replay_pos + size, co.replay.size());
+	if(co.replay_pos == co.replay.size())
+	{
+		co.replay.clear();
+		co.replay_pos = 0;
+	}
+
+	// Data held waits for the turn of the connection
+	if(co.held_size())
+		queue_read(co);
+
+	// Resume reading
+	if(!had_credit && co.may_receive())
+		update_interest(co);
+}
+
+size_t Reactor::release_held(Connection & co, bool all, size_t limit)
+{
+	size_t pos = co.held_pos, end = all ? co.held.size() : co.held_pos + std::min(co.held_size(), limit);
+
+	while(pos != end && (all || co.credit > 0))
+	{
+		size_t size = std::min(end - pos, max_payload(co));
+		if(!all)
+			size = std::min<size_t>(size, co.credit);
+
+		m_message_buffer.resize(Proto::tcp_message_room + size);
+		memcpy(m_message_buffer.data() + Proto::tcp_message_room, co.held.data() + pos, size);
+
+		forward_tcp(co, m_message_buffer.data() + Proto::tcp_message_room, size);
+		pos += size;
+	}
+
+	size_t sent = pos - co.held_pos;
+	co.held_pos = pos;
+
+	// Moved to the front once mostly sent
+	if(co.held_pos == co.held.size())
+	{
+		co.held.clear();
+		co.held_pos = 0;
+	}
+	else if(co.held_pos >= co.held.size() / 2)
+	{
+		co.held.erase(co.held.begin(), co.held.begin() + co.held_pos);
+		co.held_pos = 0;
+	}
+	return sent;
+}
+
+void Reactor::lane_keepalives()
+{
+	for(size_t l = 0; l != m_app.n_lanes(); ++l)
+		if(&m_app.lane_reactor(l) == this)
+			m_app.send_keepalive(l);
+}
+
+uint64_t Reactor::keepalive_interval() const
+{
+	uint64_t interval = tcp_ka_interval;
+	for(size_t l = 0; l != m_app.n_lanes(); ++l)
+		if(&m_app.lane_reactor(l) == this)
+			interval = std::min(interval, m_app.keepalive_interval(l));
+	return interval;
+}
+
+void Reactor::flush_lanes()
+{
+	for(size_t l = 0; l != m_app.n_lanes(); ++l)
+		if(&m_app.lane_reactor(l) == this)
+			m_app.flush_lane(l);
+}
+
+void Reactor::save_connections(std::vector<unsigned char> & msg)
+{
+	m_connections.for_each([&msg](conn_id_t id, Connection & co){
+		size_t pos = msg.size();
+		msg.resize(pos + resume_entry_size);
+
+		ENCODE_KEY(co.unkey, &msg[pos])
+		ENCODE_UINT32(co.connecting || !co.established ? 0 : id, &msg[pos + 8])
+		ENCODE_UINT64(co.received, &msg[pos + 12])
+		ENCODE_UINT64(co.delivered, &msg[pos + 20])
+
+		// Reported with the delivered bytes
+		co.consumed = 0;
+	});
+}
+
+void Reactor::hold_events()
+{
+	auto & events = m_poller->events();
+
+	for(; m_next_event != events.size(); ++m_next_event)
+	{
+		auto & ev = events[m_next_event];
+		if(!ev.ready || tag_source(ev.tag) != Source::CONNECTION || !(ev.ready & Poller::DATA))
+			continue;
+
+		auto co = m_connections.find(conn_id_t(tag_index(ev.tag)));
+		if(!co)
+			continue;
+
+		if(ev.size == 0)
+			co->hung_up = true;
+		else
+			co->held.insert(co->held.end(), ev.data, ev.data + ev.size);
+	}
+}
+
+void Reactor::resume_connections(const ResumeMap & peer)
+{
+	m_connections.for_each([this, &peer](conn_id_t, Connection & co){
+		auto state = peer.find(co.unkey);
+		if(state == peer.end())
+		{
+			// Lost by the other side with the lanes. A closing connection only has queued data left to deliver.
+			if(!co.closing)
+			{
+				LOG("Connection " << co.id << ',' << co.key << " not resumed." << std::endl);
+				disconnect_tcp<false>(co);
+			}
+			return;
+		}
+
+		auto & ps = state->second;
+		if(ps.delivered > ps.received || ps.received > co.sent || ps.delivered < co.acked)
+			throw NetworkError("Inconsistent state of a resumed connection");
+
+		// Established by the server if its answer was lost. It is still connecting if its id is 0.
+		bool was_established = co.established;
+		if(ps.key)
+		{
+			co.key = ps.key;
+			co.established = true;
+		}
+
+		co.credit = co.established ? int64_t(m_app.m_peer_window) - int64_t(co.sent - ps.delivered) : early_credit(co);
+		co.replay_pos += ps.delivered - co.acked;
+		co.acked = ps.delivered;
+
+		if(co.connecting)
+			return; // Nothing sent yet, watched once connected
+
+		// Sent again from what the other side received
+		for(size_t pos = co.replay_pos + (ps.received - ps.delivered), part; pos != co.replay.size(); pos += part)
+		{
+			part = std::min(co.replay.size() - pos, max_payload(co));
+
+			m_message_buffer.resize(Proto::tcp_message_room + part);
+			memcpy(m_message_buffer.data() + Proto::tcp_message_room, co.replay.data() + pos, part);
+
+			send_message(co, m_message_buffer.data() + Proto::tcp_message_room, part);
+		}
+
+		// On the client, the early data ends once established. On the server, the client ended it if it was established :
+		// the early data lost with the lanes is sent again as messages.
+		if(!was_established && co.established)
+		{
+			count_connect(co);
+			if(m_app.m_early)
+				send_early_end(co);
+		}
+		if(co.early && ps.key && !end_early(co))
+			return;
+
+		// Disconnected once established
+		if(co.hung_up && co.established)
+		{
+			release_held(co, true);
+			disconnect_tcp<true>(co);
+			return;
+		}
+
+		// Readiness reported before the reset was not handled : check the connection again
+		release_held(co);
+		if(co.queued() && !flush_conn(co))
+			return;
+
+		update_interest(co);
+	});
+}
+
+void Reactor::start_timers()
+{
+	update_clock();
+	m_timers.clear();
+	m_lanes_timed_out = false;
+
+	// A first ping at once measures the lanes before they may time out
+	m_timers.add(m_app.m_ping ? m_now : m_now + tcp_ka_interval, {TimerKind::KEEPALIVE});
+
+	for(size_t l = 0; l != m_app.n_lanes(); ++l)
+		if(&m_app.lane_reactor(l) == this)
+			m_timers.add(m_app.m_last_tcp_packet[l] + m_app.lane_timeout(l), {TimerKind::LANE_TIMEOUT, l});
+
+	if(this == &m_app && !m_app.m_bypass_udp)
+		m_timers.add(m_app.m_udp_last_send + AppBase::udp_ka_interval, {TimerKind::UDP_KEEPALIVE});
+
+	// Scrapes served while the tunnel was reestablished
+	if(this == &m_app)
+		for(size_t s = 0; s != m_app.m_scrapes.size(); ++s)
+			if(m_app.m_scrapes[s].sck.valid())
+				m_timers.add(m_app.m_scrapes[s].deadline, {TimerKind::SCRAPE, s});
+
+	// Connections resumed with the tunnel
+	m_connections.for_each([this](conn_id_t, Connection & co){
+		if(co.idle_timeout)
+			arm_idle(co);
+	});
+}
+
+void Reactor::run_timers()
+{
+	m_timers.advance(m_now, [this](uint64_t deadline, const Timer & t){on_timer(deadline, t);});
+}
+
+void Reactor::on_timer(uint64_t deadline, const Timer & t)
+{
+	switch(t.kind)
+	{
+	case TimerKind::KEEPALIVE:
+		lane_keepalives();
+		m_timers.add(m_now + keepalive_interval(), t);
+		break;
+	case TimerKind::LANE_TIMEOUT:
+		{
+			auto expiry = m_app.m_last_tcp_packet[t.lane] + m_app.lane_timeout(t.lane);
+			if(m_now >= expiry)
+			{
+				m_lanes_timed_out = true;
+				m_metrics.lane_timeouts.add();
+			}
+			else
+				m_timers.add(expiry, t);
+		}
+		break;
+	case TimerKind::UDP_KEEPALIVE:
+		m_app.udp_keepalive();
+		break;
+	case TimerKind::IDLE:
+		{
+			auto found = m_connections.find(t.conn);
+			if(!found || found->idle_timer != deadline)
+				break; // Dropped, or rearmed since
+
+			auto & co = *found;
+
+			// Waiting for the server, which answers in any case
+			if(!co.established)
+				co.last_active = m_now;
+
+			if(m_now < co.last_active + co.idle_timeout)
+			{
+				arm_idle(co);
+				break;
+			}
+
+			LOG("Connection " << co.id << ',' << co.key << " idle, dropping." << std::endl);
+			m_metrics.idle_timeouts.add();
+			if(co.closing)
+				disconnect_tcp<false>(co);
+			else
+				disconnect_tcp<true>(co);
+		}
+		break;
+	case TimerKind::CONNECT_TIMEOUT:
+		{
+			auto found = m_connections.find(t.conn);
+			if(!found || !found->connecting)
+				break;
+
+			LOG("Connect timed out, key " << found->key << std::endl);
+			m_metrics.connect_timeouts.add();
+			count_connect_failure();
+			disconnect_tcp<true>(*found);
+		}
+		break;
+	case TimerKind::CONNECT_ATTEMPT:
+		{
+			auto found = m_connections.find(t.conn);
+			if(found && found->connecting && found->attempt_timer == deadline)
+				next_attempt(*found);
+		}
+		break;
+	case TimerKind::SCRAPE:
+		m_app.scrape_timed_out(t.lane, deadline);
+		break;
+	}
+}
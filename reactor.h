@@ -0,0 +1,503 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "classes.h"
+#include "socket.hpp"
+#include "poller.hpp"
+#include "timer_wheel.hpp"
+#include "slot_map.hpp"
+#include "metrics.hpp"
+#include "ral_proto.h"
+#include "debug.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <array>
+#include <unordered_map>
+
+#define ENCODE_KEY(key, loc) *reinterpret_cast<key_sock_uni_t*>(loc) = key_sock_uni_t(key);
+#define DECODE_KEY(loc) *reinterpret_cast<key_sock_uni_t*>(loc)
+
+#undef min
+
+class AppBase;
+
+// Event loop of a set of tunnel lanes and of the bridged connections carried by them.
+// The main thread runs the first one (the application itself), the others run in their own thread.
+// A lane is only read and written by the thread of its reactor, so frames never interleave.
+class Reactor : public NoCopy
+{
+public:
+
+	typedef uint64_t key_sock_uni_t;
+
+	static_assert(sizeof(key_sock_uni_t) == 8);
+
+	// Id of a connection in the table of its reactor. Each side gives its own to the other, which puts it in the frames of the connection.
+	typedef uint32_t conn_id_t;
+
+	// Share of the reads of the connections of a bridge : the classes of higher priority are read first, and within a class,
+	// each connection reads in turn as many quanta as its weight
+	struct Schedule
+	{
+		Proto::Priority priority = Proto::Priority::NORMAL;
+		unsigned char weight = 1;
+	};
+
+	struct Connection
+	{
+		Socket sck;
+		conn_id_t id = 0;
+		conn_id_t key = 0; // Id on the other side
+		key_sock_uni_t unkey = 0; // Given by the client, its lane is the lane of the connection
+		uint16_t bridge = 0; // Its traffic is counted in the metrics of the bridge
+
+		// Data received through the tunnel and not yet accepted by the endpoint, from out_pos
+		std::vector<unsigned char> out_queue;
+		size_t out_pos = 0;
+
+		bool established = true; // False on the client until the server connected the endpoint
+		bool connecting = false; // On the server, until a connect to the endpoint completes
+		bool closing = false; // Disconnected by the other side, closed once the queue is flushed
+
+		// On the server, until the client ended its early data : the messages received meanwhile follow it, and are held in late
+		bool early = false;
+		std::vector<unsigned char> late;
+
+		// Flow control : bytes that may still be sent to the other side, and bytes given to the endpoint not yet reported in a window update
+		int64_t credit = 0;
+		uint32_t consumed = 0;
+
+		// Readable and waiting for its turn, with the bytes it may still read in its turn
+		Schedule schedule;
+		bool readable = false;
+		int64_t deficit = 0;
+
+		// Received by the backend, sent from held_pos in the turn of the connection within its credit
+		std::vector<unsigned char> held;
+		size_t held_pos = 0;
+
+		// Payloads compressed, on a bridge with compression. After a payload which did not compress, the next ones are sent as they are.
+		bool compress = false;
+		unsigned char compress_skip = 0, compress_backoff = 1;
+
+		// Bytes of each direction since the connection was opened. Data sent is kept in replay from acked, once resumable, until the other side delivered it.
+		uint64_t sent = 0, acked = 0, received = 0, delivered = 0;
+		std::vector<unsigned char> replay;
+		size_t replay_pos = 0;
+		bool hung_up = false; // The endpoint closed while the tunnel was down
+
+		// Dropped after idle_timeout ms without activity, if not 0. Its idle timer is the one expiring at idle_timer, older ones are stale.
+		uint32_t idle_timeout = 0;
+		uint64_t last_active = 0, idle_timer = 0;
+
+		// While connecting : connects to the addresses of the endpoint racing, the socket of the first to complete becomes sck.
+		// The next address is tried when attempt_timer expires, or at once when the attempts in progress failed.
+		std::vector<Socket> attempts;
+		std::vector<Address> candidates; // Addresses not tried yet
+		uint64_t attempt_timer = 0;
+		uint64_t connect_start = 0; // us, for the connect latency
+
+		size_t queued() const {return out_queue.size() - out_pos;}
+
+		// The credit is not used up by the data held
+		bool may_receive() const {return credit > int64_t(held_size());}
+
+		size_t held_size() const {return held.size() - held_pos;}
+	};
+
+	// Kind of source behind a poller tag. The rest of the tag is the bridge index, or the id for connections, with the index of the attempt above it for connect attempts.
+	enum class Source : unsigned char
+	{
+		TUNNEL_TCP = 0,
+		TUNNEL_UDP = 1,
+		TCP_LISTENER = 2,
+		UDP_BRIDGE = 3,
+		CONNECTION = 4,
+		WAKE = 5,
+		CONNECT_ATTEMPT = 6,
+		METRICS = 7, // Listener of the scrapes, on the main thread
+		SCRAPE = 8,
+	};
+
+	static Poller::tag_t make_tag(Source src, uint64_t idx = 0)
+	{
+		return uint64_t(src) << 56 | idx;
+	}
+
+	static Source tag_source(Poller::tag_t tag) {return Source(tag >> 56);}
+	static uint64_t tag_index(Poller::tag_t tag) {return tag & ((uint64_t(1) << 56) - 1);}
+
+	typedef SlotMap<Connection> ConnectionMap;
+
+	static_assert(std::is_same_v<ConnectionMap::id_t, conn_id_t>);
+
+	typedef std::function<void()> Task;
+
+	// State of a connection on the other side, when the tunnel is resumed
+	struct ResumeState
+	{
+		conn_id_t key; // Its id
+		uint64_t received, delivered;
+	};
+
+	typedef std::unordered_map<key_sock_uni_t, ResumeState> ResumeMap; // By unique key
+
+	constexpr static size_t resume_entry_size = 28;
+
+	enum class TimerKind : unsigned char
+	{
+		KEEPALIVE, // Keepalives of the lanes of the reactor
+		LANE_TIMEOUT, // After the keepalive interval of the other side, and the round trip time once measured
+		UDP_KEEPALIVE, // Keepalive of the UDP channel, on the main thread
+		IDLE, // Idle timeout of a connection
+		CONNECT_TIMEOUT, // Of a connect to an endpoint
+		CONNECT_ATTEMPT, // Start of the connect to the next address of an endpoint
+		SCRAPE, // Timeout of a scrape of the metrics, on the main thread
+	};
+
+	// Timers are rearmed from the last activity when they expire, rather than on each activity
+	struct Timer
+	{
+		TimerKind kind;
+		size_t lane = 0; // Of a lane timeout, or index of a scrape
+		conn_id_t conn = 0; // Of an idle or connect timeout
+	};
+
+	// Largest payload of a frame, given by each side and negotiated down to the smaller one
+	static constexpr size_t default_frame_payload = 16 << 10;
+	static constexpr size_t min_frame_payload = 1 << 10;
+	static constexpr size_t max_frame_payload = 1 << 20;
+	static constexpr size_t max_provided_size = 64 << 10; // Receives into the buffers preallocated by a backend, for each of them
+
+	constexpr static size_t max_queued = 4 << 20; // Bytes queued for an endpoint before the connection is dropped
+	constexpr static uint32_t max_window = max_queued / 2;
+	constexpr static uint32_t max_early_data = 64 << 10; // Bytes sent by the client on a connection before it is established
+	constexpr static uint32_t read_quantum = 64 << 10; // Bytes read from a connection in its turn, for a weight of 1
+	constexpr static uint64_t tcp_ka_interval = 2000; // ms
+	constexpr static uint64_t tcp_timeout = tcp_ka_interval + 2000;
+	constexpr static uint64_t max_wait = 60000; // ms, longest poll without any timer
+	constexpr static size_t min_compress_size = 64; // Smaller payloads are sent as they are
+	constexpr static unsigned char max_compress_backoff = 64; // Payloads sent as they are after incompressible ones
+
+	// Buffers are sized for frame_payload, the largest payload this side accepts
+	Reactor(AppBase & app, bool io_uring, size_t frame_payload);
+	~Reactor() {stop();}
+
+	// Run the reactor in its own thread, until stopped
+	void start();
+
+	// Stop the thread of the reactor, dropping the tasks it did not run
+	void stop();
+
+	// Ask the thread of the reactor to stop, without waiting for it
+	void interrupt()
+	{
+		m_stop = true;
+		wake();
+	}
+
+	// Run a task in the thread of the reactor
+	void post(Task task);
+
+	// Interrupt the wait of the reactor
+	void wake()
+	{
+		unsigned char b = 0;
+		m_wake.Send_raw(&b, 1);
+	}
+
+	// Drop the tasks posted and not yet run
+	void drop_tasks()
+	{
+		std::lock_guard lock(m_inbox_mutex);
+		m_inbox.clear();
+	}
+
+	// Give a connection to the reactor, from its thread. Returns its id, or 0 if the table is full and the connection was dropped.
+	conn_id_t add_connection(Connection && co);
+
+	// Start connecting a bridged connection to its endpoint, from the thread of the reactor. Its addresses are raced (RFC 8305).
+	// The result is reported to the other side once a connect completes, all failed, or none completed after timeout ms (0 to leave it to the system).
+	void connect_endpoint(std::vector<Address> adrs, uint16_t bridge, conn_id_t key, key_sock_uni_t unkey, bool compress, uint32_t timeout, Schedule schedule);
+
+	// Report to the other side that a connection could not reach its endpoint, from the thread of the reactor
+	void refuse_connect(conn_id_t key, key_sock_uni_t unkey);
+
+	// Give early data of a connection to its endpoint, from the thread of the reactor. Empty data ends it.
+	// Dropped if the connection is not known : refused, or already closed.
+	void receive_early(key_sock_uni_t unkey, const std::vector<unsigned char> & data);
+
+	// Drop all the connections, when the tunnel is reset. The thread of the reactor should be stopped.
+	void clear_connections()
+	{
+		m_connections.for_each([this](conn_id_t, Connection & co){unwatch_conn(co);});
+		m_metrics.closed.add(m_connections.size());
+		m_connections.clear();
+		m_early.clear();
+		for(auto & queue : m_readable)
+			queue.clear();
+	}
+
+	// Append the state of the connections to a resume message : for each, its unique key, its id (0 until established), and the bytes received and delivered.
+	// The thread of the reactor should be stopped.
+	void save_connections(std::vector<unsigned char> & msg);
+
+	// Hold the data received by the backend in the events left unprocessed when the tunnel was reset, until the connections are resumed.
+	// The thread of the reactor should be stopped.
+	void hold_events();
+
+	// Resume the connections once the tunnel is reestablished, from their state on the other side : the ones it lost are dropped,
+	// and the data it did not receive is sent again. The thread of the reactor should be stopped.
+	void resume_connections(const ResumeMap & peer);
+
+	// Restart the timers when the tunnel is (re)established : keepalives and timeouts of the lanes of the reactor.
+	// Its thread should be stopped.
+	void start_timers();
+
+	void watch(Socket & sck, Source src, uint64_t idx, uint32_t interest)
+	{
+		CHECK_RET(m_poller->add(sck.socket(), make_tag(src, idx), interest))
+	}
+
+	void unwatch(Socket & sck)
+	{
+		if(sck.valid())
+			m_poller->remove(sck.socket());
+	}
+
+	void rewatch(Socket & sck, Source src, uint64_t idx, uint32_t interest)
+	{
+		CHECK_RET(m_poller->modify(sck.socket(), make_tag(src, idx), interest))
+	}
+
+	// Give a batch of frames to the backend, which sends it in the background and reports the socket with SENT : false if it does not send
+	bool send_batch(Socket & sck, std::vector<unsigned char> & data) {return m_poller->send(sck.socket(), data);}
+
+	// Read by the main thread when scraped, while the reactor runs
+	const Metrics & metrics() const {return m_metrics;}
+
+protected:
+	AppBase & m_app;
+
+	std::unique_ptr<Poller> m_poller;
+	std::vector<unsigned char> m_message_buffer;
+	std::vector<unsigned char> m_compress_buffer; // Compressed payloads, after room for the header
+	ConnectionMap m_connections;
+	std::unordered_map<key_sock_uni_t, conn_id_t> m_early; // Connections which may still receive early data, by unique key
+	std::array<std::deque<conn_id_t>, Proto::n_priorities> m_readable; // Connections waiting for their turn to read, by priority class
+	Metrics m_metrics;
+
+	size_t m_next_event = 0; // Events of the last wait are processed in order, from this one
+	uint64_t m_now; // Monotonic time in ms, updated after poll
+	TimerWheel<Timer> m_timers;
+	bool m_lanes_timed_out = false;
+
+	Socket m_wake; // Loopback datagram socket connected to itself, written to wake the reactor up
+	std::mutex m_inbox_mutex;
+	std::vector<Task> m_inbox; // Tasks posted by other threads
+	std::thread m_thread;
+	std::atomic<bool> m_stop = false;
+
+	void drain_wake()
+	{
+		unsigned char b;
+		while(m_wake.Recv_raw(&b, 1) > 0);
+	}
+
+	void run_inbox();
+
+	// Loop of a worker reactor
+	void run();
+
+	// Process the frames received on a lane owned by a worker. Returns false if the lane was closed.
+	bool process_lane(size_t l, const Poller::Event & ev);
+
+	// Receive what a lane has available into its reader, without blocking, or take what the backend received. Returns false if the lane was closed.
+	bool receive_lane(size_t l, const Poller::Event & ev);
+
+	// Process a whole frame common to all the lanes, received on lane l, from its opcode. Returns false for other opcodes.
+	bool process_frame(size_t l, unsigned char * frame);
+
+	// Send data received on a connection through the tunnel. The payload should have space for the header reserved before it.
+	void forward_tcp(Connection & co, unsigned char * payload, uint32_t size);
+
+	// Frame a payload of a connection and send it, compressed if enabled, without accounting it. Sent as early data until established.
+	void send_message(Connection & co, unsigned char * payload, uint32_t size);
+
+	// Send early data of a connection on the first lane, after its connect. The payload should have space for the header reserved before it.
+	void send_early(Connection & co, unsigned char * payload, uint32_t size);
+
+	// Credit of a client connection until it is established : what remains of the early data, if the other side accepts it
+	int64_t early_credit(const Connection & co) const;
+
+	// Tell the server that the early data of a connection ended, once it is established
+	void send_early_end(Connection & co)
+	{
+		std::array<unsigned char, Proto::early_data_header_size> msg;
+		send_early(co, msg.data() + msg.size(), 0);
+	}
+
+	// On the server, give the messages held until the end of the early data to the endpoint. Returns false if the connection was dropped.
+	bool end_early(Connection & co);
+
+	// Largest payload of a frame of a connection : compressed payloads are at most a compression block
+	size_t max_payload(const Connection & co) const;
+
+	// Compress a payload into m_compress_buffer. Returns the payload to send, with its size flagged as compressed, or the original one if it did not compress.
+	unsigned char * compress_payload(Connection & co, unsigned char * payload, uint32_t & size);
+
+	template<bool Message>
+	void disconnect_tcp(Connection & co);
+
+	// Handle an event on a bridged connection socket. Readable connections are read by run_reads.
+	void check_conn(const Poller::Event & ev);
+
+	// Read the readable connections, once each in turn (deficit round robin), the classes of higher priority first.
+	// Those with more to read wait for the next iteration : the other sources are served between turns.
+	void run_reads();
+
+	// Queue a connection for its turn to read, unless waiting already or out of credit
+	void queue_read(Connection & co)
+	{
+		if(co.readable || co.credit <= 0)
+			return;
+		co.readable = true;
+		m_readable[size_t(co.schedule.priority)].push_back(co.id);
+	}
+
+	// Read a connection within its deficit and its credit, the data held first. Returns true if it may have more to read, false if it was drained or dropped.
+	bool read_conn(Connection & co);
+
+	bool has_reads() const
+	{
+		return std::any_of(m_readable.begin(), m_readable.end(), [](const auto & queue){return !queue.empty();});
+	}
+
+	// Start a connect to the next address of the endpoint of a connection. Addresses failing at once are skipped.
+	void next_attempt(Connection & co);
+
+	// Handle a connect attempt completed or failed, once its socket is writable
+	void check_attempt(const Poller::Event & ev);
+
+	static bool attempting(const Connection & co)
+	{
+		return std::any_of(co.attempts.begin(), co.attempts.end(), [](const Socket & sck){return sck.valid();});
+	}
+
+	// Remove the sockets of a connection from the poller
+	void unwatch_conn(Connection & co)
+	{
+		m_poller->remove(co.sck.socket());
+		for(auto & sck : co.attempts)
+			if(sck.valid())
+				m_poller->remove(sck.socket());
+	}
+
+	// Report to the client that a connection reached its endpoint
+	void send_established(Connection & co);
+
+	// Account the outcome of the connect of a connection to its endpoint
+	void count_connect(const Connection & co)
+	{
+		m_metrics.connects.add();
+		m_metrics.connect_latency.record(monotonic_us() - co.connect_start);
+	}
+
+	void count_connect_failure() {m_metrics.connect_failures.add();}
+
+	// Account a payload of a connection received from the tunnel, or sent through it
+	void count_in(const Connection & co, uint32_t size)
+	{
+		auto & traffic = m_metrics.tcp_traffic(co.bridge);
+		traffic.bytes_in.add(size);
+		traffic.frames_in.add();
+		m_metrics.frame_in.record(size);
+	}
+
+	void count_out(const Connection & co, uint32_t size)
+	{
+		auto & traffic = m_metrics.tcp_traffic(co.bridge);
+		traffic.bytes_out.add(size);
+		traffic.frames_out.add();
+		m_metrics.frame_out.record(size);
+	}
+
+	// Give data received through the tunnel to the endpoint of a connection, queuing what it does not accept now
+	void deliver_tcp(Connection & co, const unsigned char * data, size_t size);
+
+	// Send queued data to the endpoint. Returns false if the connection was dropped or closed.
+	bool flush_conn(Connection & co);
+
+	// The other side disconnected : close the connection once the queued data is delivered
+	void peer_disconnected(conn_id_t id);
+
+	// Account bytes given to the endpoint, and give the credit back to the other side
+	void consume(Connection & co, size_t size);
+
+	// Send the held data of a connection within its credit and up to limit bytes, or all of it before disconnecting. Returns the bytes sent.
+	size_t release_held(Connection & co, bool all = false, size_t limit = SIZE_MAX);
+
+	// Call to process a WINDOW_UPDATE message, after the opcode
+	void process_window_update(unsigned char * dat);
+
+	// Interest of a connection. Reading stops when the credit is exhausted, which is the early credit until established.
+	// A closing connection waits for the end of its early data once its queue is flushed.
+	static uint32_t conn_interest(const Connection & co)
+	{
+		if(co.closing) return co.queued() || !co.early ? Poller::OUT : 0;
+		return (co.may_receive() && !co.hung_up ? Poller::IN | Poller::RECV : 0) | (co.queued() ? Poller::OUT : 0);
+	}
+
+	void update_interest(Connection & co)
+	{
+		CHECK_RET(m_poller->modify(co.sck.socket(), make_tag(Source::CONNECTION, co.id), conn_interest(co)))
+	}
+
+	// Send a keepalive on the lanes of the reactor
+	void lane_keepalives();
+
+	// Interval of the keepalives of the reactor : the shortest one of its lanes
+	uint64_t keepalive_interval() const;
+
+	// Send the frames batched for the lanes of the reactor
+	void flush_lanes();
+
+	// Check if a lane of the reactor timed out, when its timer expired
+	bool lanes_timed_out() const {return m_lanes_timed_out;}
+
+	void update_clock() {m_now = monotonic_ms();}
+
+	// Poll timeout until the next timer, in ms. Connections waiting for their turn are read without waiting.
+	int poll_timeout() const
+	{
+		if(has_reads())
+			return 0;
+
+		auto next = m_timers.next_tick();
+		auto now = monotonic_ms();
+		return next <= now ? 0 : int(std::min(next - now, max_wait));
+	}
+
+	// Expire the timers due, once the clock is updated
+	void run_timers();
+
+	void on_timer(uint64_t deadline, const Timer & t);
+
+	// Arm the idle timer of a connection, from its last activity
+	void arm_idle(Connection & co)
+	{
+		co.idle_timer = co.last_active + co.idle_timeout;
+		m_timers.add(co.idle_timer, {TimerKind::IDLE, 0, co.id});
+	}
+};
+
+#endif
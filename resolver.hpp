@@ -0,0 +1,189 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include "socket.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Host names resolved by threads of their own, several at once, so that a slow resolver does not hold the event loop.
+// A host stays in the cache once added, and is looked up again in the background when its answer expires : an endpoint moving to another address is followed.
+// getaddrinfo gives no TTL : every answer is kept for the same time, given by the owner. The previous addresses stay in use until new ones are known.
+class Resolver
+{
+public:
+	// Called in the thread of the owner with the addresses of a host (port 0) when they change, in the order to try them.
+	// They are empty when a lookup fails before any address is known.
+	typedef std::function<void(const std::string & host, const std::vector<Address> & adrs)> Handler;
+
+	constexpr static unsigned max_threads = 4;
+	constexpr static std::chrono::seconds retry_delay{5}; // After a failed lookup
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Entry
+	{
+		std::vector<Address> adrs; // Empty until resolved
+		Clock::time_point due; // Of the next lookup, at once for a new host
+		bool running = false;
+	};
+
+	struct Result
+	{
+		std::string host;
+		std::vector<Address> adrs; // Empty if the lookup failed
+	};
+
+	int m_socktype;
+	std::chrono::seconds m_ttl;
+	std::function<void()> m_wake; // Called by the threads once a result is ready, to wake the owner up
+	Handler m_handler;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv; // Hosts to look up, for the threads
+	std::condition_variable m_ready; // Results, for the owner
+	std::unordered_map<std::string, Entry> m_entries;
+	std::vector<Result> m_results;
+	std::vector<std::thread> m_threads; // Started as hosts are added
+	bool m_stop = false;
+
+	void run()
+	{
+		std::unique_lock lock(m_mutex);
+		while(!m_stop)
+		{
+			auto now = Clock::now();
+			auto next = Clock::time_point::max();
+			auto due = m_entries.end();
+
+			for(auto it = m_entries.begin(); it != m_entries.end(); ++it)
+			{
+				if(it->second.running)
+					continue;
+				if(it->second.due <= now)
+				{
+					due = it;
+					break;
+				}
+				next = std::min(next, it->second.due);
+			}
+
+			if(due == m_entries.end())
+			{
+				if(next == Clock::time_point::max())
+					m_cv.wait(lock);
+				else
+					m_cv.wait_until(lock, next);
+				continue;
+			}
+
+			std::string host = due->first;
+			due->second.running = true;
+			lock.unlock();
+
+			std::vector<Address> adrs;
+			try
+			{
+				adrs = resolve_addresses(host.c_str(), m_socktype);
+			}
+			catch(const std::runtime_error &) {}
+
+			lock.lock();
+
+			auto e = m_entries.find(host);
+			if(e == m_entries.end())
+				continue; // Cleared meanwhile
+
+			auto & entry = e->second;
+			entry.running = false;
+			entry.due = Clock::now() + (adrs.empty() ? retry_delay : m_ttl);
+
+			// Only changes are reported. A failure keeps the previous addresses.
+			if(adrs.empty() ? !entry.adrs.empty() : adrs == entry.adrs)
+				continue;
+
+			if(!adrs.empty())
+				entry.adrs = adrs;
+			m_results.push_back({std::move(host), std::move(adrs)});
+			m_ready.notify_all();
+			m_wake();
+		}
+	}
+
+public:
+
+	Resolver(int socktype, std::chrono::seconds ttl, std::function<void()> wake) : m_socktype(socktype), m_ttl(ttl), m_wake(std::move(wake)) {}
+
+	~Resolver()
+	{
+		{
+			std::lock_guard lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+
+		// A lookup in progress is waited for
+		for(auto & t : m_threads)
+			t.join();
+	}
+
+	void set_handler(Handler handler) {m_handler = std::move(handler);}
+
+	// Keep a host resolved. Returns its addresses if already known, else none : the handler is called once they are.
+	std::vector<Address> add(const std::string & host)
+	{
+		{
+			std::lock_guard lock(m_mutex);
+			auto [it, added] = m_entries.try_emplace(host);
+			if(!added)
+				return it->second.adrs;
+
+			if(m_threads.size() < std::min<size_t>(max_threads, m_entries.size()))
+				m_threads.emplace_back([this]{run();});
+		}
+		m_cv.notify_one();
+		return {};
+	}
+
+	// Forget the hosts, and the results not yet handled
+	void clear()
+	{
+		std::lock_guard lock(m_mutex);
+		m_entries.clear();
+		m_results.clear();
+	}
+
+	// Call the handler for the results ready, from the thread of the owner
+	void complete()
+	{
+		std::vector<Result> results;
+		{
+			std::lock_guard lock(m_mutex);
+			results.swap(m_results);
+		}
+
+		for(auto & r : results)
+			m_handler(r.host, r.adrs);
+	}
+
+	// Wait for a result, when the owner has nothing else to do, and handle it
+	void wait()
+	{
+		{
+			std::unique_lock lock(m_mutex);
+			m_ready.wait(lock, [this]{return !m_results.empty();});
+		}
+		complete();
+	}
+};
+
+#endif
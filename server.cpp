@@ -7,9 +7,12 @@
 #include <cerrno>
 #include <iostream>
 #include <iterator>
+#include <random>
 #include <stdexcept>
 #include <tuple>
+#include <utility>
 #include <array>
+#include <chrono>
 
 void Server::run()
 {
@@ -19,8 +22,6 @@ void Server::run()
 
 void Server::initiate()
 {
-	m_pfds = {{0, POLLIN, 0}, {0, POLLIN, 0}};
-
 	connect_proto_tcp(true);
 
 	Proto::UDPBypass ub;
@@ -34,20 +35,29 @@ void Server::initiate()
 
 	init_post_connection();
 
-	m_last_tcp_packet = m_cur_time = time(nullptr);
+	reset_tcp_timeout();
 }
 
 bool Server::connect_proto_tcp(bool fresh)
 {
+	if(m_session)
+	{
+		// Established by the listener, with all the lanes
+		for(size_t l = 0; l != n_lanes(); ++l)
+			lane_reactor(l).watch(lane(l), Source::TUNNEL_TCP, l, Poller::IN | Poller::LEVEL);
+		return true;
+	}
+
 	Socket tcp_plug;
 	Address tcp_adr_rec(AF_INET, SOCK_STREAM, "0.0.0.0", m_tcp_port);
 
 	CHECK_RET(tcp_plug.create(AF_INET, SOCK_STREAM))
+	CHECK_RET(tcp_plug.set_reuseaddr())
 	CHECK_RET(tcp_plug.bind(tcp_adr_rec))
 
 	std::cout << "Listening on port " << m_tcp_port << ". Waiting for client." << std::endl;
 
-	CHECK_RET(tcp_plug.listen(1))
+	CHECK_RET(tcp_plug.listen(max_lanes))
 	std::tie(m_tcp_proto_conn, m_proto_udp_address) = tcp_plug.accept_addr();
 	CHECK_RET(m_tcp_proto_conn.valid())
 
@@ -60,19 +70,99 @@ bool Server::connect_proto_tcp(bool fresh)
 
 	std::cout << "Client connected : " << m_proto_udp_address.str() << std::endl;
 
-	m_pfds.front().fd = m_tcp_proto_conn.socket();
-
+	// A lane is read once per event, up to the room of its reader : level triggered, what is left is reported again
+	watch(m_tcp_proto_conn, Source::TUNNEL_TCP, 0, Poller::IN | Poller::LEVEL);
 
 	Proto::Connection cn(fresh ? Proto::Connection::FRESH : Proto::Connection::RESUME);
 	m_tcp_proto_conn.Send(cn);
 	m_tcp_proto_conn.Recv(cn);
+
+	accept_lanes(tcp_plug);
+
 	return cn == Proto::Connection::FRESH;
 }
 
+void Server::accept_lanes(Socket & listener)
+{
+	unsigned char n;
+	CHECK_RET(m_tcp_proto_conn.Recv(n))
+	CHECK_RET(n >= 1 && n <= max_lanes)
+
+	m_session_id = std::mt19937_64(std::random_device()())();
+
+	std::array<unsigned char, 8> session;
+	memcpy(session.data(), &m_session_id, session.size());
+	CHECK_RET(m_tcp_proto_conn.Send(session))
+
+	set_lanes(n);
+
+	auto deadline = std::chrono::steady_clock::now() + lane_join_timeout;
+
+	for(unsigned joined = 1; joined != n;)
+	{
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		pollfd pfd = {listener.socket(), POLLIN, 0};
+		int res = left > 0 ? poll(&pfd, 1, int(left)) : 0;
+		if(res < 0 && interrupted())
+			continue;
+		CHECK_RET(res >= 0)
+		if(res == 0)
+			throw NetworkError("The lanes did not join in time");
+
+		Socket sck = listener.accept();
+		if(!sck.valid())
+			continue;
+
+		// A peer which closes, stays silent or sends something else is rejected, and the next connection accepted
+		StatVec<10> join;
+		try
+		{
+			CHECK_RET(sck.set_recv_timeout(handshake_timeout))
+
+			Proto::OpCode opcode = Proto::OpCode::ESTABLISH;
+			CHECK_RET(sck.Send(opcode) > 0)
+
+			StatVec<1> byte;
+			size_t skipped = 0;
+			do
+			{
+				CHECK_RET(sck.Recv(byte) && byte.dyn_size && skipped++ <= max_skipped)
+			} while (Proto::OpCode(byte[0]) != Proto::OpCode::ESTABLISH);
+
+			CHECK_RET(sck.Recv(join, MSG_WAITALL) && join.dyn_size == join.size())
+			CHECK_RET(sck.set_recv_timeout(0))
+		}
+		catch(const std::runtime_error &)
+		{
+			std::cout << "Rejected a connection which did not join as a lane." << std::endl;
+			continue;
+		}
+
+		unsigned l = join[9];
+
+		if(Proto::Connection(join[0]) != Proto::Connection::LANE || memcmp(&join[1], session.data(), session.size()) != 0
+			|| l == 0 || l >= n || lane(l).valid())
+		{
+			std::cout << "Rejected a connection that is not a lane of the session." << std::endl;
+			continue;
+		}
+
+		lane_reactor(l).watch(sck, Source::TUNNEL_TCP, l, Poller::IN | Poller::LEVEL);
+		lane(l) = std::move(sck);
+		joined++;
+	}
+
+	if(n > 1)
+		std::cout << "Tunnel striped over " << unsigned(n) << " lanes." << std::endl;
+}
+
 void Server::init_post_connection()
 {
 	std::cout << "Initializing connection" << std::endl;
 
+	exchange_windows();
+	exchange_capabilities();
+
 	if(!m_bypass_udp)
 	{
 		std::array<unsigned char, 2> port;
@@ -92,277 +182,386 @@ void Server::init_post_connection()
 			<< client_udp_port << std::endl;
 
 		establish_udp_connection();
+		watch_udp_socket();
 
 		std::cout << "UDP connect OK." << std::endl;
 	}
 	else
 	{
 		std::cout << "UDP bypass enabled." << std::endl;
-		set_bypass();
 	}
 }
 
-void Server::add_endpoint(Proto::Protocol proto, port_t dst_port, const char * hostname)
+void Server::add_endpoint(Proto::Protocol proto, port_t dst_port, const char * hostname, unsigned char options, uint32_t connect_timeout, Schedule schedule)
 {
-	std::cout << "Adding endpoint for protocol " << (proto == Proto::Protocol::TCP ? "TCP" : "UDP") << " at " << hostname << ':' << dst_port << std::endl;
+	bool compress = options & (unsigned char)(Proto::BridgeOption::COMPRESS);
+
+	std::cout << "Adding endpoint for protocol " << (proto == Proto::Protocol::TCP ? "TCP" : "UDP") << " at " << hostname << ':' << dst_port
+		<< (compress ? " with compression" : "");
+	if(connect_timeout)
+		std::cout << ", connect timeout " << connect_timeout << "ms";
+	if(options & (unsigned char)(Proto::BridgeOption::SCHEDULE))
+		std::cout << ", priority " << int(schedule.priority) << ", weight " << int(schedule.weight);
+	std::cout << std::endl;
 
-	Address adr{AF_INET, SOCK_STREAM, hostname, dst_port};
+	// Resolved in the background, unless already known
+	auto adrs = m_resolver.add(hostname);
 
 	if(proto == Proto::Protocol::TCP)
 	{
-		m_tcp_addresses.push_back(std::move(adr));
+		m_tcp_endpoints.push_back({hostname, dst_port});
+		m_tcp_addresses.emplace_back();
+		m_tcp_pending.emplace_back();
+		m_tcp_compress.push_back(compress);
+		m_tcp_connect_timeout.push_back(connect_timeout);
+		m_tcp_schedule.push_back(schedule);
+
+		if(!adrs.empty())
+			set_tcp_addresses(m_tcp_addresses.size() - 1, adrs);
 	}
 	else if(proto == Proto::Protocol::UDP)
 	{
-		CombinedAddressSocket sck{{}, std::move(adr)};
+		m_udp_sockets.emplace_back();
+		m_udp_sockets.back().weight = schedule.weight;
+		m_udp_endpoints.push_back({hostname, dst_port});
 
-		CHECK_RET(sck.sck.create(sck.addr.af(), SOCK_DGRAM))
-
-		m_pfds.push_back({sck.sck.socket(), POLLIN, 0});
-		m_udp_sockets.push_back(std::move(sck));
+		if(!adrs.empty())
+			set_udp_address(m_udp_sockets.size() - 1, adrs.front());
 	}
 	else
 		throw std::runtime_error("Unknown protocol in CONFIG message");
 }
 
-void Server::proc_loop()
+void Server::set_tcp_addresses(size_t bridge, const std::vector<Address> & adrs)
 {
-	while(m_run)
+	m_tcp_addresses[bridge] = adrs;
+	for(auto & adr : m_tcp_addresses[bridge])
+		adr.set_port(m_tcp_endpoints[bridge].port);
+}
+
+void Server::set_udp_address(size_t bridge, const Address & adr)
+{
+	auto & cs = m_udp_sockets[bridge];
+
+	// The socket is of the family of the address
+	if(!cs.sck.valid() || cs.addr.af() != adr.af())
 	{
-		if(check_tcp_timeout())
-			on_timeout();
+		unwatch(cs.sck);
+		CHECK_RET(cs.sck.create(adr.af(), SOCK_DGRAM))
+		CHECK_RET(cs.sck.set_nonblocking())
+		watch(cs.sck, Source::UDP_BRIDGE, bridge, Poller::IN);
+	}
 
-		auto rpoll = poll_pfds();
-		
-		if(rpoll == 0) continue;
+	cs.addr = adr;
+	cs.addr.set_port(m_udp_endpoints[bridge].port);
+}
 
-		CHECK_RET(rpoll);
+void Server::clear_bridges()
+{
+	clear_udp_bridges();
+	m_udp_endpoints.clear();
 
+	m_tcp_endpoints.clear();
+	m_tcp_addresses.clear();
+	m_tcp_pending.clear();
+	m_tcp_compress.clear();
+	m_tcp_connect_timeout.clear();
+	m_tcp_schedule.clear();
 
-		// Check client TCP / UDP
-		
-		while(m_pfds.front().revents & pollmask)
-		{
-			if(m_pfds.front().revents & (POLLIN | POLLRDNORM))
-			{
-				process_tcp_message();
-			}
-			else if(m_pfds.front().revents & (POLLERR | POLLHUP))
-			{
-				std::cout << "Lost connection. Reconnecting." << std::endl;
-				send_timeout_message();
-				on_timeout();
-			}
+	m_resolver.clear();
+}
 
+void Server::on_resolved(const std::string & host, const std::vector<Address> & adrs)
+{
+	if(adrs.empty())
+		std::cout << "Cannot resolve endpoint " << host << ", retrying." << std::endl;
+	else
+	{
+		std::cout << "Endpoint " << host << " resolved to";
+		for(auto & adr : adrs)
+			std::cout << ' ' << adr.str();
+		std::cout << std::endl;
+	}
 
-			if(!m_tcp_proto_conn.valid())
-			{
-				std::cout << "Lost connection. Reconnecting." << std::endl;
-				send_timeout_message();
-				on_timeout();
-			}
+	for(size_t b = 0; b != m_tcp_endpoints.size(); ++b)
+	{
+		if(m_tcp_endpoints[b].host != host)
+			continue;
 
-			// /!\ with TCP message, the pfd vector might have been reallocated
+		m_tcp_endpoints[b].unresolved = adrs.empty();
+		if(!adrs.empty())
+			set_tcp_addresses(b, adrs);
 
-			CHECK_RET(poll(&m_pfds.front(), 1, 0) >= 0)
+		// Connections waiting for the endpoint. They are refused if it cannot be resolved.
+		for(auto & pc : std::exchange(m_tcp_pending[b], {}))
+		{
+			connect_bridge(uint16_t(b), pc.key, pc.unkey);
+			for(auto & data : pc.early)
+				forward_early(pc.unkey, std::move(data));
 		}
+	}
 
-		// pfd vector won't invalidate ahead
+	// Datagrams go to the first address
+	if(adrs.empty())
+		return;
 
-		auto iter_pfd = std::next(m_pfds.begin());
+	for(size_t b = 0; b != m_udp_endpoints.size(); ++b)
+		if(m_udp_endpoints[b].host == host)
+			set_udp_address(b, adrs.front());
+}
 
-		
-		while (iter_pfd->revents & pollmask)
+void Server::connect_bridge(uint16_t bridge, conn_id_t key, key_sock_uni_t unkey)
+{
+	// Connected by the reactor of the lane of the connection
+	auto & r = conn_reactor(unkey);
+
+	if(m_tcp_endpoints[bridge].unresolved)
+	{
+		dispatch(r, [&r, key, unkey]{r.refuse_connect(key, unkey);});
+		return;
+	}
+
+	bool compress = m_compression && m_tcp_compress[bridge];
+	uint32_t timeout = m_tcp_connect_timeout[bridge];
+	Schedule schedule = m_tcp_schedule[bridge];
+	dispatch(r, [&r, adrs = m_tcp_addresses[bridge], bridge, key, unkey, compress, timeout, schedule]{r.connect_endpoint(adrs, bridge, key, unkey, compress, timeout, schedule);});
+}
+
+void Server::forward_early(key_sock_uni_t unkey, std::vector<unsigned char> data)
+{
+	for(auto & pending : m_tcp_pending)
+		for(auto & pc : pending)
+			if(pc.unkey == unkey)
+			{
+				pc.early.push_back(std::move(data));
+				return;
+			}
+
+	auto & r = conn_reactor(unkey);
+	dispatch(r, [&r, unkey, data = std::move(data)]{r.receive_early(unkey, data);});
+}
+
+void Server::proc_loop()
+{
+	start_workers();
+
+	while(m_run)
+	{
+		if(check_tcp_timeout())
 		{
-			process_udp_message();
-			CHECK_RET(poll(&(*iter_pfd), 1, 0) >= 0)
+			on_timeout();
+			continue;
 		}
-		
-		iter_pfd++;
 
-		// Check endpoints
-		
+		auto rpoll = poll_events();
 		
-		// UDP
-		uint16_t bridge = 0;
-		for(auto & sck : m_udp_sockets)
+		if(rpoll == 0) continue;
+
+		CHECK_RET(rpoll > 0);
+
+		auto epoch = m_epoch;
+
+		auto & events = m_poller->events();
+		while(m_next_event != events.size())
 		{
-			while(iter_pfd->revents & pollmask)
+			auto & ev = events[m_next_event++];
+			if(!ev.ready) continue; // Source removed during this iteration
+
+			switch(tag_source(ev.tag))
 			{
-				m_message_buffer.resize(m_message_buffer.capacity());
-				auto recres = sck.sck.Recv_raw(m_message_buffer.data() + Proto::udp_message_header_size, m_message_buffer.size() - Proto::udp_message_header_size);
-#ifdef WIN32
-				if(recres < 0)
+			case Source::TUNNEL_TCP:
 				{
-					auto err = WSAGetLastError();
-					if(err == WSAECONNRESET)
+					// Check client TCP
+					auto l = tag_index(ev.tag);
+
+					if(ev.ready & Poller::SENT)
 					{
-						LOG("UDP port unreachable on bridge " << bridge << std::endl);
+						lane_sent(l, ev.ready);
+						break;
+					}
+
+					if(ev.ready & Poller::IN)
+					{
+						process_tcp_message(l, ev);
 					}
-					else
-						{
-							std::cout << "err on UDP recv : " << err << std::endl;
-							throw std::runtime_error("Error on UDP recv");
-						}
-				}
-#else
-				CHECK_RET(recres >= 0);
-#endif
-				send_udp(bridge, recres);
 
-				CHECK_RET(poll(&(*iter_pfd), 1, 0) >= 0)
+					// Losing any lane reestablishes the whole tunnel
+					if(epoch == m_epoch && (!lane(l).valid() || (!(ev.ready & Poller::IN) && lane_error(l, ev.ready))))
+					{
+						std::cout << "Lost connection. Reconnecting." << std::endl;
+						send_timeout_message();
+						on_timeout();
+					}
+				}
+				break;
+			case Source::TUNNEL_UDP:
+				check_udp_channel(ev);
+				break;
+			case Source::UDP_BRIDGE:
+				check_udp_bridge(tag_index(ev.tag));
+				break;
+			case Source::CONNECTION:
+				check_conn(ev);
+				break;
+			case Source::CONNECT_ATTEMPT:
+				check_attempt(ev);
+				break;
+			case Source::WAKE:
+				drain_wake();
+				break;
+			case Source::METRICS:
+				accept_scrapes();
+				break;
+			case Source::SCRAPE:
+				check_scrape(tag_index(ev.tag));
+				break;
+			case Source::TCP_LISTENER:
+			default:
+				break;
 			}
 
-			iter_pfd++;
-			bridge++;
+			// The tunnel was reestablished : remaining events refer to dropped sources
+			if(epoch != m_epoch) break;
 		}
+	}
+}
 
-		// TCP
-		
-		for(;iter_pfd != m_pfds.end(); iter_pfd++)
+void Server::check_udp_bridge(uint16_t bridge)
+{
+	auto & sck = m_udp_sockets[bridge];
+	unsigned batches = 0;
+
+	do
+	{
+		auto n = m_udp_in.recv(sck.sck, udp_payload());
+
+		if(n < 0)
 		{
-			if(check_conn_pfd(iter_pfd)) break;
+			if(would_block())
+				return;
+#ifdef WIN32
+			auto err = WSAGetLastError();
+			if(err == WSAECONNRESET)
+			{
+				LOG("UDP port unreachable on bridge " << bridge << std::endl);
+				continue;
+			}
+
+			std::cout << "err on UDP recv : " << err << std::endl;
+			throw std::runtime_error("Error on UDP recv");
+#else
+			CHECK_RET(false)
+#endif
 		}
 
+		// Datagrams are received after room for the header
+		for(int i = 0; i != n; ++i)
+			send_udp(bridge, m_udp_in.data(i), m_udp_in.size(i));
+
+		m_udp_out.flush();
+
+		if(size_t(n) < m_udp_in.depth())
+			return; // Drained
+
+		// Turn used up : the rest is read after the other sources
+		if(m_poller->edge_triggered() && ++batches == sck.weight)
+		{
+			post([this, bridge]{check_udp_bridge(bridge);});
+			return;
+		}
 	}
+	while(m_poller->edge_triggered());
 }
 
 
-void Server::process_tcp_message()
+void Server::process_tcp_message(size_t l, const Poller::Event & ev)
 {
+	auto & tun = lane(l);
 
-	StatVec<1> opcode;
-	m_tcp_proto_conn.Recv(opcode);
-
-	if(opcode.dyn_size == 0)
+	if(!receive_lane(l, ev))
 	{
-		m_tcp_proto_conn.destroy();
+		unwatch(tun);
+		tun.destroy();
 		return;
 	}
 
-	m_last_tcp_packet = m_cur_time;	
+	auto & reader = m_readers[l];
 
-	switch(Proto::OpCode(opcode[0]))
+	while(auto size = reader.next(m_bypass_udp, m_compact))
 	{
-	case Proto::OpCode::NOP:
-		return;
-	case Proto::OpCode::CONFIG:
-		{
-			std::array<unsigned char, 2> size_dat;
-			CHECK_RET(m_tcp_proto_conn.Recv(size_dat, MSG_WAITALL))
+		auto frame = reader.frame();
 
-			uint16_t size = DECODE_UINT16(size_dat.data());
-			
-			m_message_buffer.resize(size);
-			CHECK_RET(m_tcp_proto_conn.Recv(m_message_buffer, MSG_WAITALL))
-
-			add_endpoint(Proto::Protocol(m_message_buffer[0]), DECODE_UINT16(m_message_buffer.data() + 1), reinterpret_cast<char*>(m_message_buffer.data() + 3));
-		}
-		return;
-	case Proto::OpCode::MESSAGE:
+		switch(Proto::OpCode(frame[0]))
 		{
-			if(m_bypass_udp) // Check proto!
+		case Proto::OpCode::CONFIG:
 			{
-				Proto::Protocol p;
-				CHECK_RET(m_tcp_proto_conn.Recv(p));
+				uint16_t len = DECODE_UINT16(frame + 1);
+				CHECK_RET(len > 4)
+
+				unsigned char * cfg = frame + 3;
 
-				if(p == Proto::Protocol::UDP) // It is UDP
+				// The schedule ends the message
+				Schedule schedule;
+				if(cfg[3] & (unsigned char)(Proto::BridgeOption::SCHEDULE))
 				{
-					process_bypassed_message();
-					return;
+					CHECK_RET(len > 6)
+					len -= 2;
+					CHECK_RET(cfg[len] < Proto::n_priorities && cfg[len + 1] != 0)
+					schedule = {Proto::Priority(cfg[len]), cfg[len + 1]};
 				}
-				// Otherwise, do as usual...
-			}
-
-			std::array<unsigned char, 20> hdr;
-			CHECK_RET(m_tcp_proto_conn.Recv(hdr, MSG_WAITALL))
-
-			ComKey comkey{DECODE_KEY(&hdr[0]), DECODE_KEY(&hdr[8])};
-
-			uint32_t dat_size = DECODE_UINT32(&hdr[16]);
 
-			m_message_buffer.resize(dat_size);
-			CHECK_RET(m_tcp_proto_conn.Recv(m_message_buffer, MSG_WAITALL))
+				// The connect timeout follows the host name
+				uint32_t connect_timeout = 0;
+				if(cfg[3] & (unsigned char)(Proto::BridgeOption::CONNECT_TIMEOUT))
+				{
+					CHECK_RET(len > 8)
+					len -= 4;
+					connect_timeout = DECODE_UINT32(cfg + len);
+				}
 
-			auto conn = m_connections.find(comkey);
+				CHECK_RET(cfg[len - 1] == 0) // Null terminated host name
 
-			if(conn == m_connections.end())
-			{
-				LOG("Message on dead connection " << comkey.sk << std::endl);
-				return;
+				add_endpoint(Proto::Protocol(cfg[0]), DECODE_UINT16(cfg + 1), reinterpret_cast<char*>(cfg + 4), cfg[3], connect_timeout, schedule);
 			}
-
-			CHECK_RET(conn->second.sck.Send(m_message_buffer))
-			return;
-		}
-	case Proto::OpCode::CONNECT:
-		{
-			std::array<unsigned char, 18> bridge_dat;
-			CHECK_RET(m_tcp_proto_conn.Recv(bridge_dat, MSG_WAITALL))
-			
-			uint16_t bridge = DECODE_UINT16(bridge_dat);
-			key_sock_uni_t key = DECODE_KEY(&bridge_dat[2]);
-			key_sock_uni_t unkey = DECODE_KEY(&bridge_dat[10]);
-
-			Connection newcon{{}, key, m_pfds.size()};
-
-			CHECK_RET(newcon.sck.create(AF_INET, SOCK_STREAM))
-
-			if(newcon.sck.connect(m_tcp_addresses[bridge]))
+			break;
+		case Proto::OpCode::CONNECT:
 			{
-				// Send established
-				
-				std::array<unsigned char, 25> msg_estab = {(unsigned char)(Proto::OpCode::TCP_ESTABLISHED)};
-				ENCODE_KEY(key, &msg_estab[1])
-				ENCODE_KEY(unkey, &msg_estab[9])
-				ENCODE_KEY(newcon.sck.socket(), &msg_estab[17])
+				unsigned char * bridge_dat = frame + 1;
 
-				CHECK_RET(m_tcp_proto_conn.Send(msg_estab))
+				uint16_t bridge = DECODE_UINT16(bridge_dat);
+				conn_id_t key = DECODE_UINT32(&bridge_dat[2]);
+				key_sock_uni_t unkey = DECODE_KEY(&bridge_dat[6]);
 
-				LOG("TCP bridge " << bridge << " connected, key " << key << ", " << newcon.sck.socket() << std::endl);
+				LOG("Connecting TCP bridge " << bridge << ", key " << key << std::endl);
 
-				m_pfds.push_back({newcon.sck.socket(), POLLIN, 0});
+				if(bridge >= m_tcp_addresses.size())
+					throw NetworkError("Unknown TCP bridge on TCP");
 
-				m_connections.emplace(ComKey{key_sock_uni_t(newcon.sck.socket()), unkey}, std::move(newcon));
-			}
-			else if(
-#ifdef __unix__
-				errno == ECONNREFUSED
-#elif defined(WIN32)
-				WSAGetLastError() == WSAECONNREFUSED
-#endif
-			) {
-				// Connection refused
-				LOG("Connection refused on bridge " << bridge << ", key : " << key << std::endl);
-				std::array<unsigned char, 17> msg = {(unsigned char)(Proto::OpCode::TCP_DISCONNECTED)};
+				if(m_tcp_addresses[bridge].empty() && !m_tcp_endpoints[bridge].unresolved)
+					m_tcp_pending[bridge].push_back({key, unkey, {}}); // Connected once resolved
+				else
+					connect_bridge(bridge, key, unkey);
 
-				ENCODE_KEY(key, &msg[1]);
-				ENCODE_KEY(unkey, &msg[9]);
-				
-				m_tcp_proto_conn.Send(msg);
+				break;
+			}
+		case Proto::OpCode::EARLY_DATA:
+			{
+				key_sock_uni_t unkey = DECODE_KEY(frame + 1);
+				uint32_t len = DECODE_UINT32(frame + 9);
+				unsigned char * payload = frame + Proto::early_data_header_size;
 
-				return;
+				forward_early(unkey, std::vector<unsigned char>(payload, payload + len));
+				break;
 			}
-			else
-				throw std::runtime_error("connect failed");
-	
-			return;
+		case Proto::OpCode::TCP_TIMEOUT:
+			on_timeout();
+			return; // The reader was dropped with the lane
+		default:
+			if(!process_frame(l, frame))
+				throw NetworkError("Unexpected OpCode on TCP");
 		}
-	case Proto::OpCode::TCP_DISCONNECTED:
-		{
-			std::array<unsigned char, 16> bridge_dat;
-			CHECK_RET(m_tcp_proto_conn.Recv(bridge_dat, MSG_WAITALL))
 
-			disconnect_tcp<false>(ComKey{DECODE_KEY(&bridge_dat[0]), DECODE_KEY(&bridge_dat[8])});
-
-			return;
-		}
-	case Proto::OpCode::TCP_TIMEOUT:
-		on_timeout();
-		return;
-	default:
-	case Proto::OpCode::UDP_CONNECTED:
-		throw NetworkError("Unexpected OpCode on TCP");
+		reader.consume(size);
 	}
 }
 
@@ -370,16 +569,32 @@ void Server::on_timeout()
 {
 	std::cout << "Timeout!" << std::endl;
 
-	m_connections.clear();
-	m_pfds.resize(2 + m_udp_sockets.size());
+	m_epoch++;
+	m_metrics.reconnects.add();
+
+	stop_workers();
+
+	if(m_session)
+	{
+		// The client reconnects as a new session
+		std::cout << "Session " << m_session_id << " ended." << std::endl;
+		m_run = false;
+		return;
+	}
+
+	if(!m_resume)
+		drop_connections();
+
 	// Reset established TCPS
-	m_tcp_proto_conn.destroy();
-	
+	close_lanes();
+
+	auto udp_port = m_proto_udp_address.port();
+
 	if(connect_proto_tcp(false))
 	{
-		m_udp_sockets.clear();
-		m_connections.clear();
-		m_pfds.resize(2);
+		// New client : nothing to resume
+		drop_connections();
+		clear_bridges();
 
 		Proto::UDPBypass ub;
 		CHECK_RET(m_tcp_proto_conn.Recv(ub));
@@ -388,16 +603,21 @@ void Server::on_timeout()
 		if(!m_bypass_udp && !m_udp_proto_conn.valid())
 		{
 			create_udp_socket();
-			m_pfds[1].fd = m_udp_proto_conn.socket();
 		}
 		else if(m_bypass_udp)
-			m_pfds[0].fd = 0;
+			unwatch(m_udp_proto_conn);
 		
 		init_post_connection();
 	}
+	else
+	{
+		m_proto_udp_address.set_port(udp_port);
+
+		if(m_resume)
+			resume_session(false);
+	}
+
+	reset_tcp_timeout();
 
-	
-	m_pfds.front().fd = m_tcp_proto_conn.socket();
-	
-	m_last_tcp_packet = m_cur_time = time(nullptr);
+	start_workers();
 }
@@ -7,31 +7,106 @@
 
 #include "classes.h"
 
+#include <chrono>
 #include <iostream>
+#include <string>
 
 
 class Server : public AppBase
 {
 	uint16_t m_tcp_port;
 
-	std::vector<Address> m_tcp_addresses;
+	// Endpoint of a bridge, as given by the client
+	struct Endpoint
+	{
+		std::string host;
+		port_t port;
+		bool unresolved = false; // Its lookup failed : connections are refused until it succeeds
+	};
+
+	// Connection of a TCP bridge waiting for its endpoint to be resolved
+	struct PendingConnect
+	{
+		conn_id_t key;
+		key_sock_uni_t unkey;
+		std::vector<std::vector<unsigned char>> early; // Early data received meanwhile, an empty one at its end
+	};
+
+	std::vector<Endpoint> m_tcp_endpoints, m_udp_endpoints;
+	std::vector<std::vector<Address>> m_tcp_addresses; // For each TCP bridge, raced when connecting. Empty until resolved.
+	std::vector<std::vector<PendingConnect>> m_tcp_pending; // For each TCP bridge
+	std::vector<bool> m_tcp_compress; // For each TCP bridge
+	std::vector<uint32_t> m_tcp_connect_timeout; // Of each TCP bridge in ms, 0 to leave it to the system
+	std::vector<Schedule> m_tcp_schedule; // Of the connections of each TCP bridge
+
+	bool m_session = false; // Session of a multi-client server : connected by its listener, ends with the tunnel
 public:
+	constexpr static unsigned handshake_timeout = 5000; // ms, for each read of the handshake of a lane
+	constexpr static std::chrono::seconds lane_join_timeout{10}; // For all the lanes of a client to join
+	constexpr static size_t max_skipped = 64; // Bytes received before the ESTABLISH of a connection
+
+	// Tunnel connections of a client, accepted by the listener of a multi-client server
+	struct Session
+	{
+		Socket conn;
+		Address addr;
+		std::vector<Socket> lanes; // Lanes after the first one, invalid until joined
+		uint64_t id = 0;
+	};
 
-	Server(port_t tp) : m_tcp_port(tp) {}
+	Server(port_t tp, const Options & opts) : AppBase(opts), m_tcp_port(tp)
+	{
+		m_resolver.set_handler([this](const std::string & host, const std::vector<Address> & adrs){on_resolved(host, adrs);});
+	}
+
+	Server(Session && session, const Options & opts) : AppBase(opts), m_tcp_port(0), m_session(true)
+	{
+		m_resolver.set_handler([this](const std::string & host, const std::vector<Address> & adrs){on_resolved(host, adrs);});
+
+		m_tcp_proto_conn = std::move(session.conn);
+		m_proto_udp_address = std::move(session.addr);
+		m_lanes = std::move(session.lanes);
+		m_batches.assign(n_lanes(), {});
+		m_readers.assign(n_lanes(), {});
+		m_lane_rtt = std::vector<RttEstimator>(n_lanes());
+		m_session_id = session.id;
+	}
 
 	void run();
 
 	void initiate();
 	void proc_loop();
 
-	void process_tcp_message();
+	// Read the datagrams of a UDP bridge, as many batches as its weight in its turn
+	void check_udp_bridge(uint16_t bridge);
+
+	void process_tcp_message(size_t l, const Poller::Event & ev);
 
-	void add_endpoint(Proto::Protocol proto, port_t dst_port, const char * hostname);
+	void add_endpoint(Proto::Protocol proto, port_t dst_port, const char * hostname, unsigned char options, uint32_t connect_timeout, Schedule schedule);
+
+	// Forget the bridges of the previous client
+	void clear_bridges();
+
+	// A host name of the endpoints was resolved, or changed addresses
+	void on_resolved(const std::string & host, const std::vector<Address> & adrs);
+
+	// Addresses of the endpoint of a bridge, once resolved. A UDP bridge sends to a single one.
+	void set_tcp_addresses(size_t bridge, const std::vector<Address> & adrs);
+	void set_udp_address(size_t bridge, const Address & adr);
+
+	// Connect a connection of a TCP bridge whose endpoint was looked up, or refuse it if the lookup failed
+	void connect_bridge(uint16_t bridge, conn_id_t key, key_sock_uni_t unkey);
+
+	// Give early data to the reactor of its connection, after the connect. Kept with the connect while it waits for its endpoint to be resolved.
+	void forward_early(key_sock_uni_t unkey, std::vector<unsigned char> data);
 	
 	void on_timeout();
 
 	bool connect_proto_tcp(bool fresh);
 
+	// Accept the other lanes of the tunnel, once the first one is connected. Connections which are not one of them are rejected.
+	void accept_lanes(Socket & listener);
+
 	// Initilization after connecting tcp and establishing if connection is fresh
 	void init_post_connection();
 };
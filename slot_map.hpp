@@ -0,0 +1,120 @@
+#ifndef SLOT_MAP_HPP
+#define SLOT_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Values in a vector of slots, found from a 32-bit id by direct indexing.
+// An id holds the index of its slot and the generation of the slot when it was given : the generation changes when the slot is freed,
+// so that the id of an erased value no longer finds the value reusing its slot. 0 is never a valid id.
+// The generation is in the low bits : the ids of a small table stay small numbers, short once encoded as varints.
+template<typename T>
+class SlotMap
+{
+public:
+	typedef uint32_t id_t;
+
+	constexpr static int index_bits = 20;
+	constexpr static size_t max_size = size_t(1) << index_bits;
+
+private:
+	constexpr static int generation_bits = 32 - index_bits;
+	constexpr static id_t max_generation = id_t(1) << generation_bits;
+
+	struct Slot
+	{
+		T value;
+		id_t generation = 1;
+		bool used = false;
+	};
+
+	std::vector<Slot> m_slots;
+	std::vector<id_t> m_free; // Indices of the free slots, the last freed reused first
+	size_t m_size = 0;
+
+	static id_t make_id(id_t index, id_t generation) {return index << generation_bits | generation;}
+	static id_t index_of(id_t id) {return id >> generation_bits;}
+
+	Slot * slot(id_t id)
+	{
+		id_t index = index_of(id);
+		if(index >= m_slots.size())
+			return nullptr;
+
+		auto & s = m_slots[index];
+		return s.used && make_id(index, s.generation) == id ? &s : nullptr;
+	}
+
+	void release(id_t index)
+	{
+		auto & s = m_slots[index];
+		s.value = T();
+		s.used = false;
+		s.generation = s.generation + 1 == max_generation ? 1 : s.generation + 1;
+		m_free.push_back(index);
+		m_size--;
+	}
+
+public:
+
+	// Insert a value, and return its id. Returns 0, without inserting, if the map is full.
+	id_t insert(T && value)
+	{
+		id_t index;
+		if(!m_free.empty())
+		{
+			index = m_free.back();
+			m_free.pop_back();
+		}
+		else if(m_slots.size() != max_size)
+		{
+			index = id_t(m_slots.size());
+			m_slots.emplace_back();
+		}
+		else
+			return 0;
+
+		auto & s = m_slots[index];
+		s.value = std::move(value);
+		s.used = true;
+		m_size++;
+		return make_id(index, s.generation);
+	}
+
+	// Value of an id, or nullptr if it was erased
+	T * find(id_t id)
+	{
+		auto s = slot(id);
+		return s ? &s->value : nullptr;
+	}
+
+	void erase(id_t id)
+	{
+		if(slot(id))
+			release(index_of(id));
+	}
+
+	// Call f(id, value) for each value. f may erase the value it is given, but not insert any.
+	template<typename F>
+	void for_each(F && f)
+	{
+		for(id_t index = 0; index != m_slots.size(); ++index)
+			if(m_slots[index].used)
+				f(make_id(index, m_slots[index].generation), m_slots[index].value);
+	}
+
+	// Erase all the values. The slots are kept, with ids of a new generation.
+	void clear()
+	{
+		for(id_t index = 0; index != m_slots.size(); ++index)
+			if(m_slots[index].used)
+				release(index);
+	}
+
+	size_t size() const {return m_size;}
+	bool empty() const {return !m_size;}
+};
+
+#endif
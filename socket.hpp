@@ -10,6 +10,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <poll.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -43,14 +44,21 @@ constexpr socket_t null_socket = INVALID_SOCKET;
 
 #define net_err WSAGetLastError()
 
+// Sockets do not raise signals on Windows
+#define MSG_NOSIGNAL 0
+
 #endif
 
+#include <algorithm>
+#include <chrono>
 #include <utility>
 #include <stdexcept>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
+#include <vector>
 
-static char exc_buf[500];
+static thread_local char exc_buf[500];
 
 #define CHECK_RET(call) if(!(call))\
 {\
@@ -64,6 +72,36 @@ struct resizable : std::false_type {};
 template <typename T>
 struct resizable <T, decltype((void) std::declval<T>().resize(1), 0)> : std::true_type {};
 
+// True if the last socket call failed only because the socket is non-blocking and not ready
+inline bool would_block()
+{
+#ifdef __unix__
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#else
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#endif
+}
+
+// True if the last connect on a non-blocking socket was started, and completes once the socket is writable
+inline bool connect_in_progress()
+{
+#ifdef __unix__
+	return errno == EINPROGRESS;
+#else
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#endif
+}
+
+// True if the last socket call was interrupted before transferring anything, and should be retried
+inline bool interrupted()
+{
+#ifdef __unix__
+	return errno == EINTR;
+#else
+	return WSAGetLastError() == WSAEINTR;
+#endif
+}
+
 struct NetworkError :  std::runtime_error {
 	NetworkError() : std::runtime_error("Network Error") {}
 
@@ -78,12 +116,16 @@ class Address : public NoCopy
 	socklen_t m_alen = 0;
 public:
 	Address(Address && rhs) : m_sa(std::exchange(rhs.m_sa, nullptr)), m_alen(rhs.m_alen) {}
-	Address(const Address & rhs) : m_sa(reinterpret_cast<sockaddr*>(malloc(rhs.m_alen))), m_alen(rhs.m_alen) {
-		memcpy(m_sa, rhs.m_sa, m_alen);
+	Address(const Address & rhs) {
+		*this = rhs;
 	}
 
 	Address(socklen_t len) : m_sa(reinterpret_cast<sockaddr*>(malloc(len))), m_alen(len) {}
 
+	Address(const sockaddr * sa, socklen_t len) : Address(len) {
+		memcpy(m_sa, sa, len);
+	}
+
 	Address() = default;
 	~Address() {destroy();}
 
@@ -103,6 +145,7 @@ public:
 		m_sa = reinterpret_cast<sockaddr*>(malloc(pnfo->ai_addrlen));
 		m_alen = pnfo->ai_addrlen;
 		memcpy(m_sa, pnfo->ai_addr, m_alen);
+		freeaddrinfo(pnfo);
 	}
 
 	Address(int af, int socktype, const char * adr_str, port_t port) : Address(af, socktype, adr_str) {
@@ -119,7 +162,9 @@ public:
 
 	Address & operator=(const Address & rhs)
 	{
-		if(rhs.m_alen == m_alen)
+		if(rhs.empty())
+			destroy();
+		else if(rhs.m_alen == m_alen)
 			memcpy(m_sa, rhs.m_sa, m_alen);
 		else
 		{
@@ -180,11 +225,14 @@ public:
 		else
 			inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(m_sa)->sin6_addr, s.data(), s.size());
 
+		s.resize(strlen(s.c_str()));
 		return s;
 	}
 
 	bool empty() const {return m_sa == nullptr;}
 
+	bool operator==(const Address & rhs) const {return m_alen == rhs.m_alen && (!m_alen || memcmp(m_sa, rhs.m_sa, m_alen) == 0);}
+
 	friend class Socket;
 };
 
@@ -194,7 +242,8 @@ private:
 
 	socket_t m_sck;
 
-	Socket(socket_t s) : m_sck(s) {}
+	// Failed socket calls give -1 on unix, which is mapped to null_socket
+	Socket(socket_t s) : m_sck(s == socket_t(-1) ? null_socket : s) {}
 
 public:
 
@@ -228,10 +277,33 @@ public:
 	bool create(int af, int type, int protocol = 0)
 	{
 		destroy();
-		m_sck = ::socket(af, type, protocol);
+		*this = Socket(::socket(af, type, protocol));
 		return m_sck != null_socket;
 	}
 
+	bool set_nonblocking(bool on = true)
+	{
+#ifdef __unix__
+		int flags = fcntl(m_sck, F_GETFL, 0);
+		return flags != -1 && fcntl(m_sck, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == 0;
+#else
+		u_long mode = on;
+		return ioctlsocket(m_sck, FIONBIO, &mode) == 0;
+#endif
+	}
+
+	// Make blocking receives fail after a delay, 0 to wait forever
+	bool set_recv_timeout(unsigned ms)
+	{
+#ifdef __unix__
+		timeval tv = {time_t(ms / 1000), suseconds_t(ms % 1000 * 1000)};
+		return setsockopt(m_sck, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+#else
+		DWORD t = ms;
+		return setsockopt(m_sck, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&t), sizeof(t)) == 0;
+#endif
+	}
+
 	bool connect(const Address & add)
 	{
 		return ::connect(m_sck, add.addr(), add.addr_len()) == 0;
@@ -278,6 +350,20 @@ public:
 		return ::recv(m_sck, reinterpret_cast<char*>(buf), size, flags);
 	}
 
+	// Receive without blocking, what is already available on a stream socket. Returns 0 once the stream ended.
+	recv_res_t Recv_available(void * buf, size_t size)
+	{
+#ifdef __unix__
+		return ::recv(m_sck, reinterpret_cast<char*>(buf), size, MSG_DONTWAIT);
+#else
+		// No per call non-blocking flag : only read what is queued, a read of nothing then reports the end of the stream
+		u_long avail = 0;
+		if(ioctlsocket(m_sck, FIONREAD, &avail) != 0)
+			return -1;
+		return ::recv(m_sck, reinterpret_cast<char*>(buf), avail && avail < size ? avail : size, 0);
+#endif
+	}
+
 	recv_res_t Recvfrom_raw(void * buf, size_t size, Address & addr, int flags = 0)
 	{
 		if(addr.empty())
@@ -285,17 +371,38 @@ public:
 		return ::recvfrom(m_sck, reinterpret_cast<char*>(buf), size, flags, addr.m_sa, &addr.m_alen);
 	}
 
+	// With MSG_WAITALL, the receive is resumed if interrupted (e.g. by io_uring task work) until the buffer is full or the stream ends
 	template<typename Cont>
 	bool Recv(Cont & buf, int flags = 0)
 	{
-		int res;
+		char * data;
+		size_t size;
 		if constexpr(std::is_class_v<Cont>)
-			res = ::recv(m_sck, reinterpret_cast<char*>(buf.data()), buf.size(), flags);
+		{
+			data = reinterpret_cast<char*>(buf.data());
+			size = buf.size();
+		}
 		else
-			res = ::recv(m_sck, reinterpret_cast<char*>(&buf), sizeof(Cont), flags);
+		{
+			data = reinterpret_cast<char*>(&buf);
+			size = sizeof(Cont);
+		}
 
-		CHECK_RET(res != -1);
-		if constexpr(resizable<Cont>::value) buf.resize(res);
+		size_t got = 0;
+		while(got != size)
+		{
+			auto res = ::recv(m_sck, data + got, size - got, flags);
+			if(res < 0)
+			{
+				if(interrupted()) continue;
+				CHECK_RET(false)
+			}
+
+			got += res;
+			if(res == 0 || !(flags & MSG_WAITALL)) break;
+		}
+
+		if constexpr(resizable<Cont>::value) buf.resize(got);
 		return true;
 	}
 
@@ -310,20 +417,38 @@ public:
 		return {true, adr};
 	}
 
+	// Send the whole buffer on a blocking socket : a blocking send may still be cut short by an interruption
+	bool Send_all(const void * data, size_t size, int flags = 0)
+	{
+		auto pos = reinterpret_cast<const char*>(data);
+		while(size)
+		{
+			auto res = ::send(m_sck, pos, size, flags);
+			if(res < 0)
+			{
+				if(interrupted()) continue;
+				return false;
+			}
+			pos += res;
+			size -= res;
+		}
+		return true;
+	}
+
 	template<typename Cont>
 	int Send(const Cont & buf, int flags = 0)
 	{
 		if constexpr (std::is_class_v<Cont>)
-			return ::send(m_sck, reinterpret_cast<const char*>(buf.data()), buf.size(), flags);
+			return Send_all(buf.data(), buf.size(), flags) ? int(buf.size()) : -1;
 		else
-			return ::send(m_sck, reinterpret_cast<const char*>(&buf), sizeof(Cont), flags);
+			return Send_all(&buf, sizeof(Cont), flags) ? int(sizeof(Cont)) : -1;
 	}
 
 	int Send_raw(const void * data, size_t size, int flags = 0)
 	{
 		return ::send(m_sck, reinterpret_cast<const char*>(data), size, flags);
 	}
-	
+
 	template<typename Cont>
 	int Sendto(const Cont & buf, Address a, int flags = 0)
 	{
@@ -338,10 +463,139 @@ public:
 		return ::sendto(m_sck, reinterpret_cast<const char *>(dat), len, flags, a.m_sa, a.m_alen);
 	}
 
+	// Pending error of the socket, cleared by the call. 0 if none.
+	int pending_error()
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(m_sck, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&err), &len) != 0)
+			return -1;
+		return err;
+	}
+
+	// Allow binding again the address of a listener closed a moment ago
+	bool set_reuseaddr()
+	{
+		int on = 1;
+		return setsockopt(m_sck, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&on), sizeof(on)) == 0;
+	}
+
+	// Allow sends with MSG_ZEROCOPY (Linux), completed on the error queue of the socket
+	bool set_zerocopy()
+	{
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+		int on = 1;
+		return setsockopt(m_sck, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+#else
+		return false;
+#endif
+	}
+
+	// Stop receiving : a thread blocked in a receive on the socket returns
+	bool shutdown_read()
+	{
+#ifdef __unix__
+		return ::shutdown(m_sck, SHUT_RD) == 0;
+#else
+		return ::shutdown(m_sck, SD_RECEIVE) == 0;
+#endif
+	}
+
 	bool close()
 	{
 		return close_socket(m_sck) == 0;
 	}
 };
 
+constexpr int connect_attempt_delay = 250; // ms before racing the next address of a host, from RFC 8305
+
+// All the addresses of a host, IPv4 and IPv6. They alternate between both families, from the family of the first address given by the system (RFC 8305).
+inline std::vector<Address> resolve_addresses(const char * host, int socktype)
+{
+	addrinfo * pnfo = nullptr, hint = {};
+	hint.ai_family = AF_UNSPEC;
+	hint.ai_socktype = socktype;
+
+	auto res = getaddrinfo(host, nullptr, &hint, &pnfo);
+	if(res)
+		throw NetworkError(gai_strerror(res));
+
+	std::vector<Address> first, other;
+	for(auto i = pnfo; i; i = i->ai_next)
+	{
+		if(i->ai_family == AF_INET || i->ai_family == AF_INET6)
+			(i->ai_family == pnfo->ai_family ? first : other).emplace_back(i->ai_addr, socklen_t(i->ai_addrlen));
+	}
+	freeaddrinfo(pnfo);
+
+	std::vector<Address> adrs;
+	for(size_t i = 0; i != std::max(first.size(), other.size()); ++i)
+	{
+		if(i < first.size())
+			adrs.push_back(std::move(first[i]));
+		if(i < other.size())
+			adrs.push_back(std::move(other[i]));
+	}
+	return adrs;
+}
+
+// Connect to the first of the addresses of a host to accept, blocking. Attempts are raced : the next one starts after connect_attempt_delay,
+// or as soon as the ones in progress failed (RFC 8305). Returns the blocking socket connected and the index of its address, or an invalid socket if all failed.
+// Throws if none connected within timeout ms.
+inline std::pair<Socket, size_t> connect_first(const std::vector<Address> & adrs, int timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+	std::vector<Socket> attempts(adrs.size());
+	std::vector<pollfd> pending; // Attempts in progress
+	std::vector<size_t> pending_index;
+	size_t next = 0;
+
+	while(next != adrs.size() || !pending.empty())
+	{
+		if(next != adrs.size())
+		{
+			auto & sck = attempts[next];
+			if(sck.create(adrs[next].af(), SOCK_STREAM) && sck.set_nonblocking())
+			{
+				if(sck.connect(adrs[next]) && sck.set_nonblocking(false))
+					return {std::move(sck), next};
+
+				if(connect_in_progress())
+				{
+					pending.push_back({sck.socket(), POLLOUT, 0});
+					pending_index.push_back(next);
+				}
+			}
+			next++;
+			if(pending.empty())
+				continue; // Failed at once
+		}
+
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if(left <= 0)
+			throw NetworkError("Connect timed out");
+
+		if(poll(pending.data(), pending.size(), int(next != adrs.size() ? std::min<long long>(connect_attempt_delay, left) : left)) < 0)
+			break;
+
+		for(size_t i = 0; i != pending.size();)
+		{
+			auto & sck = attempts[pending_index[i]];
+			if(!pending[i].revents)
+				++i;
+			else if(sck.pending_error() == 0 && sck.set_nonblocking(false))
+				return {std::move(sck), pending_index[i]};
+			else
+			{
+				sck.destroy();
+				pending.erase(pending.begin() + i);
+				pending_index.erase(pending_index.begin() + i);
+			}
+		}
+	}
+
+	return {Socket(), adrs.size()};
+}
+
 #endif
@@ -0,0 +1,227 @@
+// Round trips of the frame codecs : varints, compact headers, and the frame sizes found by the reader for every opcode.
+// Returns the number of failed checks.
+
+#include "../frame_reader.hpp"
+#include "../ral_proto.h"
+
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+static int failures = 0;
+
+#define EXPECT(cond) if(!(cond)) {std::cerr << __FILE__ << ':' << __LINE__ << " : " #cond << std::endl; failures++;}
+
+constexpr uint32_t varint_boundaries[] = {0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, 0x1FFFFF, 0x200000, 0xFFFFFFF, 0x10000000, UINT32_MAX};
+
+static void test_varints()
+{
+	for(uint32_t v : varint_boundaries)
+	{
+		std::array<unsigned char, Proto::max_varint_size> buf;
+		size_t size = Proto::encode_varint(v, buf.data());
+		EXPECT(size == Proto::varint_size(v))
+
+		uint32_t n;
+		EXPECT(Proto::decode_varint(buf.data(), buf.size(), n) == int(size))
+		EXPECT(n == v)
+
+		// Truncated : more is needed
+		for(size_t avail = 0; avail != size; ++avail)
+		{
+			n = 1;
+			EXPECT(Proto::decode_varint(buf.data(), avail, n) == 0)
+			EXPECT(n == 0)
+		}
+	}
+
+	uint32_t n;
+
+	// Beyond 32 bits
+	const unsigned char wide[] = {0xFF, 0xFF, 0xFF, 0xFF, 0x10};
+	EXPECT(Proto::decode_varint(wide, sizeof(wide), n) == -1)
+	EXPECT(n == 0)
+
+	// Too long
+	const unsigned char endless[] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x00};
+	EXPECT(Proto::decode_varint(endless, sizeof(endless), n) == -1)
+	EXPECT(n == 0)
+}
+
+static void test_compact_headers()
+{
+	constexpr uint32_t sizes[] = {0, 1, Proto::max_short_payload, Proto::max_short_payload + 1, 0x3FFF, 0x4000, 1 << 20, FrameReader::max_frame_size};
+
+	std::array<unsigned char, Proto::tcp_message_room + 1> buf;
+	unsigned char * payload = buf.data() + Proto::tcp_message_room;
+
+	for(uint32_t id : varint_boundaries)
+		for(uint32_t size : sizes)
+			for(bool compressed : {false, true})
+				for(bool bypass : {false, true})
+				{
+					uint32_t wire_size = size | (compressed ? Proto::compressed_payload : 0);
+					unsigned char * msg = Proto::encode_compact_header(payload, id, wire_size, bypass);
+
+					bool is_short = !compressed && size <= Proto::max_short_payload;
+					EXPECT(Proto::OpCode(msg[0]) == (is_short ? Proto::OpCode::SHORT_MESSAGE : Proto::OpCode::MESSAGE))
+
+					size_t head = 1;
+					if(bypass && !is_short)
+					{
+						EXPECT(Proto::Protocol(msg[1]) == Proto::Protocol::TCP)
+						head = 2;
+					}
+					EXPECT(size_t(payload - msg) <= Proto::max_compact_header_size)
+
+					// Read back from the header after the opcode and the protocol
+					const unsigned char * hdr = msg + head;
+					size_t hdr_size = payload - hdr;
+					uint32_t rid, rsize;
+					EXPECT(Proto::decode_compact_header(hdr, hdr_size, is_short, rid, rsize) == int(hdr_size))
+					EXPECT(rid == id)
+					EXPECT(rsize == wire_size)
+
+					for(size_t avail = 0; avail != hdr_size; ++avail)
+					{
+						rid = rsize = 1;
+						EXPECT(Proto::decode_compact_header(hdr, avail, is_short, rid, rsize) == 0)
+						EXPECT(rid == 0 && rsize == 0)
+					}
+				}
+
+	// A malformed id fails the header
+	const unsigned char bad[] = {0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0x01};
+	uint32_t id, size;
+	EXPECT(Proto::decode_compact_header(bad, sizeof(bad), false, id, size) == -1)
+	EXPECT(id == 0 && size == 0)
+}
+
+// A frame and how the reader must see it
+struct Frame
+{
+	std::vector<unsigned char> bytes;
+	bool bypass = false, compact = false;
+};
+
+static Frame make_frame(std::initializer_list<unsigned char> head, size_t tail = 0, bool bypass = false, bool compact = false)
+{
+	Frame f{head, bypass, compact};
+	for(size_t i = 0; i != tail; ++i)
+		f.bytes.push_back((unsigned char)(i));
+	return f;
+}
+
+static Frame make_compact(uint32_t id, uint32_t size, bool bypass)
+{
+	std::vector<unsigned char> buf(Proto::tcp_message_room + (size & ~Proto::compressed_payload));
+	unsigned char * payload = buf.data() + Proto::tcp_message_room;
+	unsigned char * msg = Proto::encode_compact_header(payload, id, size, bypass);
+	return {{msg, buf.data() + buf.size()}, bypass, true};
+}
+
+static void test_frame_reader()
+{
+	using Op = Proto::OpCode;
+
+	const std::vector<Frame> frames = {
+		make_frame({(unsigned char)(Op::NOP)}),
+		make_frame({(unsigned char)(Op::TCP_TIMEOUT)}),
+		make_frame({(unsigned char)(Op::CONFIG), 4, 0}, 4),
+		make_frame({(unsigned char)(Op::MESSAGE), 1, 0, 0, 0, 3, 0, 0, 0}, 3), // Fixed header
+		make_frame({(unsigned char)(Op::MESSAGE), (unsigned char)(Proto::Protocol::TCP), 1, 0, 0, 0, 3, 0, 0, 0}, 3, true),
+		make_frame({(unsigned char)(Op::MESSAGE), (unsigned char)(Proto::Protocol::UDP), 2, 0, 5, 0, 0, 0}, 5, true), // Bypassed UDP
+		make_frame({(unsigned char)(Op::MESSAGE), (unsigned char)(Proto::Protocol::UDP), 2, 0, 5, 0, 0, 0}, 5, true, true),
+		make_compact(7, 3, false), // SHORT_MESSAGE
+		make_compact(7, 3, true),
+		make_compact(0x4000, 300, false), // Compact MESSAGE
+		make_compact(0x4000, 300, true),
+		make_compact(1, 20 | Proto::compressed_payload, false),
+		make_frame({(unsigned char)(Op::CONNECT)}, 14),
+		make_frame({(unsigned char)(Op::TCP_DISCONNECTED)}, 4),
+		make_frame({(unsigned char)(Op::TCP_ESTABLISHED)}, 8),
+		make_frame({(unsigned char)(Op::WINDOW_UPDATE)}, 8),
+		make_frame({(unsigned char)(Op::PING)}, Proto::ping_size - 1),
+		make_frame({(unsigned char)(Op::PONG)}, Proto::pong_size - 1),
+		make_frame({(unsigned char)(Op::EARLY_DATA), 1, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0}, 2),
+	};
+
+	Socket listener;
+	Address any(AF_INET, SOCK_STREAM, "127.0.0.1", 0);
+	if(!listener.create(AF_INET, SOCK_STREAM) || !listener.bind(any) || !listener.listen(1))
+	{
+		std::cerr << "No loopback listener" << std::endl;
+		failures++;
+		return;
+	}
+
+	Socket out;
+	auto [ok, adr] = listener.getsockname();
+	EXPECT(ok && out.create(AF_INET, SOCK_STREAM) && out.connect(adr))
+	Socket in = listener.accept();
+	EXPECT(in.valid())
+
+	FrameReader reader;
+
+	// Sent a byte at a time : the frame is only returned once whole, with its size
+	for(auto & f : frames)
+	{
+		for(size_t i = 0; i != f.bytes.size(); ++i)
+		{
+			EXPECT(reader.next(f.bypass, f.compact) == 0)
+			EXPECT(out.Send_all(&f.bytes[i], 1))
+			while(reader.fill(in) < 0 && would_block()) {}
+		}
+
+		EXPECT(reader.next(f.bypass, f.compact) == f.bytes.size())
+		EXPECT(!memcmp(reader.frame(), f.bytes.data(), f.bytes.size()))
+		reader.consume(f.bytes.size());
+	}
+
+	// Opcodes out of the lanes
+	for(Op op : {Op::UDP_CONNECTED, Op::ESTABLISH, Op(0xFF)})
+	{
+		unsigned char b = (unsigned char)(op);
+		EXPECT(out.Send_all(&b, 1))
+		while(reader.fill(in) < 0 && would_block()) {}
+
+		bool thrown = false;
+		try
+		{
+			reader.next(false, true);
+		}
+		catch(const NetworkError &)
+		{
+			thrown = true;
+		}
+		EXPECT(thrown)
+		reader.consume(1);
+	}
+
+	// Only with compact headers
+	unsigned char s = (unsigned char)(Op::SHORT_MESSAGE);
+	EXPECT(out.Send_all(&s, 1))
+	while(reader.fill(in) < 0 && would_block()) {}
+	bool thrown = false;
+	try
+	{
+		reader.next(false, false);
+	}
+	catch(const NetworkError &)
+	{
+		thrown = true;
+	}
+	EXPECT(thrown)
+}
+
+int main()
+{
+	test_varints();
+	test_compact_headers();
+	test_frame_reader();
+
+	if(failures)
+		std::cerr << failures << " failed" << std::endl;
+	return failures;
+}
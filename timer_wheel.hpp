@@ -0,0 +1,166 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Monotonic time in milliseconds
+inline uint64_t monotonic_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Timers in a hierarchical wheel of millisecond ticks : adding a timer and expiring it cost O(1), whatever their count.
+// Level k has 64 slots of 64^k ticks. A timer waits in the level of its distance, and moves down to a finer level when its slot is reached.
+// Timers are not cancelled : the owner checks on expiry whether the timer still applies.
+template<typename T>
+class TimerWheel
+{
+	constexpr static int slot_bits = 6;
+	constexpr static size_t n_slots = 1 << slot_bits;
+	constexpr static int n_levels = 4; // Over 4 hours, farther timers are placed again when reached
+
+	struct Entry
+	{
+		uint64_t deadline;
+		T value;
+	};
+
+	std::array<std::array<std::vector<Entry>, n_slots>, n_levels> m_slots;
+	std::array<uint64_t, n_levels> m_used = {}; // Bit mask of the non-empty slots of each level
+	std::vector<Entry> m_moving; // Entries of the slot being expired or moved down
+	uint64_t m_time; // Next tick to process. The slots of the levels reached at this tick are already moved down.
+
+	static int shift(int level) {return level * slot_bits;}
+
+	void place(Entry && e)
+	{
+		uint64_t d = std::max(e.deadline, m_time); // Late timers expire at the next tick
+
+		int level = 0;
+		size_t slot;
+
+		if(d - m_time < n_slots)
+			slot = d & (n_slots - 1);
+		else
+		{
+			// Coarsest level needed : the slot is reached within one turn
+			for(level = 1; level != n_levels - 1 && (d >> shift(level)) - (m_time >> shift(level)) > n_slots; ++level);
+
+			if((d >> shift(level)) - (m_time >> shift(level)) > n_slots)
+				slot = (m_time >> shift(level)) & (n_slots - 1); // Beyond the wheel : placed again at the end of the turn
+			else
+				slot = (d >> shift(level)) & (n_slots - 1);
+		}
+
+		m_slots[level][slot].push_back(std::move(e));
+		m_used[level] |= uint64_t(1) << slot;
+	}
+
+	// Take the entries of a slot into m_moving
+	void take(int level, size_t slot)
+	{
+		m_moving.clear();
+		m_moving.swap(m_slots[level][slot]);
+		m_used[level] &= ~(uint64_t(1) << slot);
+	}
+
+	// Move to a tick, with no timer due before it, and move down the slots reached
+	void set_time(uint64_t t)
+	{
+		m_time = t;
+
+		for(int level = n_levels - 1; level != 0; --level)
+		{
+			if(t & ((uint64_t(1) << shift(level)) - 1))
+				continue;
+
+			take(level, (t >> shift(level)) & (n_slots - 1));
+			for(auto & e : m_moving)
+				place(std::move(e));
+		}
+		m_moving.clear();
+	}
+
+public:
+	TimerWheel(uint64_t now) : m_time(now) {}
+
+	void add(uint64_t deadline, T value)
+	{
+		place({deadline, std::move(value)});
+	}
+
+	// Tick at which the next timer may expire : it may only be moved down then. The maximum if there is none.
+	uint64_t next_tick() const
+	{
+		uint64_t next = std::numeric_limits<uint64_t>::max();
+
+		for(int level = 0; level != n_levels; ++level)
+		{
+			if(!m_used[level])
+				continue;
+
+			uint64_t base = m_time >> shift(level);
+			uint64_t tick;
+
+			if(level == 0)
+				tick = m_time + std::countr_zero(std::rotr(m_used[0], int(base & (n_slots - 1))));
+			else
+			{
+				// The current slot of a coarser level was already moved down : what it holds is for the next turn
+				uint64_t dist = std::countr_zero(std::rotr(m_used[level], int((base + 1) & (n_slots - 1)))) + 1;
+				tick = (base + dist) << shift(level);
+			}
+			next = std::min(next, tick);
+		}
+		return next;
+	}
+
+	// Expire the timers due up to now, calling expire(deadline, value) for each of them. It may add timers.
+	template<typename F>
+	void advance(uint64_t now, F && expire)
+	{
+		for(uint64_t t; (t = next_tick()) <= now;)
+		{
+			if(t != m_time)
+				set_time(t);
+
+			std::vector<Entry> due;
+			due.swap(m_slots[0][t & (n_slots - 1)]);
+			m_used[0] &= ~(uint64_t(1) << (t & (n_slots - 1)));
+
+			set_time(t + 1);
+
+			for(auto & e : due)
+			{
+				if(e.deadline > t)
+					place(std::move(e)); // Beyond the wheel when added
+				else
+					expire(e.deadline, e.value);
+			}
+
+			// Keep the allocation of the slot
+			due.clear();
+			if(m_slots[0][t & (n_slots - 1)].empty())
+				m_slots[0][t & (n_slots - 1)].swap(due);
+		}
+
+		if(now >= m_time)
+			set_time(now + 1);
+	}
+
+	// Drop all the timers
+	void clear()
+	{
+		for(auto & level : m_slots)
+			for(auto & slot : level)
+				slot.clear();
+		m_used = {};
+	}
+};
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef UDP_BATCH_HPP
+#define UDP_BATCH_HPP
+
+#include "socket.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#ifdef __linux__
+#include <netinet/udp.h>
+
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define RALLONGE_UDP_GSO
+#endif
+
+#endif
+
+// Enable UDP segmentation offload on a socket : runs of equal datagrams may then be sent as one. Returns false if unsupported.
+inline bool enable_udp_gso([[maybe_unused]] Socket & sck)
+{
+#ifdef RALLONGE_UDP_GSO
+	int size = 0; // Given for each send
+	return setsockopt(sck.socket(), SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+#else
+	return false;
+#endif
+}
+
+// Enable UDP receive offload on a socket : runs of equal datagrams may then be received as one. Returns false if unsupported.
+inline bool enable_udp_gro([[maybe_unused]] Socket & sck)
+{
+#ifdef RALLONGE_UDP_GSO
+	int on = 1;
+	return setsockopt(sck.socket(), SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+#else
+	return false;
+#endif
+}
+
+// Datagrams received with one system call : recvmmsg on Linux, a loop of receives elsewhere.
+// Each datagram is stored after some headroom, so that a header can be written before it in place.
+class RecvBatch : public NoCopy
+{
+	size_t m_depth, m_size, m_headroom;
+	std::vector<unsigned char> m_buffer;
+	std::vector<sockaddr_storage> m_addrs;
+#ifdef __linux__
+	struct Control
+	{
+		alignas(cmsghdr) char buf[CMSG_SPACE(sizeof(int))];
+	};
+
+	std::vector<mmsghdr> m_msgs;
+	std::vector<iovec> m_iovs;
+	std::vector<Control> m_controls; // Segment size of coalesced datagrams, with GRO
+	bool m_gro = false;
+#else
+	std::vector<socklen_t> m_addr_lens;
+	std::vector<size_t> m_lens;
+#endif
+
+	size_t stride() const {return m_headroom + m_size;}
+
+public:
+	RecvBatch(size_t depth, size_t size, size_t headroom) : m_depth(depth), m_size(size), m_headroom(headroom),
+		m_buffer(depth * (size + headroom)), m_addrs(depth)
+#ifdef __linux__
+		, m_msgs(depth), m_iovs(depth), m_controls(depth)
+#else
+		, m_addr_lens(depth), m_lens(depth)
+#endif
+	{
+#ifdef __linux__
+		for(size_t i = 0; i != depth; ++i)
+		{
+			m_iovs[i] = {data(i), size};
+			m_msgs[i].msg_hdr = {};
+			m_msgs[i].msg_hdr.msg_name = &m_addrs[i];
+			m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+			m_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+#endif
+	}
+
+	size_t depth() const {return m_depth;}
+	size_t capacity() const {return m_size;}
+
+	// Receive the segment size of coalesced datagrams, on a socket with GRO enabled
+	void set_gro([[maybe_unused]] bool gro)
+	{
+#ifdef __linux__
+		m_gro = gro;
+#endif
+	}
+
+	bool gro() const
+	{
+#ifdef __linux__
+		return m_gro;
+#else
+		return false;
+#endif
+	}
+
+	// Receive the datagrams waiting on a non-blocking socket, up to the depth, each up to max_size (at most the capacity).
+	// Returns their count, or -1 on error (would_block() if none was waiting).
+	int recv(Socket & sck, size_t max_size)
+	{
+#ifdef __linux__
+		for(size_t i = 0; i != m_depth; ++i)
+		{
+			m_iovs[i].iov_len = std::min(max_size, m_size);
+			m_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+			m_msgs[i].msg_hdr.msg_control = m_gro ? m_controls[i].buf : nullptr;
+			m_msgs[i].msg_hdr.msg_controllen = m_gro ? sizeof(m_controls[i].buf) : 0;
+		}
+
+		int res;
+		do
+			res = recvmmsg(sck.socket(), m_msgs.data(), m_depth, 0, nullptr);
+		while(res < 0 && interrupted());
+		return res;
+#else
+		size_t n = 0;
+		for(; n != m_depth; ++n)
+		{
+			m_addr_lens[n] = sizeof(sockaddr_storage);
+			auto res = ::recvfrom(sck.socket(), reinterpret_cast<char*>(data(n)), std::min(max_size, m_size), 0, reinterpret_cast<sockaddr*>(&m_addrs[n]), &m_addr_lens[n]);
+			if(res < 0)
+			{
+				if(n == 0)
+					return -1;
+				break;
+			}
+			m_lens[n] = res;
+		}
+		return n;
+#endif
+	}
+
+	unsigned char * data(size_t i) {return m_buffer.data() + i * stride() + m_headroom;}
+
+	size_t size(size_t i) const
+	{
+#ifdef __linux__
+		return m_msgs[i].msg_len;
+#else
+		return m_lens[i];
+#endif
+	}
+
+	// Size of the datagrams coalesced in a received one, the last one may be smaller. Its whole size if it was not coalesced.
+	size_t segment(size_t i) const
+	{
+#ifdef RALLONGE_UDP_GSO
+		if(m_gro)
+		{
+			auto & hdr = m_msgs[i].msg_hdr;
+			for(auto cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(const_cast<msghdr*>(&hdr), cm))
+			{
+				if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+				{
+					int seg;
+					memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+					if(seg > 0)
+						return seg;
+				}
+			}
+		}
+#endif
+		return size(i);
+	}
+
+	// Source of a datagram
+	Address addr(size_t i) const
+	{
+#ifdef __linux__
+		return Address(reinterpret_cast<const sockaddr*>(&m_addrs[i]), m_msgs[i].msg_hdr.msg_namelen);
+#else
+		return Address(reinterpret_cast<const sockaddr*>(&m_addrs[i]), m_addr_lens[i]);
+#endif
+	}
+};
+
+// Datagrams sent on a socket with one system call : sendmmsg on Linux, a loop of sends elsewhere.
+// The data and the destinations should stay valid until the batch is flushed.
+class SendBatch : public NoCopy
+{
+	size_t m_depth;
+	size_t m_count = 0; // Messages
+	size_t m_datagrams = 0;
+	Socket * m_sck = nullptr;
+#ifdef __linux__
+	struct Control
+	{
+		alignas(cmsghdr) char buf[CMSG_SPACE(sizeof(uint16_t))];
+	};
+
+	std::vector<mmsghdr> m_msgs;
+	std::vector<iovec> m_iovs; // Consecutive datagrams of a message are consecutive
+	std::vector<Control> m_controls;
+	bool m_gso = true; // Cleared if the kernel refuses a segmented send
+#else
+	struct Datagram
+	{
+		const void * data;
+		size_t size;
+		const Address * to;
+	};
+	std::vector<Datagram> m_dgrams;
+#endif
+
+#ifdef RALLONGE_UDP_GSO
+	// Whether a datagram can be appended to the last message, sent with segmentation offload.
+	// All the segments have the size of the first one, but the last one which may be smaller.
+	bool can_segment(const Address & to, size_t size) const
+	{
+		auto & hdr = m_msgs[m_count - 1].msg_hdr;
+		size_t seg = hdr.msg_iov[0].iov_len;
+
+		return m_gso && hdr.msg_name == to.addr() && size && size <= seg && m_iovs[m_datagrams - 1].iov_len == seg
+			&& hdr.msg_iovlen < max_segments && seg * (hdr.msg_iovlen + 1) <= max_segmented_size;
+	}
+#endif
+
+public:
+	constexpr static size_t max_segments = 64; // Limit of the kernel
+	constexpr static size_t max_segmented_size = 60000; // Within the size of an IP packet
+
+	SendBatch(size_t depth) : m_depth(depth)
+#ifdef __linux__
+		, m_msgs(depth), m_iovs(depth), m_controls(depth)
+#else
+		, m_dgrams(depth)
+#endif
+	{}
+
+	// Queue a datagram. The batch is flushed first if it is full, or for another socket.
+	// With segment, a run of equal datagrams to the same destination is sent as one with segmentation offload, which should be enabled on the socket.
+	// The destination is compared by address, it should be the same object for the whole run.
+	void add(Socket & sck, const void * data, size_t size, const Address & to, [[maybe_unused]] bool segment = false)
+	{
+		if(m_datagrams && (m_datagrams == m_depth || m_sck != &sck))
+			flush();
+
+		m_sck = &sck;
+#ifdef __linux__
+		m_iovs[m_datagrams] = {const_cast<void*>(data), size};
+
+#ifdef RALLONGE_UDP_GSO
+		if(segment && m_count && can_segment(to, size))
+		{
+			m_msgs[m_count - 1].msg_hdr.msg_iovlen++;
+			m_datagrams++;
+			return;
+		}
+#endif
+
+		auto & hdr = m_msgs[m_count].msg_hdr;
+		hdr = {};
+		hdr.msg_name = const_cast<sockaddr*>(to.addr());
+		hdr.msg_namelen = to.addr_len();
+		hdr.msg_iov = &m_iovs[m_datagrams];
+		hdr.msg_iovlen = 1;
+#else
+		m_dgrams[m_count] = {data, size, &to};
+#endif
+		m_count++;
+		m_datagrams++;
+	}
+
+	// Send the queued datagrams. As for single sends, a datagram which cannot be sent is dropped.
+	void flush()
+	{
+#ifdef RALLONGE_UDP_GSO
+		for(size_t m = 0; m != m_count; ++m)
+		{
+			auto & hdr = m_msgs[m].msg_hdr;
+			if(hdr.msg_iovlen == 1)
+				continue;
+
+			// Segment size
+			hdr.msg_control = m_controls[m].buf;
+			hdr.msg_controllen = sizeof(m_controls[m].buf);
+
+			auto cm = CMSG_FIRSTHDR(&hdr);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+			uint16_t seg = hdr.msg_iov[0].iov_len;
+			memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+		}
+#endif
+
+		size_t sent = 0;
+		while(sent < m_count)
+		{
+#ifdef __linux__
+			int res = sendmmsg(m_sck->socket(), m_msgs.data() + sent, m_count - sent, 0);
+			if(res < 0 && interrupted())
+				continue;
+
+			if(res > 0)
+			{
+				sent += res;
+				continue;
+			}
+
+			auto & hdr = m_msgs[sent].msg_hdr;
+			if(hdr.msg_iovlen > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+			{
+				// Segmentation offload refused : send the datagrams one by one from now on
+				m_gso = false;
+				for(size_t d = 0; d != hdr.msg_iovlen; ++d)
+					::sendto(m_sck->socket(), hdr.msg_iov[d].iov_base, hdr.msg_iov[d].iov_len, 0, reinterpret_cast<sockaddr*>(hdr.msg_name), hdr.msg_namelen);
+			}
+			sent++;
+#else
+			auto & dg = m_dgrams[sent++];
+			::sendto(m_sck->socket(), reinterpret_cast<const char*>(dg.data), dg.size, 0, dg.to->addr(), dg.to->addr_len());
+#endif
+		}
+		m_count = 0;
+		m_datagrams = 0;
+	}
+};
+
+#endif
@@ -0,0 +1,573 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#include "poller.hpp"
+
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <csignal>
+#include <ctime>
+
+// io_uring backend, without liburing.
+// Readiness is given by multishot polls, and sources registered with RECV get multishot receives
+// into a ring of provided buffers : the received bytes are delivered in the events, so that reading
+// a socket costs no syscall. Sends given to the backend are submitted as well.
+// Submissions are batched and sent with the wait.
+class IoUringPoller : public Poller
+{
+	static constexpr unsigned sq_size = 256;
+	static constexpr unsigned cq_size = 4096;
+	static constexpr unsigned n_buffers = 512; // A power of 2, for the buffer ring
+	static constexpr uint16_t buffer_group = 0;
+	static constexpr size_t max_spare = 8; // Buffers of completed sends kept for the next ones
+
+	int m_ring_fd = -1;
+
+	// Submission ring
+	void * m_sq_map = MAP_FAILED;
+	size_t m_sq_map_size = 0;
+	unsigned * m_sq_head, * m_sq_tail, * m_sq_array;
+	unsigned m_sq_mask, m_sq_entries;
+	io_uring_sqe * m_sqes = reinterpret_cast<io_uring_sqe*>(MAP_FAILED);
+	unsigned m_sq_local_tail = 0;
+
+	// Completion ring
+	void * m_cq_map = MAP_FAILED;
+	size_t m_cq_map_size = 0;
+	unsigned * m_cq_head, * m_cq_tail;
+	unsigned m_cq_mask;
+	io_uring_cqe * m_cqes;
+
+	// Provided buffers. Each buffer is preceded by headroom, so that a frame header can be written before the data.
+	std::vector<unsigned char> m_buffers;
+	size_t m_headroom, m_buffer_size;
+	std::vector<uint16_t> m_consumed; // Buffers given in the last events, returned on next wait
+
+	// Buffer ring shared with the kernel : buffers are given back by moving its tail, without submissions
+	io_uring_buf_ring * m_buf_ring = reinterpret_cast<io_uring_buf_ring*>(MAP_FAILED);
+	uint16_t m_buf_tail = 0;
+
+	struct Registration
+	{
+		tag_t tag;
+		uint32_t interest;
+		uint64_t serial; // Tells apart registrations of a reused socket
+		uint64_t poll_id = 0; // 0 if no request in flight
+		uint64_t recv_id = 0;
+		uint64_t send_id = 0;
+		bool rearm_poll = false, rearm_recv = false;
+	};
+
+	enum class Op {POLL, RECV, SEND};
+
+	struct Request
+	{
+		socket_t sck;
+		uint64_t serial;
+		Op op;
+	};
+
+	std::unordered_map<socket_t, Registration> m_regs;
+	std::unordered_map<uint64_t, Request> m_requests; // In flight requests
+	std::vector<socket_t> m_rearm;
+	uint64_t m_next_id = 1;
+
+	std::unordered_map<uint64_t, std::vector<unsigned char>> m_sends; // Data of the sends in flight, read by the kernel until they complete
+	std::vector<std::vector<unsigned char>> m_spare;
+	std::vector<socket_t> m_queued_sends; // Sends not submitted yet
+
+	static constexpr uint64_t internal_id = 0; // Requests of which the completion is ignored
+
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags, void * arg = nullptr, size_t argsz = 0)
+	{
+		return syscall(__NR_io_uring_enter, m_ring_fd, to_submit, min_complete, flags, arg, argsz);
+	}
+
+	// Without SQ polling, the kernel consumes the submissions during io_uring_enter
+	unsigned pending_submissions() const {return m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);}
+
+	void publish()
+	{
+		__atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+	}
+
+	io_uring_sqe * get_sqe()
+	{
+		if(m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_sq_entries)
+		{
+			// Full : flush to the kernel
+			submit();
+		}
+
+		unsigned idx = m_sq_local_tail & m_sq_mask;
+		m_sq_array[idx] = idx;
+		m_sq_local_tail++;
+
+		io_uring_sqe * sqe = &m_sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	void submit()
+	{
+		publish();
+		CHECK_RET(enter(pending_submissions(), 0, 0) >= 0)
+		m_queued_sends.clear();
+	}
+
+	static uint32_t poll_mask(uint32_t interest)
+	{
+		return ((interest & IN) && !(interest & RECV) ? POLLIN : 0) | ((interest & OUT) ? POLLOUT : 0);
+	}
+
+	static bool wants_recv(uint32_t interest)
+	{
+		return (interest & RECV) && (interest & IN);
+	}
+
+	void arm_poll(socket_t sck, Registration & reg)
+	{
+		auto sqe = get_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = sck;
+		sqe->poll32_events = poll_mask(reg.interest);
+		// Level triggered sources get one shot polls, armed again after each iteration
+		sqe->len = (reg.interest & LEVEL) ? 0 : IORING_POLL_ADD_MULTI;
+		reg.poll_id = m_next_id++;
+		sqe->user_data = reg.poll_id;
+		m_requests.emplace(reg.poll_id, Request{sck, reg.serial, Op::POLL});
+	}
+
+	void arm_recv(socket_t sck, Registration & reg)
+	{
+		auto sqe = get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sck;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = buffer_group;
+		reg.recv_id = m_next_id++;
+		sqe->user_data = reg.recv_id;
+		m_requests.emplace(reg.recv_id, Request{sck, reg.serial, Op::RECV});
+	}
+
+	// With keep, the completions posted before the cancellation are still reported
+	void cancel(uint64_t & id, bool keep = false)
+	{
+		if(!id) return;
+
+		if(!keep)
+			m_requests.erase(id);
+
+		auto sqe = get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = id;
+		sqe->user_data = internal_id;
+		id = 0;
+	}
+
+	void arm(socket_t sck, Registration & reg)
+	{
+		if(poll_mask(reg.interest) || !wants_recv(reg.interest))
+			arm_poll(sck, reg);
+		if(wants_recv(reg.interest))
+			arm_recv(sck, reg);
+	}
+
+	// Seen by the kernel once the tail is published. The entries are indexed from the start of the ring :
+	// in C++, the empty struct before bufs in some versions of the header moves it.
+	void provide(uint16_t bid)
+	{
+		auto & buf = reinterpret_cast<io_uring_buf*>(m_buf_ring)[m_buf_tail & (n_buffers - 1)];
+		buf.addr = reinterpret_cast<uint64_t>(buffer(bid));
+		buf.len = m_buffer_size;
+		buf.bid = bid;
+		m_buf_tail++;
+	}
+
+	void publish_buffers()
+	{
+		__atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+	}
+
+	static size_t buf_ring_size() {return n_buffers * sizeof(io_uring_buf);}
+
+	// Size of the data of a completed send, its buffer kept for the next ones
+	size_t release_send(uint64_t id)
+	{
+		auto node = m_sends.extract(id);
+		if(node.empty()) return 0;
+
+		size_t size = node.mapped().size();
+		if(m_spare.size() < max_spare)
+		{
+			node.mapped().clear();
+			m_spare.push_back(std::move(node.mapped()));
+		}
+		return size;
+	}
+
+	unsigned char * buffer(uint16_t bid)
+	{
+		return m_buffers.data() + bid * (m_headroom + m_buffer_size) + m_headroom;
+	}
+
+	bool setup();
+
+	// Check that multishot receives work (6.0)
+	bool probe_recv();
+
+	void destroy()
+	{
+		if(m_buf_ring != MAP_FAILED) munmap(m_buf_ring, buf_ring_size());
+		if(m_sqes != MAP_FAILED) munmap(m_sqes, m_sq_entries * sizeof(io_uring_sqe));
+		if(m_cq_map != MAP_FAILED && m_cq_map != m_sq_map) munmap(m_cq_map, m_cq_map_size);
+		if(m_sq_map != MAP_FAILED) munmap(m_sq_map, m_sq_map_size);
+		if(m_ring_fd >= 0) close(m_ring_fd);
+	}
+
+	void process_cqe(const io_uring_cqe & cqe);
+
+	IoUringPoller(size_t headroom, size_t buffer_size) :
+		m_buffers(n_buffers * (headroom + buffer_size)), m_headroom(headroom), m_buffer_size(buffer_size)
+	{}
+
+public:
+	// Returns nullptr if io_uring or one of the needed features is not available
+	static std::unique_ptr<Poller> create(size_t headroom, size_t buffer_size)
+	{
+		std::unique_ptr<IoUringPoller> p(new IoUringPoller(headroom, buffer_size));
+		if(!p->setup()) return nullptr;
+		return p;
+	}
+
+	~IoUringPoller() {destroy();}
+
+	bool add(socket_t sck, tag_t tag, uint32_t interest) override
+	{
+		auto [it, ins] = m_regs.emplace(sck, Registration{tag, interest, m_next_id++});
+		if(!ins) return false;
+		arm(sck, it->second);
+		return true;
+	}
+
+	bool modify(socket_t sck, tag_t tag, uint32_t interest) override
+	{
+		auto it = m_regs.find(sck);
+		if(it == m_regs.end()) return false;
+
+		auto & reg = it->second;
+		bool repoll = poll_mask(reg.interest) != poll_mask(interest) || (reg.interest & LEVEL) != (interest & LEVEL)
+			|| wants_recv(reg.interest) != wants_recv(interest);
+		bool rerecv = wants_recv(reg.interest) != wants_recv(interest);
+
+		reg.tag = tag;
+		reg.interest = interest;
+
+		if(repoll)
+		{
+			cancel(reg.poll_id);
+			reg.rearm_poll = false;
+			if(poll_mask(interest) || !wants_recv(interest))
+				arm_poll(sck, reg);
+		}
+		if(rerecv)
+		{
+			// Bytes received before the cancellation must not be lost
+			cancel(reg.recv_id, true);
+			reg.rearm_recv = false;
+			if(wants_recv(interest))
+				arm_recv(sck, reg);
+		}
+		return true;
+	}
+
+	void remove(socket_t sck) override
+	{
+		auto it = m_regs.find(sck);
+		if(it == m_regs.end()) return;
+
+		// A send queued for the socket must reach the kernel before the socket is closed, and another one may take its number
+		if(std::find(m_queued_sends.begin(), m_queued_sends.end(), sck) != m_queued_sends.end())
+			submit();
+
+		cancel(it->second.poll_id);
+		cancel(it->second.recv_id);
+		cancel(it->second.send_id, true); // Its data is released on completion
+
+		// Received data still pending in this iteration must not reach a source reusing the socket
+		for(auto & ev : m_events)
+			if(ev.tag == it->second.tag)
+				ev.ready = 0;
+
+		m_regs.erase(it);
+	}
+
+	int wait(int timeout_ms) override;
+
+	void sync() override {submit();}
+
+	bool send(socket_t sck, std::vector<unsigned char> & data) override
+	{
+		auto it = m_regs.find(sck);
+		if(it == m_regs.end()) return false;
+
+		auto & reg = it->second;
+		reg.send_id = m_next_id++;
+
+		auto & buf = m_sends[reg.send_id];
+		buf.swap(data);
+		if(!m_spare.empty())
+		{
+			data.swap(m_spare.back());
+			m_spare.pop_back();
+		}
+
+		// Sent whole, or failed
+		auto sqe = get_sqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = sck;
+		sqe->addr = reinterpret_cast<uint64_t>(buf.data());
+		sqe->len = buf.size();
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = reg.send_id;
+		m_requests.emplace(reg.send_id, Request{sck, reg.serial, Op::SEND});
+		m_queued_sends.push_back(sck);
+		return true;
+	}
+
+	bool edge_triggered() const override {return true;}
+
+	bool receives() const override {return true;}
+
+	const char * name() const override {return "io_uring";}
+};
+
+inline bool IoUringPoller::setup()
+{
+	io_uring_params params{};
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = cq_size;
+
+	m_ring_fd = syscall(__NR_io_uring_setup, sq_size, &params);
+	if(m_ring_fd < 0)
+	{
+		// Cooperative task running is recent (5.19), try without
+		params = {};
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = cq_size;
+		m_ring_fd = syscall(__NR_io_uring_setup, sq_size, &params);
+	}
+	if(m_ring_fd < 0) return false;
+
+	if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+		return false;
+
+	m_sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		m_sq_map_size = m_cq_map_size = std::max(m_sq_map_size, m_cq_map_size);
+
+	m_sq_map = mmap(nullptr, m_sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	if(m_sq_map == MAP_FAILED) return false;
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		m_cq_map = m_sq_map;
+	else
+	{
+		m_cq_map = mmap(nullptr, m_cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+		if(m_cq_map == MAP_FAILED) return false;
+	}
+
+	m_sq_entries = params.sq_entries;
+	m_sqes = reinterpret_cast<io_uring_sqe*>(mmap(nullptr, m_sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES));
+	if(m_sqes == MAP_FAILED) return false;
+
+	auto sq = reinterpret_cast<unsigned char*>(m_sq_map);
+	m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	m_sq_local_tail = *m_sq_tail;
+
+	auto cq = reinterpret_cast<unsigned char*>(m_cq_map);
+	m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	// Buffer rings are recent (5.19), like the multishot receives
+	void * ring = mmap(nullptr, buf_ring_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if(ring == MAP_FAILED) return false;
+	m_buf_ring = reinterpret_cast<io_uring_buf_ring*>(ring);
+
+	io_uring_buf_reg reg{};
+	reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+	reg.ring_entries = n_buffers;
+	reg.bgid = buffer_group;
+	if(syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		return false;
+
+	for(uint16_t bid = 0; bid != n_buffers; ++bid)
+		provide(bid);
+	publish_buffers();
+
+	return probe_recv();
+}
+
+inline bool IoUringPoller::probe_recv()
+{
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return false;
+
+	bool ok = false;
+	if(add(sv[0], 0, IN | RECV) && write(sv[1], "p", 1) == 1 && wait(1000) == 1)
+	{
+		auto & ev = m_events.front();
+		ok = (ev.ready & DATA) && ev.size == 1 && m_regs.at(sv[0]).recv_id;
+	}
+
+	remove(sv[0]);
+	close(sv[0]);
+	close(sv[1]);
+	return ok;
+}
+
+inline void IoUringPoller::process_cqe(const io_uring_cqe & cqe)
+{
+	bool more = cqe.flags & IORING_CQE_F_MORE;
+	uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+	bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+
+	if(has_buffer)
+		m_consumed.push_back(bid);
+
+	if(cqe.user_data == internal_id)
+		return;
+
+	auto it_req = m_requests.find(cqe.user_data);
+	if(it_req == m_requests.end())
+		return; // Cancelled request
+
+	auto req = it_req->second;
+	auto sck = req.sck;
+
+	if(!more)
+		m_requests.erase(it_req);
+
+	size_t send_size = req.op == Op::SEND ? release_send(cqe.user_data) : 0;
+
+	auto it_reg = m_regs.find(sck);
+	if(it_reg == m_regs.end() || it_reg->second.serial != req.serial)
+		return; // Late completion of a removed source
+
+	auto & reg = it_reg->second;
+
+	if(req.op == Op::SEND)
+	{
+		if(cqe.user_data == reg.send_id)
+			reg.send_id = 0;
+
+		m_events.push_back({reg.tag, SENT | (cqe.res != int(send_size) ? ERR : 0), nullptr, size_t(std::max(cqe.res, 0))});
+	}
+	else if(req.op == Op::POLL)
+	{
+		if(!more)
+		{
+			reg.poll_id = 0;
+			reg.rearm_poll = true;
+			m_rearm.push_back(sck);
+		}
+
+		if(cqe.res < 0)
+		{
+			if(cqe.res != -ECANCELED)
+				m_events.push_back({reg.tag, ERR});
+			return;
+		}
+
+		m_events.push_back({reg.tag, uint32_t(
+			((cqe.res & POLLIN) ? IN : 0) |
+			((cqe.res & POLLOUT) ? OUT : 0) |
+			((cqe.res & POLLHUP) ? HUP : 0) |
+			((cqe.res & POLLERR) ? ERR : 0))});
+	}
+	else
+	{
+		if(!more && cqe.user_data == reg.recv_id)
+		{
+			reg.recv_id = 0;
+			if(cqe.res != 0) // The end of the stream terminates the receive for good
+			{
+				reg.rearm_recv = true;
+				m_rearm.push_back(sck);
+			}
+		}
+
+		if(cqe.res >= 0)
+		{
+			// 0 : end of stream
+			m_events.push_back({reg.tag, IN | DATA, has_buffer ? buffer(bid) : nullptr, size_t(cqe.res)});
+		}
+		else if(cqe.res != -ENOBUFS && cqe.res != -ECANCELED && cqe.user_data == reg.recv_id)
+		{
+			m_events.push_back({reg.tag, ERR});
+		}
+	}
+}
+
+inline int IoUringPoller::wait(int timeout_ms)
+{
+	m_events.clear();
+
+	// Give back the buffers of the last iteration, and arm the terminated requests again
+	for(auto bid : m_consumed)
+		provide(bid);
+	if(!m_consumed.empty())
+		publish_buffers();
+	m_consumed.clear();
+
+	for(auto sck : m_rearm)
+	{
+		auto it = m_regs.find(sck);
+		if(it == m_regs.end()) continue;
+
+		auto & reg = it->second;
+		if(std::exchange(reg.rearm_poll, false) && !reg.poll_id)
+			arm_poll(sck, reg);
+		if(std::exchange(reg.rearm_recv, false) && !reg.recv_id && wants_recv(reg.interest))
+			arm_recv(sck, reg);
+	}
+	m_rearm.clear();
+
+	publish();
+
+	bool ready = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE) != *m_cq_head;
+
+	__kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+	io_uring_getevents_arg arg{};
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+	int res = enter(pending_submissions(), ready ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if(res < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+		return -1;
+	if(!pending_submissions())
+		m_queued_sends.clear();
+
+	unsigned head = *m_cq_head;
+	unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+	for(; head != tail; ++head)
+		process_cqe(m_cqes[head & m_cq_mask]);
+
+	__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+	return m_events.size();
+}
+
+#endif
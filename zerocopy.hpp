@@ -0,0 +1,155 @@
+#ifndef ZEROCOPY_HPP
+#define ZEROCOPY_HPP
+
+#include "socket.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define RALLONGE_ZEROCOPY
+#endif
+
+#endif
+
+// Buffers sent with MSG_ZEROCOPY on a TCP socket. The kernel reads them after the send returns :
+// they are kept until it reports, on the error queue of the socket, that it is done with them.
+// Without kernel support, buffers are sent with copies.
+class ZeroCopyQueue
+{
+	struct Pending
+	{
+		std::vector<unsigned char> data;
+		uint32_t last; // Id of the last send reading it
+	};
+
+	std::deque<Pending> m_pending; // In send order
+	std::vector<std::vector<unsigned char>> m_free; // Released buffers, reused
+	uint32_t m_next = 0; // Id of the next zero copy send, counted by the kernel for each socket
+
+	enum class State : unsigned char
+	{
+		UNSET,
+		ON,
+		OFF,
+	} m_state = State::UNSET;
+
+public:
+	constexpr static size_t max_pending = 16; // Buffers held by the kernel before sends copy again
+
+	// Send a whole buffer on a blocking socket, taking it and leaving an empty buffer in its place. Returns false on failure.
+	bool send(Socket & sck, std::vector<unsigned char> & buf)
+	{
+#ifdef RALLONGE_ZEROCOPY
+		if(m_state == State::UNSET)
+			m_state = sck.set_zerocopy() ? State::ON : State::OFF;
+
+		if(m_state == State::OFF)
+			return sck.Send_all(buf.data(), buf.size());
+
+		if(!m_pending.empty())
+			reap(sck);
+
+		if(m_pending.size() >= max_pending)
+			return sck.Send_all(buf.data(), buf.size());
+
+		auto pos = buf.data();
+		size_t size = buf.size();
+		bool zero_copy = false; // The kernel holds the buffer
+
+		while(size)
+		{
+			auto res = sck.Send_raw(pos, size, MSG_ZEROCOPY | MSG_NOSIGNAL);
+			if(res < 0)
+			{
+				if(interrupted()) continue;
+				if(errno != ENOBUFS)
+					return false;
+
+				// Out of memory to pin pages : copy the rest
+				if(!sck.Send_all(pos, size))
+					return false;
+				break;
+			}
+
+			m_next++;
+			zero_copy = true;
+			pos += res;
+			size -= res;
+		}
+
+		if(zero_copy)
+		{
+			m_pending.push_back({std::move(buf), m_next - 1});
+
+			if(m_free.empty())
+				buf = {};
+			else
+			{
+				buf = std::move(m_free.back());
+				m_free.pop_back();
+			}
+		}
+		buf.clear();
+		return true;
+#else
+		bool res = sck.Send_all(buf.data(), buf.size());
+		buf.clear();
+		return res;
+#endif
+	}
+
+	// Release the buffers the kernel is done with. Returns true if completions were read from the error queue.
+	bool reap([[maybe_unused]] Socket & sck)
+	{
+#ifdef RALLONGE_ZEROCOPY
+		if(m_state != State::ON)
+			return false;
+
+		bool reaped = false;
+
+		for(;;)
+		{
+			alignas(cmsghdr) char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+			msghdr msg = {};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			if(recvmsg(sck.socket(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			{
+				if(interrupted()) continue;
+				return reaped;
+			}
+
+			for(auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+			{
+				if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+					continue;
+
+				sock_extended_err err;
+				memcpy(&err, CMSG_DATA(cm), sizeof(err));
+				if(err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+					continue;
+
+				reaped = true;
+
+				// Sends ee_info to ee_data completed. TCP completes them in order.
+				while(!m_pending.empty() && int32_t(m_pending.front().last - err.ee_data) <= 0)
+				{
+					if(m_free.size() < max_pending)
+						m_free.push_back(std::move(m_pending.front().data));
+					m_pending.pop_front();
+				}
+			}
+		}
+#else
+		return false;
+#endif
+	}
+};
+
+#endif